@@ -0,0 +1,391 @@
+// Microbenchmarks of the render and encode hot paths, on the host.
+//
+// ./bench [results.csv]
+//
+// Each benchmark is timed over REPEATS runs of enough iterations to last RUN_NS. The table gives the
+// median ns/pixel, its standard deviation over the runs and the median pixels/s. The CSV file has one
+// row per benchmark with the same columns, to diff between commits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "lib/defines.h"
+#include "lib/utils.h"
+#include "lib/encoder.h"
+#include "lib/geometry.h"
+
+#define REPEATS 15
+#define RUN_NS 2000000
+// Every benchmark raster is kept, the largest covers the whole frame
+#define BENCH_RASTER_POOL_BYTES (2 * 1024 * 1024)
+
+void show_pixels()
+{
+    // stub, no DMA so the buffers are swapped straight away
+    encode_stats_end_frame();
+    swap_buffers();
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+typedef void (*bench_fn_t)(int raster_id);
+
+// Results of one benchmark, all in ns per pixel
+typedef struct
+{
+    double median;
+    double mean;
+    double stddev;
+    double min;
+} bench_result_t;
+
+static volatile uint32_t sink;
+static FILE *csv;
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Time fn on raster_id, which handles pixels pixels per call
+static bench_result_t run_bench(bench_fn_t fn, int raster_id, uint32_t pixels)
+{
+    // Warm up, and size the runs
+    uint64_t start = now_ns();
+    fn(raster_id);
+    uint64_t once = now_ns() - start;
+    uint32_t iterations = once ? RUN_NS / once : RUN_NS;
+    if (iterations == 0)
+        iterations = 1;
+
+    double ns_per_pixel[REPEATS];
+    for (int r = 0; r < REPEATS; r++)
+    {
+        start = now_ns();
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            fn(raster_id);
+        }
+        ns_per_pixel[r] = (double)(now_ns() - start) / ((double)iterations * pixels);
+    }
+
+    bench_result_t result = {0};
+    for (int r = 0; r < REPEATS; r++)
+    {
+        result.mean += ns_per_pixel[r];
+    }
+    result.mean /= REPEATS;
+    for (int r = 0; r < REPEATS; r++)
+    {
+        result.stddev += (ns_per_pixel[r] - result.mean) * (ns_per_pixel[r] - result.mean);
+    }
+    result.stddev = sqrt(result.stddev / (REPEATS - 1));
+    qsort(ns_per_pixel, REPEATS, sizeof(double), compare_double);
+    result.median = ns_per_pixel[REPEATS / 2];
+    result.min = ns_per_pixel[0];
+    return result;
+}
+
+static void report(const char *name, const char *encode, uint height, uint width, const char *wrap, bench_result_t result)
+{
+    printf("%-30s %-10s %4ux%-4u %-8s %10.2f %8.2f %12.0f\n", name, encode, height, width, wrap,
+           result.median, result.stddev, 1e9 / result.median);
+    if (csv)
+    {
+        fprintf(csv, "%s,%s,%u,%u,%s,%.3f,%.3f,%.3f,%.3f,%.0f\n", name, encode, height, width, wrap,
+                result.median, result.mean, result.stddev, result.min, 1e9 / result.median);
+    }
+}
+
+// Every mapped pixel of the raster through put_pixel
+static void bench_put_pixel(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (uint32_t i = 0; i < (uint32_t)raster->height * raster->width; i++)
+    {
+        pixel_address_t address = raster->mapping[i];
+        put_pixel(address.board, address.strip, address.pixel, raster->pixels[i]);
+    }
+}
+
+static void bench_show_raster_object(int raster_id)
+{
+    show_raster_object(raster_id);
+}
+
+static void bench_show_raster_object_with_shift(int raster_id)
+{
+    show_raster_object_with_shift(raster_id, 0.3f, 0.7f);
+}
+
+static void bench_fade_raster(int raster_id)
+{
+    fade_raster(raster_id, 250);
+}
+
+static void bench_rainbow(int raster_id)
+{
+    rainbow(raster_id);
+}
+
+static void bench_init_rainbow(int raster_id)
+{
+    init_rainbow(raster_id);
+}
+
+// The float path init_rainbow used to take, hsl_to_rgb for every pixel
+static void bench_init_rainbow_float(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (uint i = 0; i < raster->height; i++)
+    {
+        for (uint j = 0; j < raster->width; j++)
+        {
+            float h = (float)j / raster->width + (float)i / raster->height;
+            if (h > 1)
+                h -= 1;
+            raster_set(raster, j, i, hsl_to_rgb(h, 1.0f, 0.5f));
+        }
+    }
+    mark_raster_all_dirty(raster_id);
+}
+
+static uint16_t rainbow_phase;
+
+static void bench_draw_rainbow(int raster_id)
+{
+    draw_rainbow(raster_id, rainbow_phase += 256);
+}
+
+static void bench_fill_raster(int raster_id)
+{
+    fill_raster(raster_id, 0x123456);
+}
+
+// Writing every pixel of a raster, from the API call per pixel down to a flat store through a handle
+static void bench_draw_pixel(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (int i = 0; i < raster->height; i++)
+        for (int j = 0; j < raster->width; j++)
+            draw_pixel(raster_id, j, i, i + j);
+}
+
+// What draw_pixel used to do per pixel: copy the raster out by id, then go through the row pointers
+static void bench_get_raster_per_pixel(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (int i = 0; i < raster->height; i++)
+    {
+        for (int j = 0; j < raster->width; j++)
+        {
+            raster_object_t ro = get_raster(raster_id);
+            ro.raster[i][j] = i + j;
+        }
+    }
+}
+
+static void bench_row_pointers(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (int i = 0; i < raster->height; i++)
+        for (int j = 0; j < raster->width; j++)
+            raster->raster[i][j] = i + j;
+}
+
+static void bench_raster_set(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (int i = 0; i < raster->height; i++)
+        for (int j = 0; j < raster->width; j++)
+            raster_set(raster, j, i, i + j);
+}
+
+static void bench_raster_row(int raster_id)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    for (int i = 0; i < raster->height; i++)
+    {
+        uint32_t *row = raster_row(raster, i);
+        for (int j = 0; j < raster->width; j++)
+            row[j] = i + j;
+    }
+}
+
+#define COLOR_COUNT 1024
+
+static uint32_t colors_a[COLOR_COUNT];
+static uint32_t colors_b[COLOR_COUNT];
+
+static void bench_hsl_to_rgb(int unused)
+{
+    (void)unused;
+    uint32_t acc = 0;
+    for (int i = 0; i < COLOR_COUNT; i++)
+    {
+        acc ^= hsl_to_rgb((float)i / COLOR_COUNT, 1.0f, 0.5f);
+    }
+    sink = acc;
+}
+
+static uint32_t gradient_colors[COLOR_COUNT];
+static gradient_t gradient = {gradient_colors, 10};
+
+static void bench_gradient_color(int unused)
+{
+    (void)unused;
+    uint32_t acc = 0;
+    for (int i = 0; i < COLOR_COUNT; i++)
+    {
+        acc ^= gradient_color(&gradient, i * (0x10000 / COLOR_COUNT));
+    }
+    sink = acc;
+}
+
+static void bench_gradient_hsv(int unused)
+{
+    (void)unused;
+    gradient_hsv(&gradient, 255, 255);
+}
+
+static void bench_gradient_hsl(int unused)
+{
+    (void)unused;
+    gradient_hsl(&gradient, 1.0f, 0.5f);
+}
+
+static void bench_mix_rgb(int unused)
+{
+    (void)unused;
+    uint32_t acc = 0;
+    for (int i = 0; i < COLOR_COUNT; i++)
+    {
+        acc ^= mix_rgb(colors_a[i], colors_b[i], 0.5f);
+    }
+    sink = acc;
+}
+
+typedef struct
+{
+    uint16_t height;
+    uint16_t width;
+} bench_size_t;
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        csv = fopen(argv[1], "w");
+        if (csv == NULL)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+        fprintf(csv, "benchmark,encode,height,width,wrap,ns_per_pixel,mean_ns_per_pixel,stddev_ns_per_pixel,min_ns_per_pixel,pixels_per_s\n");
+    }
+
+    geometry_t g;
+    default_geometry(&g);
+    if (init_geometry(&g, MAX_RASTER_OBJECTS, BENCH_RASTER_POOL_BYTES) != 0)
+        return 1;
+
+    // One strip, a quarter board, one board and the whole frame
+    const bench_size_t sizes[] = {{1, NUM_PIXELS}, {STRIPS, NUM_PIXELS / 4}, {STRIPS, NUM_PIXELS}, {STRIPS * BOARDS, NUM_PIXELS}};
+    const WrapMode wraps[] = {CLIP, NO_WRAP, WRAP};
+    const char *wrap_names[] = {"clip", "no_wrap", "wrap"};
+    const EncodeMode encodes[] = {ENCODE_PUT_PIXEL, ENCODE_TRANSPOSE};
+    const char *encode_names[] = {"put_pixel", "transpose"};
+    const uint size_count = sizeof(sizes) / sizeof(sizes[0]);
+    const uint wrap_count = sizeof(wraps) / sizeof(wraps[0]);
+
+    int rasters[sizeof(sizes) / sizeof(sizes[0])][sizeof(wraps) / sizeof(wraps[0])];
+    srand(12);
+    for (uint s = 0; s < size_count; s++)
+    {
+        for (uint w = 0; w < wrap_count; w++)
+        {
+            rasters[s][w] = create_raster(sizes[s].height, sizes[s].width, 0, 0, 0, wraps[w]);
+            raster_object_t *raster = get_raster_handle(rasters[s][w]);
+            for (uint32_t i = 0; i < (uint32_t)raster->height * raster->width; i++)
+                raster->pixels[i] = rand() & 0xffffff;
+        }
+    }
+    for (int i = 0; i < COLOR_COUNT; i++)
+    {
+        colors_a[i] = rand() & 0xffffff;
+        colors_b[i] = rand() & 0xffffff;
+    }
+
+    printf("\n%-30s %-10s %9s %-8s %10s %8s %12s\n", "benchmark", "encode", "size", "wrap", "ns/pixel", "stddev", "pixels/s");
+    for (uint s = 0; s < size_count; s++)
+    {
+        for (uint w = 0; w < wrap_count; w++)
+        {
+            int id = rasters[s][w];
+            uint height = sizes[s].height;
+            uint width = sizes[s].width;
+            uint32_t pixels = height * width;
+            const char *wrap = wrap_names[w];
+
+            // Encoding depends on the mapping, and so on the wrap mode
+            report("put_pixel", "-", height, width, wrap, run_bench(bench_put_pixel, id, pixels));
+            for (uint e = 0; e < 2; e++)
+            {
+                set_encode_mode(encodes[e]);
+                report("show_raster_object", encode_names[e], height, width, wrap, run_bench(bench_show_raster_object, id, pixels));
+                report("show_raster_object_with_shift", encode_names[e], height, width, wrap, run_bench(bench_show_raster_object_with_shift, id, pixels));
+            }
+            set_encode_mode(ENCODE_PUT_PIXEL);
+            // Each frame is swapped out, or the written ranges of the double buffers would only grow
+            show_pixels();
+            if (wraps[w] != CLIP)
+                continue;
+
+            // The effects only touch the raster's pixels, the mapping doesn't matter
+            report("fade_raster", "-", height, width, "-", run_bench(bench_fade_raster, id, pixels));
+            report("rainbow", "-", height, width, "-", run_bench(bench_rainbow, id, pixels));
+            report("init_rainbow", "-", height, width, "-", run_bench(bench_init_rainbow, id, pixels));
+            report("init_rainbow_float", "-", height, width, "-", run_bench(bench_init_rainbow_float, id, pixels));
+            report("draw_rainbow", "-", height, width, "-", run_bench(bench_draw_rainbow, id, pixels));
+            report("fill_raster", "-", height, width, "-", run_bench(bench_fill_raster, id, pixels));
+            report("draw_pixel", "-", height, width, "-", run_bench(bench_draw_pixel, id, pixels));
+            report("get_raster_per_pixel", "-", height, width, "-", run_bench(bench_get_raster_per_pixel, id, pixels));
+            report("row_pointers", "-", height, width, "-", run_bench(bench_row_pointers, id, pixels));
+            report("raster_set", "-", height, width, "-", run_bench(bench_raster_set, id, pixels));
+            report("raster_row", "-", height, width, "-", run_bench(bench_raster_row, id, pixels));
+        }
+    }
+    // One board from each pixel format, the encoder expands them as it goes
+    const RasterFormat formats[] = {RASTER_RGB888, RASTER_PALETTE8, RASTER_RGB565};
+    const char *format_names[] = {"show_raster_object_rgb888", "show_raster_object_palette8", "show_raster_object_rgb565"};
+    set_encode_mode(ENCODE_TRANSPOSE);
+    for (uint f = 0; f < sizeof(formats) / sizeof(formats[0]); f++)
+    {
+        int id = create_raster_format(STRIPS, NUM_PIXELS, 0, 0, 0, CLIP, formats[f]);
+        for (int i = 0; i < STRIPS; i++)
+            for (int j = 0; j < NUM_PIXELS; j++)
+                draw_pixel(id, j, i, formats[f] == RASTER_PALETTE8 ? rand() & 0xff : rand() & 0xffffff);
+        report(format_names[f], "transpose", STRIPS, NUM_PIXELS, "clip", run_bench(bench_show_raster_object, id, STRIPS * NUM_PIXELS));
+        show_pixels();
+    }
+    set_encode_mode(ENCODE_PUT_PIXEL);
+
+    report("hsl_to_rgb", "-", 1, COLOR_COUNT, "-", run_bench(bench_hsl_to_rgb, 0, COLOR_COUNT));
+    report("gradient_hsv", "-", 1, COLOR_COUNT, "-", run_bench(bench_gradient_hsv, 0, COLOR_COUNT));
+    report("gradient_hsl", "-", 1, COLOR_COUNT, "-", run_bench(bench_gradient_hsl, 0, COLOR_COUNT));
+    report("gradient_color", "-", 1, COLOR_COUNT, "-", run_bench(bench_gradient_color, 0, COLOR_COUNT));
+    report("mix_rgb", "-", 1, COLOR_COUNT, "-", run_bench(bench_mix_rgb, 0, COLOR_COUNT));
+
+    if (csv)
+        fclose(csv);
+    return 0;
+}
@@ -68,8 +68,8 @@ static inline void ws2812_program_init(PIO pio, uint sm, uint offset, uint pin,
 // ws2812_parallel //
 // --------------- //
 
-#define ws2812_parallel_wrap_target 3
-#define ws2812_parallel_wrap 6
+#define ws2812_parallel_wrap_target 0
+#define ws2812_parallel_wrap 3
 #define ws2812_parallel_pio_version 0
 
 #define ws2812_parallel_T1 3
@@ -77,21 +77,18 @@ static inline void ws2812_program_init(PIO pio, uint sm, uint offset, uint pin,
 #define ws2812_parallel_T3 4
 
 static const uint16_t ws2812_parallel_program_instructions[] = {
-    0x6024, //  0: out    x, 4                       
-    0x605c, //  1: out    y, 28                      
-    0xb401, //  2: mov    pins, x                [20]
             //     .wrap_target
-    0x6020, //  3: out    x, 32                      
-    0xa20b, //  4: mov    pins, !null            [2] 
-    0xa201, //  5: mov    pins, x                [2] 
-    0xa203, //  6: mov    pins, null             [2] 
+    0x6020, //  0: out    x, 32                      
+    0xa20b, //  1: mov    pins, !null            [2] 
+    0xa201, //  2: mov    pins, x                [2] 
+    0xa203, //  3: mov    pins, null             [2] 
             //     .wrap
 };
 
 #if !PICO_NO_HARDWARE
 static const struct pio_program ws2812_parallel_program = {
     .instructions = ws2812_parallel_program_instructions,
-    .length = 7,
+    .length = 4,
     .origin = -1,
     .pio_version = ws2812_parallel_pio_version,
 #if PICO_PIO_VERSION > 0
@@ -104,25 +101,170 @@ static inline pio_sm_config ws2812_parallel_program_get_default_config(uint offs
     sm_config_set_wrap(&c, offset + ws2812_parallel_wrap_target, offset + ws2812_parallel_wrap);
     return c;
 }
+#endif
 
-#include "hardware/clocks.h"
-static inline void ws2812_parallel_program_init(PIO pio, uint sm, uint offset, uint pin_base, uint pin_count, float freq) {
-    for(uint i=pin_base; i<pin_base+pin_count; i++) {
-        pio_gpio_init(pio, i);
-    }
-    pio_sm_set_consecutive_pindirs(pio, sm, pin_base, pin_count, true);
-    pio_sm_config c = ws2812_parallel_program_get_default_config(offset);
-    sm_config_set_out_shift(&c, true, true, 32);
-    sm_config_set_out_pins(&c, pin_base, pin_count);
-    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
-    int cycles_per_bit = ws2812_parallel_T1 + ws2812_parallel_T2 + ws2812_parallel_T3;
-    float div = clock_get_hz(clk_sys) / (freq * cycles_per_bit);
-    sm_config_set_clkdiv(&c, div);
-    printf("div %d ", div);
-    //sm_config_set_clkdiv(&c,1.5d);
-    pio_sm_init(pio, sm, offset, &c);
-    pio_sm_set_enabled(pio, sm, true);
+// ---------------------- //
+// ws2812_parallel_packed //
+// ---------------------- //
+
+#define ws2812_parallel_packed_wrap_target 0
+#define ws2812_parallel_packed_wrap 3
+#define ws2812_parallel_packed_pio_version 0
+
+#define ws2812_parallel_packed_T1 3
+#define ws2812_parallel_packed_T2 3
+#define ws2812_parallel_packed_T3 4
+
+static const uint16_t ws2812_parallel_packed_program_instructions[] = {
+            //     .wrap_target
+    0x6030, //  0: out    x, 16                      
+    0xa20b, //  1: mov    pins, !null            [2] 
+    0xa201, //  2: mov    pins, x                [2] 
+    0xa203, //  3: mov    pins, null             [2] 
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program ws2812_parallel_packed_program = {
+    .instructions = ws2812_parallel_packed_program_instructions,
+    .length = 4,
+    .origin = -1,
+    .pio_version = ws2812_parallel_packed_pio_version,
+#if PICO_PIO_VERSION > 0
+    .used_gpio_ranges = 0x0
+#endif
+};
+
+static inline pio_sm_config ws2812_parallel_packed_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + ws2812_parallel_packed_wrap_target, offset + ws2812_parallel_packed_wrap);
+    return c;
+}
+#endif
+
+// ----------------------- //
+// ws2812_parallel_chained //
+// ----------------------- //
+
+#define ws2812_parallel_chained_wrap_target 0
+#define ws2812_parallel_chained_wrap 10
+#define ws2812_parallel_chained_pio_version 0
+
+#define ws2812_parallel_chained_T1 3
+#define ws2812_parallel_chained_T2 3
+#define ws2812_parallel_chained_T3 4
+
+static const uint16_t ws2812_parallel_chained_program_instructions[] = {
+            //     .wrap_target
+    0x20c4, //  0: wait   1 irq, 4                   
+    0x6040, //  1: out    y, 32                      
+    0x6061, //  2: out    null, 1                    
+    0x603f, //  3: out    x, 31                      
+    0xa20b, //  4: mov    pins, !null            [2] 
+    0xa201, //  5: mov    pins, x                [2] 
+    0xa003, //  6: mov    pins, null                 
+    0x0082, //  7: jmp    y--, 2                     
+    0x6040, //  8: out    y, 32                      
+    0x0989, //  9: jmp    y--, 9                 [9] 
+    0xc005, // 10: irq    nowait 5                   
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program ws2812_parallel_chained_program = {
+    .instructions = ws2812_parallel_chained_program_instructions,
+    .length = 11,
+    .origin = -1,
+    .pio_version = ws2812_parallel_chained_pio_version,
+#if PICO_PIO_VERSION > 0
+    .used_gpio_ranges = 0x0
+#endif
+};
+
+static inline pio_sm_config ws2812_parallel_chained_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + ws2812_parallel_chained_wrap_target, offset + ws2812_parallel_chained_wrap);
+    return c;
 }
+#endif
+
+// ------------------------------ //
+// ws2812_parallel_chained_packed //
+// ------------------------------ //
+
+#define ws2812_parallel_chained_packed_wrap_target 0
+#define ws2812_parallel_chained_packed_wrap 10
+#define ws2812_parallel_chained_packed_pio_version 0
+
+#define ws2812_parallel_chained_packed_T1 3
+#define ws2812_parallel_chained_packed_T2 3
+#define ws2812_parallel_chained_packed_T3 4
+
+static const uint16_t ws2812_parallel_chained_packed_program_instructions[] = {
+            //     .wrap_target
+    0x20c4, //  0: wait   1 irq, 4                   
+    0x6040, //  1: out    y, 32                      
+    0x6030, //  2: out    x, 16                      
+    0xa042, //  3: nop                               
+    0xa20b, //  4: mov    pins, !null            [2] 
+    0xa201, //  5: mov    pins, x                [2] 
+    0xa003, //  6: mov    pins, null                 
+    0x0082, //  7: jmp    y--, 2                     
+    0x6040, //  8: out    y, 32                      
+    0x0989, //  9: jmp    y--, 9                 [9] 
+    0xc005, // 10: irq    nowait 5                   
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program ws2812_parallel_chained_packed_program = {
+    .instructions = ws2812_parallel_chained_packed_program_instructions,
+    .length = 11,
+    .origin = -1,
+    .pio_version = ws2812_parallel_chained_packed_pio_version,
+#if PICO_PIO_VERSION > 0
+    .used_gpio_ranges = 0x0
+#endif
+};
 
+static inline pio_sm_config ws2812_parallel_chained_packed_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + ws2812_parallel_chained_packed_wrap_target, offset + ws2812_parallel_chained_packed_wrap);
+    return c;
+}
+#endif
+
+// ------------ //
+// board_select //
+// ------------ //
+
+#define board_select_wrap_target 0
+#define board_select_wrap 2
+#define board_select_pio_version 0
+
+static const uint16_t board_select_program_instructions[] = {
+            //     .wrap_target
+    0x6004, //  0: out    pins, 4                    
+    0xc004, //  1: irq    nowait 4                   
+    0x20c5, //  2: wait   1 irq, 5                   
+            //     .wrap
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program board_select_program = {
+    .instructions = board_select_program_instructions,
+    .length = 3,
+    .origin = -1,
+    .pio_version = board_select_pio_version,
+#if PICO_PIO_VERSION > 0
+    .used_gpio_ranges = 0x0
+#endif
+};
+
+static inline pio_sm_config board_select_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + board_select_wrap_target, offset + board_select_wrap);
+    return c;
+}
 #endif
 
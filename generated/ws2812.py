@@ -35,14 +35,100 @@ ws2812_parallel_T3 = 4
 
 @rp2.asm_pio()
 def ws2812_parallel():
-    out(x, 4)                             # 0
-    out(y, 28)                            # 1
-    mov(pins, x)                     [20] # 2
     wrap_target()
-    out(x, 32)                            # 3
+    out(x, 32)                            # 0
+    mov(pins, invert(null))          [2]  # 1
+    mov(pins, x)                     [2]  # 2
+    mov(pins, null)                  [2]  # 3
+    wrap()
+
+
+
+# ---------------------- #
+# ws2812_parallel_packed #
+# ---------------------- #
+
+ws2812_parallel_packed_T1 = 3
+ws2812_parallel_packed_T2 = 3
+ws2812_parallel_packed_T3 = 4
+
+@rp2.asm_pio()
+def ws2812_parallel_packed():
+    wrap_target()
+    out(x, 16)                            # 0
+    mov(pins, invert(null))          [2]  # 1
+    mov(pins, x)                     [2]  # 2
+    mov(pins, null)                  [2]  # 3
+    wrap()
+
+
+
+# ----------------------- #
+# ws2812_parallel_chained #
+# ----------------------- #
+
+ws2812_parallel_chained_T1 = 3
+ws2812_parallel_chained_T2 = 3
+ws2812_parallel_chained_T3 = 4
+
+@rp2.asm_pio()
+def ws2812_parallel_chained():
+    wrap_target()
+    wait(1, irq, 4)                       # 0
+    out(y, 32)                            # 1
+    label("2")
+    out(null, 1)                          # 2
+    out(x, 31)                            # 3
     mov(pins, invert(null))          [2]  # 4
     mov(pins, x)                     [2]  # 5
-    mov(pins, null)                  [2]  # 6
+    mov(pins, null)                       # 6
+    jmp(y_dec, "2")                       # 7
+    out(y, 32)                            # 8
+    label("9")
+    jmp(y_dec, "9")                  [9]  # 9
+    irq(5)                                # 10
+    wrap()
+
+
+
+# ------------------------------ #
+# ws2812_parallel_chained_packed #
+# ------------------------------ #
+
+ws2812_parallel_chained_packed_T1 = 3
+ws2812_parallel_chained_packed_T2 = 3
+ws2812_parallel_chained_packed_T3 = 4
+
+@rp2.asm_pio()
+def ws2812_parallel_chained_packed():
+    wrap_target()
+    wait(1, irq, 4)                       # 0
+    out(y, 32)                            # 1
+    label("2")
+    out(x, 16)                            # 2
+    nop()                                 # 3
+    mov(pins, invert(null))          [2]  # 4
+    mov(pins, x)                     [2]  # 5
+    mov(pins, null)                       # 6
+    jmp(y_dec, "2")                       # 7
+    out(y, 32)                            # 8
+    label("9")
+    jmp(y_dec, "9")                  [9]  # 9
+    irq(5)                                # 10
+    wrap()
+
+
+
+# ------------ #
+# board_select #
+# ------------ #
+
+@rp2.asm_pio()
+def board_select():
+    wrap_target()
+    out(pins, 4)                          # 0
+    irq(4)                                # 1
+    wait(1, irq, 5)                       # 2
     wrap()
 
 
@@ -2,13 +2,33 @@
 #define DEFINES_H
 #define NUM_PIXELS 100
 #define STRIPS 16
+// Build with STREAMING_OUTPUT=1 to encode each board just before it is sent, into one of two board
+// sized plane buffers, instead of double buffering the whole frame
+#ifndef STREAMING_OUTPUT
+#define STREAMING_OUTPUT 0
+#endif
+#ifndef BOARDS
+#if STREAMING_OUTPUT
+#define BOARDS 16
+#else
 #define BOARDS 10
+#endif
+#endif
+// Raster table size and raster pool bytes the examples pass to init_geometry. The pool holds the examples' two
+// 16x100 RGB888 rasters, 19 KB each with their plans. With the default geometry the arena comes to about 240 KB
+// of the RP2040's 264 KB with 32 bit planes, 146 KB with PACKED_PLANES.
 #define MAX_RASTER_OBJECTS 100
+#define RASTER_POOL_BYTES (38 * 1024)
 #ifdef LOCAL_BUILD
 typedef unsigned int uint32_t;
 typedef unsigned int uint;
 typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #endif
 #ifndef LOCAL_BUILD
 #include "hardware/pio.h"
@@ -38,12 +58,58 @@ typedef enum
     NO_WRAP = 1,
     WRAP = 2,
 } WrapMode;
+
+// How a raster stores its pixels. The encoder expands them to 24 bit color as it writes the bit planes.
+typedef enum
+{
+    // 0xRRGGBB in a uint32_t
+    RASTER_RGB888 = 0,
+    // An index into the raster's 256 entry palette of 0xRRGGBB colors
+    RASTER_PALETTE8 = 1,
+    // 5 bits red, 6 green, 5 blue in a uint16_t
+    RASTER_RGB565 = 2,
+} RasterFormat;
+
+// How raster pixels are written into the bit planes
+typedef enum
+{
+    // Read-modify-write the 24 plane words of every pixel
+    ENCODE_PUT_PIXEL = 0,
+    // Gather all strips of a pixel index and bit-transpose them into the 24 plane words at once
+    ENCODE_TRANSPOSE = 1,
+} EncodeMode;
+
+// How the buffer encoded into next is brought up to date when the double buffers are swapped
+typedef enum
+{
+    // Copy the whole frame into the next buffer
+    BUFFER_COPY_FULL = 0,
+    // Copy only the pixel ranges of each board written since the last swap
+    BUFFER_COPY_WRITTEN = 1,
+    // Copy nothing, the renderer rewrites everything it shows every frame
+    BUFFER_COPY_NONE = 2,
+} BufferCopyMode;
+// Build with PACKED_PLANES=1 to store each bit plane in 16 bits instead of 32, halving the plane
+// buffers and the DMA traffic. Only possible with up to 16 strips.
+#ifndef PACKED_PLANES
+#define PACKED_PLANES 0
+#endif
+#if PACKED_PLANES
+#if STRIPS > 16
+#error PACKED_PLANES holds at most 16 strips
+#endif
+typedef uint16_t plane_word_t;
+#else
+typedef uint32_t plane_word_t;
+#endif
 #define VALUE_PLANE_COUNT (8)
 typedef struct
 {
     // stored MSB first
-    uint32_t planes[VALUE_PLANE_COUNT];
+    plane_word_t planes[VALUE_PLANE_COUNT];
 } value_bits_t;
+// 32 bit words the DMA moves for one value_bits_t
+#define VALUE_WORD_COUNT (sizeof(value_bits_t) / sizeof(uint32_t))
 
 typedef struct
 {
@@ -52,18 +118,102 @@ typedef struct
     uint8_t pixel;
 } pixel_address_t;
 
+// One pixel index of one board that a raster writes to
+typedef struct
+{
+    uint16_t board;
+    uint16_t plane_offset; // index of the pixel's red value_bits_t in the board's planes (pixel * 3)
+    uint32_t strip_mask;   // bit n set for every strip n the raster maps at this pixel index
+    uint32_t first_source; // index of the first source of this column in encode_plan_t.sources
+} encode_column_t;
+
+// Raster pixel that feeds one strip of an encode column
+typedef struct
+{
+    uint16_t x;
+    uint16_t y;
+} encode_source_t;
+
+// Precompiled pixel_mapping: columns sorted by board and pixel index so the bit planes are written
+// sequentially, with one source per strip of each column, lowest strip first.
+typedef struct
+{
+    uint32_t column_count;
+    uint32_t source_count;
+    encode_column_t *columns;
+    encode_source_t *sources;
+    // columns board_start[b]..board_start[b + 1] - 1 are on board b
+    uint32_t board_start[BOARDS + 1];
+} encode_plan_t;
+
 typedef struct
 {
     uint16_t height;
     uint16_t width;
+    uint8_t format; // RasterFormat
+    // Row major, pixel x, y is pixels[y * width + x] and its address mapping[y * width + x].
+    // Only the pixel array of the raster's format is set, the others are NULL.
+    uint32_t *pixels;
+    uint8_t *indices;
+    uint16_t *pixels565;
+    // RASTER_PALETTE8 colors, 256 of them
+    uint32_t *palette;
+    pixel_address_t *mapping;
+    // Row pointers into pixels and mapping, for code written against raster[y][x]. raster is only set
+    // for RASTER_RGB888.
     uint32_t **raster;
     pixel_address_t **pixel_mapping;
+    encode_plan_t plan;
+    // Pixels changed since the raster was last shown: columns dirty_x0[y]..dirty_x1[y] of rows dirty_y0..dirty_y1.
+    // A row (or the raster) is clean when its start is greater than its end.
+    uint16_t *dirty_x0;
+    uint16_t *dirty_x1;
+    uint16_t dirty_y0;
+    uint16_t dirty_y1;
+    // Where create_raster mapped it from, for resize_raster
+    uint8_t board;
+    uint8_t strip;
+    uint8_t pixel;
+    uint8_t wrap;
+    // The raster's block of the raster pool, which raster, pixel_mapping, the dirty ranges and the plan point into.
+    // NULL when the raster has been destroyed, or was never created.
+    uint8_t *storage;
+    uint32_t storage_bytes;
 } raster_object_t;
-extern value_bits_t colors[NUM_PIXELS * 3];
 
-// double buffer the state of the pixel strip, since we update next version in parallel with DMAing out old version
-extern value_bits_t buffers[2][BOARDS][NUM_PIXELS * 3];
-extern raster_object_t *raster_object[100];
+#if STREAMING_OUTPUT
+// Boards take turns in two buffers of one board each
+#define PLANE_BUFFER_BOARDS 1
+#else
+#define PLANE_BUFFER_BOARDS BOARDS
+#endif
+// double buffer the state of the pixel strip, since we update next version in parallel with DMAing out old version.
+// Carved from the arena by init_geometry, each buffer holds its boards back to back, each only as long as its
+// longest strip.
+extern value_bits_t *board_planes[2][PLANE_BUFFER_BOARDS];
+// value_bits_t in each buffer
+extern uint32_t buffer_values;
+// The raster table, max_raster_objects long, also carved from the arena
+extern raster_object_t *raster_object;
+extern uint max_raster_objects;
+// Ids of destroyed rasters, the next create_raster takes the last one
+extern uint16_t *free_raster_ids;
+extern uint free_raster_id_count;
+// A raster shown since the last show_pixels
+typedef struct
+{
+    int raster_id;
+    bool shifted;
+    float shift_x;
+    float shift_y;
+} frame_show_t;
+// Rasters shown since the last show_pixels, encoded a board at a time as the frame is sent. Carved from the
+// arena, max_raster_objects long.
+extern frame_show_t *frame_shows;
+// Raster storage, raster_pool_bytes from the arena, the first raster_pool_used of it in use
+extern uint8_t *raster_pool;
+extern uint32_t raster_pool_bytes;
+extern uint32_t raster_pool_used;
 extern uint current_buffer;
 
 #endif // DEFINES_H
\ No newline at end of file
@@ -0,0 +1,397 @@
+#include "defines.h"
+#include "encoder.h"
+#include "hal.h"
+#include "geometry.h"
+
+static EncodeMode encode_mode = ENCODE_PUT_PIXEL;
+static BufferCopyMode buffer_copy_mode = BUFFER_COPY_FULL;
+static encode_stats_t encode_stats;
+
+// value_bits_t range of each board written in the current buffer since the last swap, empty when start >= end
+static uint16_t written_start[BOARDS];
+static uint16_t written_end[BOARDS];
+
+static inline void track_written(uint board, uint plane_offset, uint count)
+{
+    if (written_start[board] >= written_end[board])
+    {
+        written_start[board] = plane_offset;
+        written_end[board] = plane_offset + count;
+        return;
+    }
+    if (plane_offset < written_start[board])
+    {
+        written_start[board] = plane_offset;
+    }
+    if (plane_offset + count > written_end[board])
+    {
+        written_end[board] = plane_offset + count;
+    }
+}
+
+void mark_planes_written(uint board, uint plane_offset, uint count)
+{
+    track_written(board, plane_offset, count);
+}
+
+void clear_planes_written()
+{
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        written_start[board] = 0;
+        written_end[board] = 0;
+    }
+}
+
+void set_buffer_copy_mode(BufferCopyMode mode)
+{
+    buffer_copy_mode = mode;
+}
+
+BufferCopyMode get_buffer_copy_mode()
+{
+    return buffer_copy_mode;
+}
+
+uint32_t changed_boards(uint16_t *send_values)
+{
+    uint32_t boards = 0;
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        const value_bits_t *current = plane_buffer(current_buffer, board);
+        const value_bits_t *previous = plane_buffer(current_buffer ^ 1, board);
+        uint end = 0;
+        // Last changed pixel, from the end of the pixels the written range touches
+        uint first_pixel = written_start[board] / 3;
+        for (uint pixel = (written_end[board] + 2) / 3; pixel > first_pixel && written_start[board] < written_end[board]; pixel--)
+        {
+            if (memcmp(&current[(pixel - 1) * 3], &previous[(pixel - 1) * 3], 3 * sizeof(value_bits_t)) != 0)
+            {
+                end = pixel * 3;
+                break;
+            }
+        }
+        if (end)
+            boards |= 1u << board;
+        if (send_values)
+            send_values[board] = end;
+    }
+    return boards;
+}
+
+uint32_t swap_buffers()
+{
+    uint next_buffer = current_buffer ^ 1;
+    uint32_t copied = 0;
+
+    switch (buffer_copy_mode)
+    {
+    case BUFFER_COPY_FULL:
+        memcpy(board_planes[next_buffer][0], board_planes[current_buffer][0], buffer_values * sizeof(value_bits_t));
+        copied = buffer_values * sizeof(value_bits_t);
+        break;
+    case BUFFER_COPY_WRITTEN:
+        // The next buffer matched this one at the last swap, so only what was written since differs
+        for (uint board = 0; board < BOARDS; board++)
+        {
+            if (written_start[board] < written_end[board])
+            {
+                uint32_t bytes = (written_end[board] - written_start[board]) * sizeof(value_bits_t);
+                memcpy(&plane_buffer(next_buffer, board)[written_start[board]], &plane_buffer(current_buffer, board)[written_start[board]], bytes);
+                copied += bytes;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    clear_planes_written();
+    current_buffer = next_buffer;
+    encode_stats.last_swap_bytes_copied = copied;
+    encode_stats.total_bytes_copied += copied;
+    return copied;
+}
+
+void set_encode_mode(EncodeMode mode)
+{
+    encode_mode = mode;
+}
+
+EncodeMode get_encode_mode()
+{
+    return encode_mode;
+}
+
+/**
+ * Put a pixel into the bit plane buffer
+ */
+void put_pixel(uint board, uint strip, uint pixel, uint32_t pixel_rgb)
+{
+    // The board's planes end at its longest strip
+    if (board >= BOARDS || pixel >= board_pixel_count[board])
+        return;
+    put_pixel_planes(&plane_buffer(current_buffer, board)[pixel * 3], strip, pixel_rgb);
+    track_written(board, pixel * 3, 3);
+}
+
+void put_pixel_planes(value_bits_t *values, uint strip, uint32_t pixel_rgb)
+{
+
+    uint b = pixel_rgb & 0xffu;
+    uint g = (pixel_rgb >> 8u) & 0xffu;
+    uint r = (pixel_rgb >> 16u) & 0xffu;
+
+    plane_word_t mask = 1 << (strip + PLANE_STRIP_SHIFT); // The mask for the current strip
+
+    uint color_array[3] = {r, g, b};
+
+    // Iterate through the colors
+    for (int i = 0; i < 3; i++)
+    { // Each bit plane is 32 bits, one bit for each strip, with the MSB being the first strip
+        // There are three bit planes, one for each color
+        plane_word_t *planes = values[i].planes;
+        uint32_t color = color_array[i];
+        // Iterate through the 8 bits in each color
+        for (uint bit = 0; bit < 8; bit++)
+        {
+            // Get the current color at this bit plane location
+            plane_word_t value = planes[bit];
+            // Calculate the bit we are setting.
+            uint color_bit = (color >> (7 - bit)) & 1;
+            // Calculate the new value in the bit plane.
+            planes[bit] = (color_bit) ? (value | (mask)) : (value & ~(mask));
+        }
+    }
+}
+
+// Transpose one color channel of 8 strips into 8 plane bytes and OR them into planes at bit_offset.
+// This is the 8x8 bit matrix transpose from Hacker's Delight (transpose8rS32): the channel bytes of
+// strips 7..0 are the rows, so after the transpose row n holds bit (7 - n) of every strip, strip 0 in bit 0.
+static inline void transpose_channel(const uint32_t *colors, uint channel_shift, uint bit_offset, uint32_t *planes)
+{
+    uint32_t x = (((colors[7] >> channel_shift) & 0xffu) << 24) |
+                 (((colors[6] >> channel_shift) & 0xffu) << 16) |
+                 (((colors[5] >> channel_shift) & 0xffu) << 8) |
+                 ((colors[4] >> channel_shift) & 0xffu);
+    uint32_t y = (((colors[3] >> channel_shift) & 0xffu) << 24) |
+                 (((colors[2] >> channel_shift) & 0xffu) << 16) |
+                 (((colors[1] >> channel_shift) & 0xffu) << 8) |
+                 ((colors[0] >> channel_shift) & 0xffu);
+    uint32_t t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AAu;
+    x = x ^ t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00AA00AAu;
+    y = y ^ t ^ (t << 7);
+
+    t = (x ^ (x >> 14)) & 0x0000CCCCu;
+    x = x ^ t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000CCCCu;
+    y = y ^ t ^ (t << 14);
+
+    t = (x & 0xF0F0F0F0u) | ((y >> 4) & 0x0F0F0F0Fu);
+    y = ((x << 4) & 0xF0F0F0F0u) | (y & 0x0F0F0F0Fu);
+    x = t;
+
+    planes[0] |= (x >> 24) << bit_offset;
+    planes[1] |= ((x >> 16) & 0xffu) << bit_offset;
+    planes[2] |= ((x >> 8) & 0xffu) << bit_offset;
+    planes[3] |= (x & 0xffu) << bit_offset;
+    planes[4] |= (y >> 24) << bit_offset;
+    planes[5] |= ((y >> 16) & 0xffu) << bit_offset;
+    planes[6] |= ((y >> 8) & 0xffu) << bit_offset;
+    planes[7] |= (y & 0xffu) << bit_offset;
+}
+
+void encode_column(value_bits_t *values, const uint32_t *colors, uint32_t strip_mask)
+{
+    // r, g and b planes of this pixel index, in output order
+    uint32_t planes[3][VALUE_PLANE_COUNT] = {0};
+
+    for (uint group = 0; group < STRIP_GROUPS; group++)
+    {
+        uint bit_offset = group * 8 + PLANE_STRIP_SHIFT;
+        transpose_channel(colors + group * 8, 16, bit_offset, planes[0]);
+        transpose_channel(colors + group * 8, 8, bit_offset, planes[1]);
+        transpose_channel(colors + group * 8, 0, bit_offset, planes[2]);
+    }
+
+    if ((strip_mask & ALL_STRIPS_MASK) == ALL_STRIPS_MASK)
+    {
+        // Every strip is present, so the plane words can be written blind
+        uint32_t mask = ALL_STRIPS_MASK << PLANE_STRIP_SHIFT;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int bit = 0; bit < VALUE_PLANE_COUNT; bit++)
+            {
+                values[i].planes[bit] = planes[i][bit] & mask;
+            }
+        }
+    }
+    else
+    {
+        uint32_t mask = (strip_mask & ALL_STRIPS_MASK) << PLANE_STRIP_SHIFT;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int bit = 0; bit < VALUE_PLANE_COUNT; bit++)
+            {
+                values[i].planes[bit] = (values[i].planes[bit] & ~mask) | (planes[i][bit] & mask);
+            }
+        }
+    }
+}
+
+void put_pixel_column(uint board, uint pixel, const uint32_t *colors, uint32_t strip_mask)
+{
+    encode_column(&plane_buffer(current_buffer, board)[pixel * 3], colors, strip_mask);
+    track_written(board, pixel * 3, 3);
+}
+
+void encode_plan(const raster_object_t *raster)
+{
+    encode_plan_columns(raster, 0, raster->plan.column_count, NULL);
+}
+
+void encode_plan_columns(const raster_object_t *raster, uint32_t first, uint32_t end, value_bits_t *board_values)
+{
+    const encode_plan_t *plan = &raster->plan;
+    uint width = raster->width;
+    if (first >= end)
+    {
+        return;
+    }
+    // Strips missing from a column are masked out, so stale entries do no harm
+    uint32_t colors[STRIP_GROUPS * 8] = {0};
+    const encode_source_t *source = plan->sources + plan->columns[first].first_source;
+
+    for (uint32_t c = first; c < end; c++)
+    {
+        const encode_column_t *column = &plan->columns[c];
+        value_bits_t *values;
+        if (board_values)
+        {
+            values = board_values + column->plane_offset;
+        }
+        else
+        {
+            values = plane_buffer(current_buffer, column->board) + column->plane_offset;
+            track_written(column->board, column->plane_offset, 3);
+        }
+        uint32_t strip_mask = column->strip_mask;
+
+        if (encode_mode == ENCODE_TRANSPOSE)
+        {
+            for (uint strip = 0; strip < STRIPS; strip++)
+            {
+                if (strip_mask & (1u << strip))
+                {
+                    colors[strip] = raster_color(raster, source->y * width + source->x);
+                    source++;
+                }
+            }
+            encode_column(values, colors, strip_mask);
+        }
+        else
+        {
+            for (uint strip = 0; strip < STRIPS; strip++)
+            {
+                if (strip_mask & (1u << strip))
+                {
+                    put_pixel_planes(values, strip, raster_color(raster, source->y * width + source->x));
+                    source++;
+                }
+            }
+        }
+    }
+    encode_stats_add(source - (plan->sources + plan->columns[first].first_source));
+}
+
+void encode_plan_dirty(const raster_object_t *raster)
+{
+    const encode_plan_t *plan = &raster->plan;
+    uint width = raster->width;
+    const uint16_t *dirty_x0 = raster->dirty_x0;
+    const uint16_t *dirty_x1 = raster->dirty_x1;
+    uint32_t colors[STRIP_GROUPS * 8] = {0};
+    uint32_t encoded = 0;
+
+    for (uint32_t c = 0; c < plan->column_count; c++)
+    {
+        const encode_column_t *column = &plan->columns[c];
+        const encode_source_t *sources = plan->sources + column->first_source;
+        uint32_t strip_mask = column->strip_mask;
+
+        // Find the strips whose raster pixel changed
+        uint32_t dirty_mask = 0;
+        const encode_source_t *source = sources;
+        for (uint strip = 0; strip < STRIPS; strip++)
+        {
+            if (strip_mask & (1u << strip))
+            {
+                if (source->x >= dirty_x0[source->y] && source->x <= dirty_x1[source->y])
+                {
+                    dirty_mask |= 1u << strip;
+                }
+                source++;
+            }
+        }
+        if (dirty_mask == 0)
+        {
+            continue;
+        }
+
+        value_bits_t *values = plane_buffer(current_buffer, column->board) + column->plane_offset;
+        track_written(column->board, column->plane_offset, 3);
+        source = sources;
+        if (encode_mode == ENCODE_TRANSPOSE)
+        {
+            // Rewriting the whole column is cheaper than merging just the dirty strips
+            for (uint strip = 0; strip < STRIPS; strip++)
+            {
+                if (strip_mask & (1u << strip))
+                {
+                    colors[strip] = raster_color(raster, source->y * width + source->x);
+                    source++;
+                    encoded++;
+                }
+            }
+            encode_column(values, colors, strip_mask);
+        }
+        else
+        {
+            for (uint strip = 0; strip < STRIPS; strip++)
+            {
+                if (strip_mask & (1u << strip))
+                {
+                    if (dirty_mask & (1u << strip))
+                    {
+                        put_pixel_planes(values, strip, raster_color(raster, source->y * width + source->x));
+                        encoded++;
+                    }
+                    source++;
+                }
+            }
+        }
+    }
+    encode_stats_add(encoded);
+}
+
+void encode_stats_add(uint32_t pixels)
+{
+    // Both cores encode with parallel encode, the total is brought up to date at the end of the frame
+    hal_atomic_fetch_add(&encode_stats.pixels_encoded, pixels);
+}
+
+void encode_stats_end_frame()
+{
+    encode_stats.last_frame_pixels_encoded = encode_stats.pixels_encoded;
+    encode_stats.total_pixels_encoded += encode_stats.pixels_encoded;
+    encode_stats.pixels_encoded = 0;
+    encode_stats.frames++;
+}
+
+encode_stats_t get_encode_stats()
+{
+    return encode_stats;
+}
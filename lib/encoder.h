@@ -0,0 +1,142 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+#include "defines.h"
+
+// Bit plane encoding.
+// Each value_bits_t holds one color channel of one pixel index for every strip of a board:
+// planes[bit] has one bit per strip, MSB of the channel first, strip n at bit (n + PLANE_STRIP_SHIFT).
+
+#if PACKED_PLANES
+// Two planes per 32 bit word, the PIO's out pins start at the first strip
+#define PLANE_STRIP_SHIFT 0
+#else
+// Plane bit 0 drives WS2812_PIN_BASE, the strips start on the pin above it
+#define PLANE_STRIP_SHIFT 1
+#endif
+
+// Strips are transposed in groups of 8 (one byte per strip per channel)
+#define STRIP_GROUPS ((STRIPS + 7) / 8)
+
+#define ALL_STRIPS_MASK ((uint32_t)((1ull << STRIPS) - 1))
+
+// Bit planes of one board in the given buffer
+static inline value_bits_t *plane_buffer(uint buffer, uint board)
+{
+#if STREAMING_OUTPUT
+    // There is no frame buffer, boards alternate between the two board buffers, board 0 in buffer. With an
+    // odd number of boards the frames alternate too, so the first board of a frame doesn't go in the buffer
+    // the last board of the frame before is still being sent from.
+    return board_planes[(board ^ buffer) & 1][0];
+#else
+    return board_planes[buffer][board];
+#endif
+}
+
+// Fragment list output_strips_dma chains the DMA through: the address of each value_bits_t, null terminated
+static inline void fill_fragment_list(uintptr_t *fragments, value_bits_t *values, uint value_length)
+{
+    for (uint i = 0; i < value_length; i++)
+    {
+        fragments[i] = (uintptr_t)values[i].planes; // MSB first
+    }
+    fragments[value_length] = 0;
+}
+
+// Select how show_raster_object and show_raster_object_with_shift write to the bit planes
+void set_encode_mode(EncodeMode mode);
+
+EncodeMode get_encode_mode();
+
+// Record that count value_bits_t of a board, starting at plane_offset, were written in the current buffer.
+// The encoder does this itself, call it after writing the planes of the current buffer directly.
+void mark_planes_written(uint board, uint plane_offset, uint count);
+
+// Forget the ranges written since the last swap, when the plane buffers are laid out again
+void clear_planes_written();
+
+// Select what swap_buffers copies into the next buffer
+void set_buffer_copy_mode(BufferCopyMode mode);
+
+BufferCopyMode get_buffer_copy_mode();
+
+// Boards whose planes in the current buffer differ from the other buffer, bit n for board n. Only the
+// ranges written since the last swap are compared, the rest of the current buffer is up to date.
+// If send_values is not NULL it gets, for each board, the value_bits_t up to and including its last
+// changed pixel (0 when the board is unchanged).
+uint32_t changed_boards(uint16_t *send_values);
+
+// Switch the buffer being encoded into, bringing the next buffer up to date with the one just shown
+// as the buffer copy mode says. Returns the number of bytes copied.
+uint32_t swap_buffers();
+
+// Put a pixel into the bit plane buffer, one read-modify-write per plane word
+void put_pixel(uint board, uint strip, uint pixel, uint32_t pixel_rgb);
+
+// Same as put_pixel, for the red, green and blue value_bits_t of an already resolved pixel index
+void put_pixel_planes(value_bits_t *values, uint strip, uint32_t pixel_rgb);
+
+// Encode one pixel index for several strips at once into its red, green and blue value_bits_t.
+// colors is indexed by strip, strip_mask has bit n set for every strip n to write.
+// If strip_mask covers all strips the 24 plane words are written without being read back.
+void encode_column(value_bits_t *values, const uint32_t *colors, uint32_t strip_mask);
+
+// encode_column for a board and pixel index of the current buffer
+void put_pixel_column(uint board, uint pixel, const uint32_t *colors, uint32_t strip_mask);
+
+static inline uint16_t rgb_to_565(uint32_t rgb)
+{
+    return ((rgb >> 8) & 0xf800) | ((rgb >> 5) & 0x07e0) | ((rgb >> 3) & 0x001f);
+}
+
+// The low bits are filled from the high ones, so white stays 0xffffff
+static inline uint32_t rgb565_to_rgb(uint16_t pixel)
+{
+    uint32_t r = (pixel >> 11) & 0x1f;
+    uint32_t g = (pixel >> 5) & 0x3f;
+    uint32_t b = pixel & 0x1f;
+    return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+}
+
+// 0xRRGGBB color of the pixel at row major index i of a raster, whatever its format
+static inline uint32_t raster_color(const raster_object_t *raster, uint32_t i)
+{
+    switch (raster->format)
+    {
+    case RASTER_PALETTE8:
+        return raster->palette[raster->indices[i]];
+    case RASTER_RGB565:
+        return rgb565_to_rgb(raster->pixels565[i]);
+    default:
+        return raster->pixels[i];
+    }
+}
+
+// Write the pixels of a raster into the current buffer by walking its encode plan, using the current encode mode.
+void encode_plan(const raster_object_t *raster);
+
+// encode_plan for the columns first..end - 1 of the raster's plan. If board_values is not NULL all of those columns
+// must be on one board, and they are written to board_values instead of that board's planes in the current buffer.
+void encode_plan_columns(const raster_object_t *raster, uint32_t first, uint32_t end, value_bits_t *board_values);
+
+// Like encode_plan, but only for columns with at least one raster pixel inside its row's dirty span.
+void encode_plan_dirty(const raster_object_t *raster);
+
+typedef struct
+{
+    uint32_t pixels_encoded;            // raster pixels written to the bit planes since the last show_pixels
+    uint32_t last_frame_pixels_encoded; // raster pixels written for the last frame sent with show_pixels
+    uint32_t frames;
+    uint64_t total_pixels_encoded;      // up to the last frame sent
+    uint32_t last_swap_bytes_copied; // bytes copied between the double buffers by the last swap_buffers
+    uint64_t total_bytes_copied;
+} encode_stats_t;
+
+// Count raster pixels written to the bit planes
+void encode_stats_add(uint32_t pixels);
+
+// Close the frame's pixel count, called by show_pixels
+void encode_stats_end_frame();
+
+encode_stats_t get_encode_stats();
+
+#endif // ENCODER_H
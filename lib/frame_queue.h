@@ -0,0 +1,56 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+#include "defines.h"
+
+// Single producer, single consumer queue of frame descriptors between the cores. The producer only
+// writes head and the consumer only writes tail, so neither needs a lock.
+
+// Frames a queue holds, a power of two
+#define FRAME_QUEUE_DEPTH 4
+
+typedef struct
+{
+    uint32_t number;    // frames submitted before this one
+    uint32_t buffer;    // plane buffer holding the frame, owned by the output until the frame is done
+    uint32_t boards;    // bit n set for each board n to send, the others hold what they were last sent
+    // value_bits_t of each board to send, up to its last changed pixel. The pixels after it hold theirs.
+    uint16_t board_values[BOARDS];
+    uint32_t submit_us; // when show_pixels handed it to the output
+    uint32_t done_us;   // when its last board was sent
+} frame_t;
+
+typedef struct
+{
+    frame_t frames[FRAME_QUEUE_DEPTH];
+    uint32_t head; // frames pushed
+    uint32_t tail; // frames popped
+} frame_queue_t;
+
+// Returns false if the queue is full
+static inline bool frame_queue_push(frame_queue_t *queue, const frame_t *frame)
+{
+    uint32_t head = queue->head;
+    if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == FRAME_QUEUE_DEPTH)
+        return false;
+    queue->frames[head & (FRAME_QUEUE_DEPTH - 1)] = *frame;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Returns false if the queue is empty
+static inline bool frame_queue_pop(frame_queue_t *queue, frame_t *frame)
+{
+    uint32_t tail = queue->tail;
+    if (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail)
+        return false;
+    *frame = queue->frames[tail & (FRAME_QUEUE_DEPTH - 1)];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline uint32_t frame_queue_count(frame_queue_t *queue)
+{
+    return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif // FRAME_QUEUE_H
@@ -0,0 +1,166 @@
+#include "defines.h"
+#include "geometry.h"
+#include "encoder.h"
+#include "log.h"
+#include "utils.h"
+
+geometry_t geometry = {
+    .strips = {[0 ... BOARDS - 1] = STRIPS},
+    .pixels = {[0 ... BOARDS - 1] = {[0 ... STRIPS - 1] = NUM_PIXELS}},
+};
+uint16_t board_pixel_count[BOARDS] = {[0 ... BOARDS - 1] = NUM_PIXELS};
+
+// Everything below is carved from arena, nothing is there until init_geometry
+static uint8_t *arena;
+static uint32_t arena_bytes;
+value_bits_t *board_planes[2][PLANE_BUFFER_BOARDS];
+uint32_t buffer_values;
+uintptr_t *fragment_list;
+raster_object_t *raster_object;
+uint max_raster_objects;
+uint16_t *free_raster_ids;
+uint free_raster_id_count;
+frame_show_t *frame_shows;
+uint8_t *raster_pool;
+uint32_t raster_pool_bytes;
+uint32_t raster_pool_used;
+
+// Each part of the arena starts on an 8 byte boundary, enough for any of them
+static inline uint32_t arena_align(uint32_t bytes)
+{
+    return (bytes + 7) & ~7u;
+}
+
+void default_geometry(geometry_t *g)
+{
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        g->strips[board] = STRIPS;
+        for (uint strip = 0; strip < STRIPS; strip++)
+        {
+            g->pixels[board][strip] = NUM_PIXELS;
+        }
+    }
+}
+
+static void update_board_pixel_counts()
+{
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        uint16_t longest = 0;
+        for (uint strip = 0; strip < geometry.strips[board]; strip++)
+        {
+            if (geometry.pixels[board][strip] > longest)
+                longest = geometry.pixels[board][strip];
+        }
+        board_pixel_count[board] = longest;
+    }
+}
+
+static bool geometry_valid(const geometry_t *g)
+{
+    uint32_t total = 0;
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        if (g->strips[board] > STRIPS)
+            return false;
+        for (uint strip = 0; strip < g->strips[board]; strip++)
+        {
+            if (g->pixels[board][strip] > NUM_PIXELS)
+                return false;
+            total += g->pixels[board][strip];
+        }
+    }
+    return total != 0;
+}
+
+int init_geometry(const geometry_t *g, uint max_rasters, uint32_t raster_bytes)
+{
+    if (!geometry_valid(g))
+    {
+        LOG(LOG_GEOMETRY_INVALID);
+        return -1;
+    }
+    geometry_t previous = geometry;
+    geometry = *g;
+    update_board_pixel_counts();
+
+    uint longest = 0;
+    uint32_t values = 0;
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        if (board_pixel_count[board] > longest)
+            longest = board_pixel_count[board];
+        values += board_pixel_count[board] * 3;
+    }
+#if STREAMING_OUTPUT
+    // One board at a time in each buffer
+    values = longest * 3;
+#endif
+    uint32_t plane_bytes = arena_align(values * sizeof(value_bits_t));
+    uint32_t fragment_bytes = arena_align((longest * 3 + 1) * sizeof(uintptr_t));
+    uint32_t table_bytes = arena_align(max_rasters * sizeof(raster_object_t));
+    uint32_t free_id_bytes = arena_align(max_rasters * sizeof(uint16_t));
+    uint32_t show_bytes = arena_align(max_rasters * sizeof(frame_show_t));
+    raster_bytes = arena_align(raster_bytes);
+    uint32_t bytes = 2 * plane_bytes + fragment_bytes + table_bytes + free_id_bytes + show_bytes + raster_bytes;
+
+    uint8_t *memory = calloc(1, bytes);
+    if (!memory)
+    {
+        LOG(LOG_ARENA_ALLOC_FAILED, bytes);
+        geometry = previous;
+        update_board_pixel_counts();
+        return -1;
+    }
+    // Everything the rasters hold is in the arena, only the shows queued for them are outside it
+    clear_frame_shows();
+    free(arena);
+    arena = memory;
+    arena_bytes = bytes;
+
+    for (uint buffer = 0; buffer < 2; buffer++)
+    {
+        value_bits_t *planes = (value_bits_t *)memory;
+        for (uint board = 0; board < PLANE_BUFFER_BOARDS; board++)
+        {
+            board_planes[buffer][board] = planes;
+            planes += board_pixel_count[board] * 3;
+        }
+        memory += plane_bytes;
+    }
+    buffer_values = values;
+    fragment_list = (uintptr_t *)memory;
+    memory += fragment_bytes;
+    raster_object = (raster_object_t *)memory;
+    memory += table_bytes;
+    max_raster_objects = max_rasters;
+    raster_object_count = -1;
+    free_raster_ids = (uint16_t *)memory;
+    memory += free_id_bytes;
+    free_raster_id_count = 0;
+    frame_shows = (frame_show_t *)memory;
+    memory += show_bytes;
+    raster_pool = memory;
+    raster_pool_bytes = raster_bytes;
+    raster_pool_used = 0;
+    clear_planes_written();
+    LOG(LOG_ARENA_ALLOCATED, bytes, __builtin_popcount(present_boards()), max_rasters);
+    return 0;
+}
+
+uint32_t geometry_arena_bytes()
+{
+    return arena_bytes;
+}
+
+uint32_t present_boards()
+{
+    uint32_t boards = 0;
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        if (board_pixel_count[board])
+            boards |= 1u << board;
+    }
+    return boards;
+}
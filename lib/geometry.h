@@ -0,0 +1,46 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+#include "defines.h"
+
+// Installation geometry: which boards are present, how many strips each has and how long each strip is.
+// BOARDS, STRIPS and NUM_PIXELS in defines.h are the limits. By default every board has STRIPS strips
+// of NUM_PIXELS pixels.
+
+typedef struct
+{
+    uint8_t strips[BOARDS];          // strips on each board, 0 when the board is not present
+    uint16_t pixels[BOARDS][STRIPS]; // pixels on each strip
+} geometry_t;
+
+extern geometry_t geometry;
+// Longest strip of each board, the pixels its DMA sends
+extern uint16_t board_pixel_count[BOARDS];
+
+// Every board present with STRIPS strips of NUM_PIXELS pixels
+void default_geometry(geometry_t *g);
+
+// Lay out the installation g describes: the plane buffers, the DMA fragment list, a table of max_rasters
+// rasters, a frame show queue as long and raster_bytes of raster storage are carved from one allocation sized for it. Call at startup,
+// before creating rasters and before initialize_dma. Calling it again drops every raster. Returns -1, and
+// keeps the layout it had, if g is beyond the limits in defines.h, has no pixels at all, or the memory isn't there.
+int init_geometry(const geometry_t *g, uint max_rasters, uint32_t raster_bytes);
+
+// Bytes allocated by the last init_geometry
+uint32_t geometry_arena_bytes();
+
+// Addresses of the value_bits_t output_strips_dma sends, carved from the arena for the longest board, + 1 for
+// the terminator
+extern uintptr_t *fragment_list;
+// Rasters created so far - 1, init_geometry resets it
+extern int raster_object_count;
+
+// Pixels on a strip, 0 if the strip or its board is not present
+static inline uint strip_pixels(uint board, uint strip)
+{
+    return board < BOARDS && strip < STRIPS && strip < geometry.strips[board] ? geometry.pixels[board][strip] : 0;
+}
+
+// Bit n set for each board n that is present
+uint32_t present_boards();
+
+#endif // GEOMETRY_H
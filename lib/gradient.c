@@ -0,0 +1,110 @@
+#include "defines.h"
+#include "gradient.h"
+#include "utils.h"
+
+// 0-65025 (channel * 255) to 0-255, rounded
+static inline uint32_t unscale(uint32_t x)
+{
+    return (x + 127) / 255;
+}
+
+void gradient_hsv(const gradient_t *g, uint8_t saturation, uint8_t value)
+{
+    uint32_t count = 1u << g->bits;
+    uint32_t top = value * 255;
+    uint32_t chroma = value * saturation;
+    uint32_t bottom = top - chroma;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        // Sixths of the wheel, the fraction through this one in 16 bits
+        uint32_t h6 = (i * 6) << (16 - g->bits);
+        uint32_t fraction = h6 & 0xffff;
+        uint32_t rise = bottom + ((chroma * fraction) >> 16);
+        uint32_t fall = bottom + ((chroma * (0x10000 - fraction)) >> 16);
+        uint32_t r, gr, b;
+        switch (h6 >> 16)
+        {
+        case 0:
+            r = top, gr = rise, b = bottom;
+            break;
+        case 1:
+            r = fall, gr = top, b = bottom;
+            break;
+        case 2:
+            r = bottom, gr = top, b = rise;
+            break;
+        case 3:
+            r = bottom, gr = fall, b = top;
+            break;
+        case 4:
+            r = rise, gr = bottom, b = top;
+            break;
+        default:
+            r = top, gr = bottom, b = fall;
+            break;
+        }
+        g->colors[i] = (unscale(r) << 16) | (unscale(gr) << 8) | unscale(b);
+    }
+}
+
+void gradient_hsl(const gradient_t *g, float saturation, float lightness)
+{
+    uint32_t count = 1u << g->bits;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        g->colors[i] = hsl_to_rgb((float)i / count, saturation, lightness);
+    }
+}
+
+// a to b, weight 0-256
+static inline uint32_t lerp_rgb(uint32_t a, uint32_t b, uint32_t weight)
+{
+    uint32_t rb = (((a & 0xff00ff) * (256 - weight) + (b & 0xff00ff) * weight) >> 8) & 0xff00ff;
+    uint32_t g = (((a & 0x00ff00) * (256 - weight) + (b & 0x00ff00) * weight) >> 8) & 0x00ff00;
+    return rb | g;
+}
+
+int gradient_stops(const gradient_t *g, const gradient_stop_t *stops, uint count)
+{
+    if (count == 0)
+    {
+        return -1;
+    }
+    for (uint k = 1; k < count; k++)
+    {
+        if (stops[k].phase < stops[k - 1].phase)
+        {
+            return -1;
+        }
+    }
+    uint32_t colors = 1u << g->bits;
+    // Before the first stop the gradient is on its way round from the last one
+    uint from = count - 1;
+    uint to = 0;
+    for (uint32_t i = 0; i < colors; i++)
+    {
+        int32_t phase = i << (16 - g->bits);
+        while (to < count && stops[to].phase <= phase)
+        {
+            from = to++;
+        }
+        int32_t start = stops[from].phase - (stops[from].phase > phase ? 0x10000 : 0);
+        int32_t end = to < count ? stops[to].phase : stops[0].phase + 0x10000;
+        uint32_t weight = ((phase - start) << 8) / (end - start);
+        g->colors[i] = lerp_rgb(stops[from].color, stops[to < count ? to : 0].color, weight);
+    }
+    return 0;
+}
+
+const gradient_t *rainbow_gradient()
+{
+    static uint32_t colors[256];
+    static gradient_t rainbow = {colors, 8};
+    static bool built = false;
+    if (!built)
+    {
+        gradient_hsv(&rainbow, 255, 255);
+        built = true;
+    }
+    return &rainbow;
+}
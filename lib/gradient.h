@@ -0,0 +1,38 @@
+#ifndef GRADIENT_H
+#define GRADIENT_H
+#include "defines.h"
+
+// Gradients: a color ramp computed once into a table of 1 << bits 0xRRGGBB colors, looked up by a 16 bit
+// phase where 0x10000 is once around the ramp. Effects step the phase with integer adds instead of
+// converting colors for every pixel.
+
+typedef struct
+{
+    uint32_t *colors; // 1 << bits colors, the caller's storage
+    uint8_t bits;     // 8 for 256 colors, 10 for 1024, at most 16
+} gradient_t;
+
+// A keyframe: the color the gradient passes through at phase
+typedef struct
+{
+    uint16_t phase;
+    uint32_t color;
+} gradient_stop_t;
+
+static inline uint32_t gradient_color(const gradient_t *g, uint16_t phase)
+{
+    return g->colors[phase >> (16 - g->bits)];
+}
+
+// The HSV hue wheel from red, in integer math. saturation and value are 0-255.
+void gradient_hsv(const gradient_t *g, uint8_t saturation, uint8_t value);
+// The HSL hue wheel hsl_to_rgb makes, hsl_to_rgb is called once per color
+void gradient_hsl(const gradient_t *g, float saturation, float lightness);
+// Blend between stops sorted by phase, from the last stop back round to the first.
+// Returns -1 if there are no stops or they aren't sorted.
+int gradient_stops(const gradient_t *g, const gradient_stop_t *stops, uint count);
+
+// 256 color hue wheel at full saturation and value, the rainbow effects use it. Built on first use.
+const gradient_t *rainbow_gradient();
+
+#endif // GRADIENT_H
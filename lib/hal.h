@@ -0,0 +1,142 @@
+#ifndef HAL_H
+#define HAL_H
+#include "defines.h"
+#ifdef LOCAL_BUILD
+#include <pthread.h>
+#else
+#include "pico/sem.h"
+#endif
+
+// Hardware used by the output path, so pixelblit.c runs on the Pico (hal_pico.c) and on the host (hal_host.c).
+// The host backend runs core 1 as a thread, and the PIO and DMA in the PIO simulator on a thread of their own.
+
+// ---- PIO ----
+
+typedef struct
+{
+    const uint16_t *instructions;
+    uint length;
+    uint wrap_target;
+    uint wrap;
+} hal_pio_program_t;
+
+// Load a program and claim a state machine to run it. The out pins are out_count pins from out_base and are
+// given to the PIO. Bits are shifted out to the right with autopull every pull_threshold bits, and the FIFOs
+// are joined for TX. The state machine runs cycles_per_second cycles a second, or at the system clock if 0,
+// and is left disabled. Returns the state machine, or -1 if none is free.
+int hal_pio_claim(const hal_pio_program_t *program, uint out_base, uint out_count, uint pull_threshold, float cycles_per_second);
+
+void hal_pio_unclaim(int sm, const hal_pio_program_t *program);
+
+// Start the state machines in sm_mask on the same cycle
+void hal_pio_enable_mask(uint32_t sm_mask);
+
+bool hal_pio_tx_empty(uint sm);
+
+void hal_pio_clear_irq(uint irq);
+
+// ---- GPIO ----
+
+// Drive a pin from the CPU, taking it back from the PIO if it had it
+void hal_gpio_init_out(uint pin);
+
+void hal_gpio_put(uint pin, bool value);
+
+// ---- DMA ----
+
+// count 32 bit words from read_addr into the TX FIFO of state machine sm
+typedef struct
+{
+    const void *read_addr;
+    uint32_t count;
+    uint sm;
+} hal_dma_block_t;
+
+typedef struct hal_dma_chain hal_dma_chain_t;
+
+// Claim the DMA channels. complete_handler is called from the DMA interrupt once a fragment list or a chain has been moved.
+void hal_dma_init(void (*complete_handler)());
+
+// Move words_per_fragment words from each address of the null terminated fragments list into state machine sm.
+// fragments is read while the DMA runs.
+void hal_dma_start_fragments(const uintptr_t *fragments, uint words_per_fragment, uint sm);
+
+// Build a chain of blocks that runs without the CPU. blocks are copied, the memory they point to must stay valid.
+hal_dma_chain_t *hal_dma_create_chain(const hal_dma_block_t *blocks, uint count);
+
+void hal_dma_start_chain(hal_dma_chain_t *chain);
+
+// ---- Time ----
+
+uint32_t hal_time_us_32();
+
+uint64_t hal_time_us_64();
+
+void hal_busy_wait_us(uint32_t us);
+
+void hal_busy_wait_until_us(uint64_t time_us);
+
+// Body of a busy wait loop
+void hal_tight_loop();
+
+typedef int32_t hal_alarm_id_t;
+typedef int64_t (*hal_alarm_callback_t)(hal_alarm_id_t id, void *user_data);
+
+// Alarms fire on the core that called hal_alarm_init
+void hal_alarm_init();
+
+// One shot alarm, returns its id (> 0)
+hal_alarm_id_t hal_alarm_add_in_us(uint32_t us, hal_alarm_callback_t callback, void *user_data);
+
+void hal_alarm_cancel(hal_alarm_id_t id);
+
+// ---- Semaphores ----
+
+#ifdef LOCAL_BUILD
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int16_t permits;
+    int16_t max_permits;
+} hal_sem_t;
+#else
+typedef struct semaphore hal_sem_t;
+#endif
+
+void hal_sem_init(hal_sem_t *sem, int16_t initial_permits, int16_t max_permits);
+
+void hal_sem_acquire_blocking(hal_sem_t *sem);
+
+// Take a permit if one is available, without waiting
+bool hal_sem_try_acquire(hal_sem_t *sem);
+
+bool hal_sem_release(hal_sem_t *sem);
+
+// Add to a value shared between the cores and interrupts, returns the value before the add
+uint32_t hal_atomic_fetch_add(volatile uint32_t *value, uint32_t add);
+
+// ---- Cores ----
+
+// (Re)start core 1 running entry
+void hal_core1_launch(void (*entry)());
+
+void hal_fifo_push_blocking(uint32_t value);
+
+uint32_t hal_fifo_pop_blocking();
+
+#ifdef LOCAL_BUILD
+#include "piosim.h"
+
+// The simulator standing in for the PIO and DMA, hold the lock while looking at it
+piosim_t *hal_host_sim();
+
+void hal_host_sim_lock();
+
+void hal_host_sim_unlock();
+
+// Wait until the DMA is done and the strips have been low long enough to latch
+void hal_host_wait_idle();
+#endif
+
+#endif // HAL_H
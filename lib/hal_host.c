@@ -0,0 +1,432 @@
+#include "defines.h"
+#include "hal.h"
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+// Host backend. The PIO and DMA are the PIO simulator, run by a "hardware" thread that also raises the DMA
+// interrupt and fires alarms. Core 1 is a second thread, and the inter-core FIFO and semaphores are
+// mutexes and condition variables.
+//
+// Time is the simulator's cycle count, kept from running ahead of the monotonic clock. When the host can't
+// simulate the PIO in real time it falls behind the clock instead, so the output sees the same timing as on
+// the Pico whatever the load: a busy wait lasts as long in PIO cycles, and a frame is as many cycles long.
+
+#define CYCLES_PER_US (1000 / PIOSIM_CYCLE_NS)
+// Most cycles simulated per hold of the lock, so the other threads get at the simulator in between
+#define STEP_CHUNK_CYCLES 256
+// Sleep of the hardware thread once it has caught up with the clock
+#define IDLE_SLEEP_NS 20000
+#define ALARM_COUNT 8
+// Same depth as the Pico's inter-core FIFO
+#define FIFO_DEPTH 8
+
+struct hal_dma_chain
+{
+    uint count;
+    piosim_segment_t segments[];
+};
+
+typedef struct
+{
+    hal_alarm_id_t id; // 0 when the slot is free
+    uint64_t due_cycle;
+    hal_alarm_callback_t callback;
+    void *user_data;
+} host_alarm_t;
+
+static piosim_t sim;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hardware_once = PTHREAD_ONCE_INIT;
+static uint64_t start_ns;
+// sim.cycle, published for hal_time_us_64 to read without the lock
+static uint64_t sim_cycle;
+
+static uint32_t claimed_sms;
+static void (*dma_complete_handler)();
+static bool dma_running;
+// One segment per fragment, pixelblit.c sends at most NUM_PIXELS * 3 fragments at a time
+static piosim_segment_t fragment_segments[NUM_PIXELS * 3];
+
+static host_alarm_t alarms[ALARM_COUNT];
+static hal_alarm_id_t next_alarm_id = 1;
+
+static pthread_mutex_t fifo_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fifo_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t fifo[FIFO_DEPTH];
+static uint fifo_head;
+static uint fifo_count;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Runs the simulator up to the clock, raising the DMA interrupt and firing alarms as it goes
+static void *hardware_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&sim_lock);
+        uint64_t clock_cycle = (monotonic_ns() - start_ns) / PIOSIM_CYCLE_NS;
+        uint64_t target = clock_cycle;
+        if (target > sim.cycle + STEP_CHUNK_CYCLES)
+            target = sim.cycle + STEP_CHUNK_CYCLES;
+        // Stop at the next alarm, so it fires on time
+        for (uint i = 0; i < ALARM_COUNT; i++)
+        {
+            if (alarms[i].id && alarms[i].due_cycle < target)
+                target = alarms[i].due_cycle;
+        }
+
+        bool dma_complete = false;
+        while (sim.cycle < target)
+        {
+            if (piosim_idle(&sim))
+                piosim_skip(&sim, target - sim.cycle);
+            else
+                piosim_step(&sim);
+            if (dma_running && !piosim_dma_busy(&sim))
+            {
+                dma_running = false;
+                dma_complete = true;
+                break;
+            }
+        }
+        __atomic_store_n(&sim_cycle, sim.cycle, __ATOMIC_RELEASE);
+
+        host_alarm_t due = {0};
+        for (uint i = 0; i < ALARM_COUNT; i++)
+        {
+            if (alarms[i].id && alarms[i].due_cycle <= sim.cycle)
+            {
+                due = alarms[i];
+                alarms[i].id = 0;
+                break;
+            }
+        }
+        bool caught_up = sim.cycle >= clock_cycle;
+        pthread_mutex_unlock(&sim_lock);
+
+        // Handlers run without the lock, they can call back into the HAL
+        if (dma_complete && dma_complete_handler)
+            dma_complete_handler();
+        if (due.id)
+            due.callback(due.id, due.user_data);
+        if (caught_up && !dma_complete && !due.id)
+        {
+            struct timespec sleep = {0, IDLE_SLEEP_NS};
+            nanosleep(&sleep, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void start_hardware()
+{
+    piosim_init(&sim);
+    start_ns = monotonic_ns();
+    pthread_t thread;
+    pthread_create(&thread, NULL, hardware_thread, NULL);
+    pthread_detach(thread);
+}
+
+static void ensure_hardware()
+{
+    pthread_once(&hardware_once, start_hardware);
+}
+
+piosim_t *hal_host_sim()
+{
+    ensure_hardware();
+    return &sim;
+}
+
+void hal_host_sim_lock()
+{
+    pthread_mutex_lock(&sim_lock);
+}
+
+void hal_host_sim_unlock()
+{
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_host_wait_idle()
+{
+    ensure_hardware();
+    while (1)
+    {
+        pthread_mutex_lock(&sim_lock);
+        if (!dma_running && piosim_idle(&sim))
+        {
+            piosim_latch(&sim);
+            __atomic_store_n(&sim_cycle, sim.cycle, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&sim_lock);
+            return;
+        }
+        pthread_mutex_unlock(&sim_lock);
+        hal_tight_loop();
+    }
+}
+
+// Every state machine runs at the 8MHz the simulator counts in, cycles_per_second is not used
+int hal_pio_claim(const hal_pio_program_t *program, uint out_base, uint out_count, uint pull_threshold, float cycles_per_second)
+{
+    (void)cycles_per_second;
+    ensure_hardware();
+    pthread_mutex_lock(&sim_lock);
+    int sm = -1;
+    for (uint i = 0; i < PIOSIM_SM_COUNT; i++)
+    {
+        if (!(claimed_sms & (1u << i)))
+        {
+            sm = i;
+            break;
+        }
+    }
+    if (sm >= 0)
+    {
+        claimed_sms |= 1u << sm;
+        piosim_sm_config(&sim, sm, program->instructions, program->length, program->wrap_target, program->wrap);
+        piosim_sm_set_out(&sim, sm, out_base, out_count, true, true, pull_threshold);
+        piosim_set_pio_pins(&sim, out_base, out_count);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return sm;
+}
+
+void hal_pio_unclaim(int sm, const hal_pio_program_t *program)
+{
+    (void)program;
+    pthread_mutex_lock(&sim_lock);
+    sim.sm[sm].enabled = false;
+    claimed_sms &= ~(1u << sm);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_pio_enable_mask(uint32_t sm_mask)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (uint i = 0; i < PIOSIM_SM_COUNT; i++)
+    {
+        if (sm_mask & (1u << i))
+            piosim_sm_enable(&sim, i);
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+bool hal_pio_tx_empty(uint sm)
+{
+    pthread_mutex_lock(&sim_lock);
+    bool empty = sim.sm[sm].fifo_count == 0;
+    pthread_mutex_unlock(&sim_lock);
+    return empty;
+}
+
+void hal_pio_clear_irq(uint irq)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim.irq &= ~(1u << irq);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_gpio_init_out(uint pin)
+{
+    ensure_hardware();
+    pthread_mutex_lock(&sim_lock);
+    sim.pio_pins &= ~(1u << pin);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_gpio_put(uint pin, bool value)
+{
+    pthread_mutex_lock(&sim_lock);
+    piosim_gpio_put(&sim, pin, value);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_dma_init(void (*complete_handler)())
+{
+    ensure_hardware();
+    dma_complete_handler = complete_handler;
+}
+
+void hal_dma_start_fragments(const uintptr_t *fragments, uint words_per_fragment, uint sm)
+{
+    pthread_mutex_lock(&sim_lock);
+    uint count = piosim_fragment_segments(fragment_segments, fragments, words_per_fragment, sm);
+    piosim_dma_start(&sim, fragment_segments, count);
+    dma_running = true;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+hal_dma_chain_t *hal_dma_create_chain(const hal_dma_block_t *blocks, uint count)
+{
+    hal_dma_chain_t *chain = malloc(sizeof(hal_dma_chain_t) + count * sizeof(piosim_segment_t));
+    if (chain == NULL)
+        return NULL;
+    chain->count = count;
+    for (uint i = 0; i < count; i++)
+    {
+        chain->segments[i] = (piosim_segment_t){(const uint32_t *)blocks[i].read_addr, blocks[i].count, blocks[i].sm};
+    }
+    return chain;
+}
+
+void hal_dma_start_chain(hal_dma_chain_t *chain)
+{
+    pthread_mutex_lock(&sim_lock);
+    piosim_dma_start(&sim, chain->segments, chain->count);
+    dma_running = true;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+uint32_t hal_time_us_32()
+{
+    return (uint32_t)hal_time_us_64();
+}
+
+uint64_t hal_time_us_64()
+{
+    ensure_hardware();
+    return __atomic_load_n(&sim_cycle, __ATOMIC_ACQUIRE) / CYCLES_PER_US;
+}
+
+void hal_busy_wait_us(uint32_t us)
+{
+    hal_busy_wait_until_us(hal_time_us_64() + us);
+}
+
+void hal_busy_wait_until_us(uint64_t time_us)
+{
+    while (hal_time_us_64() < time_us)
+        hal_tight_loop();
+}
+
+void hal_tight_loop()
+{
+    // Let the hardware thread run, the host may have fewer cores than there are threads
+    sched_yield();
+}
+
+// Alarms fire on the hardware thread, whichever core armed them
+void hal_alarm_init()
+{
+    ensure_hardware();
+}
+
+// The callback's return value is not used, alarms don't repeat
+hal_alarm_id_t hal_alarm_add_in_us(uint32_t us, hal_alarm_callback_t callback, void *user_data)
+{
+    pthread_mutex_lock(&sim_lock);
+    hal_alarm_id_t id = -1;
+    for (uint i = 0; i < ALARM_COUNT; i++)
+    {
+        if (alarms[i].id == 0)
+        {
+            id = next_alarm_id++;
+            alarms[i] = (host_alarm_t){id, sim.cycle + (uint64_t)us * CYCLES_PER_US, callback, user_data};
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return id;
+}
+
+void hal_alarm_cancel(hal_alarm_id_t id)
+{
+    pthread_mutex_lock(&sim_lock);
+    for (uint i = 0; i < ALARM_COUNT; i++)
+    {
+        if (alarms[i].id == id)
+            alarms[i].id = 0;
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void hal_sem_init(hal_sem_t *sem, int16_t initial_permits, int16_t max_permits)
+{
+    pthread_mutex_init(&sem->lock, NULL);
+    pthread_cond_init(&sem->cond, NULL);
+    sem->permits = initial_permits;
+    sem->max_permits = max_permits;
+}
+
+void hal_sem_acquire_blocking(hal_sem_t *sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    while (sem->permits == 0)
+        pthread_cond_wait(&sem->cond, &sem->lock);
+    sem->permits--;
+    pthread_mutex_unlock(&sem->lock);
+}
+
+bool hal_sem_try_acquire(hal_sem_t *sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    bool acquired = sem->permits > 0;
+    if (acquired)
+        sem->permits--;
+    pthread_mutex_unlock(&sem->lock);
+    return acquired;
+}
+
+bool hal_sem_release(hal_sem_t *sem)
+{
+    pthread_mutex_lock(&sem->lock);
+    bool released = sem->permits < sem->max_permits;
+    if (released)
+    {
+        sem->permits++;
+        pthread_cond_signal(&sem->cond);
+    }
+    pthread_mutex_unlock(&sem->lock);
+    return released;
+}
+
+uint32_t hal_atomic_fetch_add(volatile uint32_t *value, uint32_t add)
+{
+    return __atomic_fetch_add(value, add, __ATOMIC_ACQ_REL);
+}
+
+static void *core1_thread(void *entry)
+{
+    ((void (*)())entry)();
+    return NULL;
+}
+
+// A thread can't be reset like core 1, launch it once
+void hal_core1_launch(void (*entry)())
+{
+    pthread_t thread;
+    pthread_create(&thread, NULL, core1_thread, (void *)entry);
+    pthread_detach(thread);
+}
+
+void hal_fifo_push_blocking(uint32_t value)
+{
+    pthread_mutex_lock(&fifo_lock);
+    while (fifo_count == FIFO_DEPTH)
+        pthread_cond_wait(&fifo_cond, &fifo_lock);
+    fifo[(fifo_head + fifo_count) % FIFO_DEPTH] = value;
+    fifo_count++;
+    pthread_cond_broadcast(&fifo_cond);
+    pthread_mutex_unlock(&fifo_lock);
+}
+
+uint32_t hal_fifo_pop_blocking()
+{
+    pthread_mutex_lock(&fifo_lock);
+    while (fifo_count == 0)
+        pthread_cond_wait(&fifo_cond, &fifo_lock);
+    uint32_t value = fifo[fifo_head];
+    fifo_head = (fifo_head + 1) % FIFO_DEPTH;
+    fifo_count--;
+    pthread_cond_broadcast(&fifo_cond);
+    pthread_mutex_unlock(&fifo_lock);
+    return value;
+}
@@ -0,0 +1,340 @@
+#include "defines.h"
+#include "hal.h"
+#include <stdio.h>
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/clocks.h"
+#include "pico/sem.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "pio_programs.h"
+#include "log.h"
+
+// Check the pin is compatible with the platform
+#if WS2812_PIN_BASE >= NUM_BANK0_GPIOS
+#error Attempting to use a pin>=32 on a platform that does not support it
+#endif
+
+// bit plane content dma channel
+#define DMA_CHANNEL 0
+// chain channel for configuring main dma channel to output from disjoint fragments of memory, or from control blocks
+#define DMA_CB_CHANNEL 1
+
+#define DMA_CHANNEL_MASK (1u << DMA_CHANNEL)
+#define DMA_CB_CHANNEL_MASK (1u << DMA_CB_CHANNEL)
+#define DMA_CHANNELS_MASK (DMA_CHANNEL_MASK | DMA_CB_CHANNEL_MASK)
+
+// Every state machine of the output shares one PIO, picked by the first hal_pio_claim
+static PIO pio;
+static uint program_offset[NUM_PIO_STATE_MACHINES];
+
+static void (*dma_complete_handler)();
+
+typedef enum
+{
+    DMA_MODE_NONE = 0,
+    DMA_MODE_FRAGMENTS = 1,
+    DMA_MODE_CHAIN = 2,
+} DmaMode;
+
+static DmaMode dma_mode = DMA_MODE_NONE;
+static uint dma_mode_sm;
+static uint dma_mode_words;
+
+// One DMA transfer, in the register order of a channel's fourth alias (ctrl, write, count, read trigger).
+// Ending on the read address trigger means the null block that ends a chain only writes 0 to
+// al3_read_addr_trig and leaves a real ctrl word, with IRQ_QUIET set, in the channel.
+typedef struct
+{
+    uint32_t ctrl;
+    volatile void *write_addr;
+    uint32_t transfer_count;
+    const volatile void *read_addr;
+} dma_control_block_t;
+
+struct hal_dma_chain
+{
+    uint32_t count;
+    // count blocks and a null block (no data, a NULL read trigger) that stops the control channel and,
+    // as the channel is IRQ_QUIET, raises the IRQ
+    dma_control_block_t blocks[];
+};
+
+// alarm pool owned by the core that called hal_alarm_init
+static alarm_pool_t *alarm_pool;
+
+int hal_pio_claim(const hal_pio_program_t *program, uint out_base, uint out_count, uint pull_threshold, float cycles_per_second)
+{
+    struct pio_program pio_program = {
+        .instructions = program->instructions,
+        .length = program->length,
+        .origin = -1,
+        .pio_version = 0,
+#if PICO_PIO_VERSION > 0
+        .used_gpio_ranges = 0x0
+#endif
+    };
+    uint sm;
+    uint offset;
+    if (pio == NULL)
+    {
+        if (!pio_claim_free_sm_and_add_program_for_gpio_range(&pio_program, &pio, &sm, &offset, out_base, out_count, true))
+            return -1;
+    }
+    else
+    {
+        if (!pio_can_add_program(pio, &pio_program))
+            return -1;
+        int claimed = pio_claim_unused_sm(pio, false);
+        if (claimed < 0)
+            return -1;
+        sm = claimed;
+        offset = pio_add_program(pio, &pio_program);
+    }
+    program_offset[sm] = offset;
+
+    for (uint i = out_base; i < out_base + out_count; i++)
+    {
+        pio_gpio_init(pio, i);
+    }
+    pio_sm_set_consecutive_pindirs(pio, sm, out_base, out_count, true);
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + program->wrap_target, offset + program->wrap);
+    sm_config_set_out_shift(&c, true, true, pull_threshold);
+    sm_config_set_out_pins(&c, out_base, out_count);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
+    if (cycles_per_second > 0)
+    {
+        float div = clock_get_hz(clk_sys) / cycles_per_second;
+        sm_config_set_clkdiv(&c, div);
+        LOG(LOG_PIO_CLOCK_DIVIDER, (int32_t)div);
+    }
+    pio_sm_init(pio, sm, offset, &c);
+    return sm;
+}
+
+void hal_pio_unclaim(int sm, const hal_pio_program_t *program)
+{
+    struct pio_program pio_program = {
+        .instructions = program->instructions,
+        .length = program->length,
+        .origin = -1,
+        .pio_version = 0,
+    };
+    pio_sm_set_enabled(pio, sm, false);
+    pio_remove_program(pio, &pio_program, program_offset[sm]);
+    pio_sm_unclaim(pio, sm);
+}
+
+void hal_pio_enable_mask(uint32_t sm_mask)
+{
+    pio_enable_sm_mask_in_sync(pio, sm_mask);
+}
+
+bool hal_pio_tx_empty(uint sm)
+{
+    return pio_sm_is_tx_fifo_empty(pio, sm);
+}
+
+void hal_pio_clear_irq(uint irq)
+{
+    pio_interrupt_clear(pio, irq);
+}
+
+void hal_gpio_init_out(uint pin)
+{
+    gpio_init(pin);
+    gpio_set_dir(pin, GPIO_OUT);
+}
+
+void hal_gpio_put(uint pin, bool value)
+{
+    gpio_put(pin, value);
+}
+
+static void __isr dma_irq_handler()
+{
+    if (dma_hw->ints0 & DMA_CHANNEL_MASK)
+    {
+        // clear IRQ
+        dma_hw->ints0 = DMA_CHANNEL_MASK;
+        if (dma_complete_handler)
+            dma_complete_handler();
+    }
+}
+
+void hal_dma_init(void (*complete_handler)())
+{
+    dma_claim_mask(DMA_CHANNELS_MASK);
+    dma_complete_handler = complete_handler;
+    irq_set_exclusive_handler(DMA_IRQ_0, dma_irq_handler);
+    dma_channel_set_irq0_enabled(DMA_CHANNEL, true);
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+void hal_dma_start_fragments(const uintptr_t *fragments, uint words_per_fragment, uint sm)
+{
+    if (dma_mode != DMA_MODE_FRAGMENTS || dma_mode_sm != sm || dma_mode_words != words_per_fragment)
+    {
+        // main DMA channel outputs a fragment, and then chains back to the chain channel
+        dma_channel_config channel_config = dma_channel_get_default_config(DMA_CHANNEL);
+        channel_config_set_dreq(&channel_config, pio_get_dreq(pio, sm, true));
+        channel_config_set_chain_to(&channel_config, DMA_CB_CHANNEL);
+        channel_config_set_irq_quiet(&channel_config, true);
+        dma_channel_configure(DMA_CHANNEL,
+                              &channel_config,
+                              &pio->txf[sm],
+                              NULL, // set by chain
+                              words_per_fragment,
+                              false);
+
+        // chain channel sends single word pointer to start of fragment each time
+        dma_channel_config chain_config = dma_channel_get_default_config(DMA_CB_CHANNEL);
+        dma_channel_configure(DMA_CB_CHANNEL,
+                              &chain_config,
+                              &dma_channel_hw_addr(
+                                   DMA_CHANNEL)
+                                   ->al3_read_addr_trig, // ch DMA config (target "ring" buffer size 4) - this is (read_addr trigger)
+                              NULL,                      // set later
+                              1,
+                              false);
+        dma_mode = DMA_MODE_FRAGMENTS;
+        dma_mode_sm = sm;
+        dma_mode_words = words_per_fragment;
+    }
+    dma_channel_hw_addr(DMA_CB_CHANNEL)->al3_read_addr_trig = (uintptr_t)fragments;
+}
+
+hal_dma_chain_t *hal_dma_create_chain(const hal_dma_block_t *blocks, uint count)
+{
+    hal_dma_chain_t *chain = malloc(sizeof(hal_dma_chain_t) + (count + 1) * sizeof(dma_control_block_t));
+    if (chain == NULL)
+        return NULL;
+    chain->count = count;
+
+    dma_channel_config c = dma_channel_get_default_config(DMA_CHANNEL);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_chain_to(&c, DMA_CB_CHANNEL);
+    channel_config_set_irq_quiet(&c, true);
+    for (uint i = 0; i < count; i++)
+    {
+        channel_config_set_dreq(&c, pio_get_dreq(pio, blocks[i].sm, true));
+        chain->blocks[i] = (dma_control_block_t){channel_config_get_ctrl_value(&c), &pio->txf[blocks[i].sm], blocks[i].count, blocks[i].read_addr};
+    }
+    // The last block's ctrl and write address again, so a null trigger is all the end of the chain changes
+    chain->blocks[count] = count ? chain->blocks[count - 1] : (dma_control_block_t){channel_config_get_ctrl_value(&c), &pio->txf[0], 0, NULL};
+    chain->blocks[count].transfer_count = 0;
+    chain->blocks[count].read_addr = NULL;
+    return chain;
+}
+
+void hal_dma_start_chain(hal_dma_chain_t *chain)
+{
+    if (dma_mode != DMA_MODE_CHAIN)
+    {
+        // The control channel writes a 4 word block to the data channel's fourth register alias, the last word
+        // triggers it. The data channel chains back when done, and the write address rings back to al3_ctrl.
+        dma_channel_config chain_config = dma_channel_get_default_config(DMA_CB_CHANNEL);
+        channel_config_set_read_increment(&chain_config, true);
+        channel_config_set_write_increment(&chain_config, true);
+        channel_config_set_ring(&chain_config, true, 4); // 16 byte ring on the write address
+        dma_channel_configure(DMA_CB_CHANNEL,
+                              &chain_config,
+                              &dma_hw->ch[DMA_CHANNEL].al3_ctrl,
+                              NULL, // set for each frame
+                              sizeof(dma_control_block_t) / sizeof(uint32_t),
+                              false);
+        dma_mode = DMA_MODE_CHAIN;
+    }
+    dma_channel_set_read_addr(DMA_CB_CHANNEL, chain->blocks, true);
+}
+
+uint32_t hal_time_us_32()
+{
+    return time_us_32();
+}
+
+uint64_t hal_time_us_64()
+{
+    return time_us_64();
+}
+
+void hal_busy_wait_us(uint32_t us)
+{
+    busy_wait_us_32(us);
+}
+
+void hal_busy_wait_until_us(uint64_t time_us)
+{
+    busy_wait_until(from_us_since_boot(time_us));
+}
+
+void hal_tight_loop()
+{
+    tight_loop_contents();
+}
+
+void hal_alarm_init()
+{
+    // Created on the calling core, so its alarm IRQ is handled by that core as well
+    alarm_pool = alarm_pool_create_with_unused_hardware_alarm(4);
+}
+
+hal_alarm_id_t hal_alarm_add_in_us(uint32_t us, hal_alarm_callback_t callback, void *user_data)
+{
+    return alarm_pool_add_alarm_in_us(alarm_pool, us, callback, user_data, true);
+}
+
+void hal_alarm_cancel(hal_alarm_id_t id)
+{
+    alarm_pool_cancel_alarm(alarm_pool, id);
+}
+
+void hal_sem_init(hal_sem_t *sem, int16_t initial_permits, int16_t max_permits)
+{
+    sem_init(sem, initial_permits, max_permits);
+}
+
+void hal_sem_acquire_blocking(hal_sem_t *sem)
+{
+    sem_acquire_blocking(sem);
+}
+
+bool hal_sem_try_acquire(hal_sem_t *sem)
+{
+    return sem_try_acquire(sem);
+}
+
+bool hal_sem_release(hal_sem_t *sem)
+{
+    return sem_release(sem);
+}
+
+uint32_t hal_atomic_fetch_add(volatile uint32_t *value, uint32_t add)
+{
+    // The RP2040 has no atomic read-modify-write, a hardware spin lock also keeps out the other core
+    spin_lock_t *lock = spin_lock_instance(PICO_SPINLOCK_ID_STRIPED_FIRST);
+    uint32_t save = spin_lock_blocking(lock);
+    uint32_t old = *value;
+    *value = old + add;
+    spin_unlock(lock, save);
+    return old;
+}
+
+void hal_core1_launch(void (*entry)())
+{
+    multicore_reset_core1();
+    multicore_launch_core1(entry);
+}
+
+void hal_fifo_push_blocking(uint32_t value)
+{
+    multicore_fifo_push_blocking(value);
+}
+
+uint32_t hal_fifo_pop_blocking()
+{
+    return multicore_fifo_pop_blocking();
+}
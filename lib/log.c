@@ -0,0 +1,82 @@
+#include "defines.h"
+#include "log.h"
+#include "hal.h"
+
+#if PIXELBLIT_LOG
+
+static const char *const formats[LOG_CODE_COUNT] = {
+    [LOG_RASTER_LIMIT] = "Max raster objects reached, not creating new raster object",
+    [LOG_RASTER_CREATED] = "Created raster object %d, height %d, width %d",
+    [LOG_WRAP_DISABLED] = "Width %d does not evenly divide NUM_PIXELS, WRAP mode disabled, NO_WRAP defaulting",
+    [LOG_INVALID_RASTER] = "Invalid raster object %d",
+    [LOG_PLAN_ALLOC_FAILED] = "No room in the raster pool for the encode plan of raster %d",
+    [LOG_SHOW_QUEUE_FULL] = "Too many raster objects shown in one frame, not showing %d",
+    [LOG_NO_OUTPUT_SM] = "No state machine for the output, schedule %d",
+    [LOG_NO_SELECT_SM] = "No state machine for board select",
+    [LOG_PIO_CLOCK_DIVIDER] = "PIO clock divider %d",
+    [LOG_GEOMETRY_INVALID] = "Geometry is beyond the limits in defines.h or has no pixels",
+    [LOG_ARENA_ALLOC_FAILED] = "Failed to allocate %d bytes for the geometry",
+    [LOG_ARENA_ALLOCATED] = "Allocated %d bytes for %d boards and %d rasters",
+    [LOG_RASTER_POOL_FULL] = "Raster pool full, raster %d needs %d bytes",
+};
+
+static log_record_t records[LOG_RECORDS];
+// Sequence of the last message stored
+static volatile uint32_t write_sequence;
+// Sequence of the next message to print, only touched by log_drain
+static uint32_t read_sequence = 1;
+static uint32_t dropped;
+
+void log_record(LogCode code, const char *function, int32_t arg0, int32_t arg1, int32_t arg2)
+{
+    uint32_t sequence = hal_atomic_fetch_add(&write_sequence, 1) + 1;
+    log_record_t *record = &records[sequence & (LOG_RECORDS - 1)];
+    // log_drain skips the slot until its sequence is written back
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    record->code = code;
+    record->function = function;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    __atomic_store_n(&record->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+uint32_t log_drain(uint32_t max_messages)
+{
+    uint32_t printed = 0;
+    while (printed < max_messages)
+    {
+        uint32_t last = write_sequence;
+        if (read_sequence > last)
+            break;
+        // Messages the writers have lapped are gone
+        if (last - read_sequence >= LOG_RECORDS)
+        {
+            uint32_t oldest = last - LOG_RECORDS + 1;
+            dropped += oldest - read_sequence;
+            printf("(%u log messages dropped)\n", oldest - read_sequence);
+            read_sequence = oldest;
+        }
+        const log_record_t *record = &records[read_sequence & (LOG_RECORDS - 1)];
+        log_record_t copy = *record;
+        uint32_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        // Not written yet, print it next time
+        if (sequence < read_sequence)
+            break;
+        // Written while it was copied, or overwritten and caught by the lapped check on the next pass
+        if (sequence != read_sequence || copy.sequence != read_sequence)
+            continue;
+        printf(formats[copy.code], copy.args[0], copy.args[1], copy.args[2]);
+        printf(" (%s)\n", copy.function);
+        read_sequence++;
+        printed++;
+    }
+    return printed;
+}
+
+uint32_t log_dropped()
+{
+    return dropped;
+}
+
+#endif
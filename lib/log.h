@@ -0,0 +1,65 @@
+#ifndef LOG_H
+#define LOG_H
+#include "defines.h"
+
+// Deferred logging: LOG stores a message code and its arguments in a ring, and log_drain formats and
+// prints them later, from core 0 between frames. Neither core, nor the DMA interrupt, waits on stdio
+// to log. When the ring is full the oldest undrained messages are dropped, and counted.
+// Like the trace ring, a slot is taken under hal_atomic_fetch_add, a hardware spin lock on the RP2040.
+
+// Build with PIXELBLIT_LOG=0 to compile out every LOG call and the ring
+#ifndef PIXELBLIT_LOG
+#define PIXELBLIT_LOG 1
+#endif
+// Messages kept until drained, a power of two
+#define LOG_RECORDS 64
+
+typedef enum
+{
+    LOG_RASTER_LIMIT = 0,
+    LOG_RASTER_CREATED = 1,    // raster id, height, width
+    LOG_WRAP_DISABLED = 2,     // raster width
+    LOG_INVALID_RASTER = 3,    // raster id
+    LOG_PLAN_ALLOC_FAILED = 4, // raster id
+    LOG_SHOW_QUEUE_FULL = 5,   // raster id
+    LOG_NO_OUTPUT_SM = 6,      // output schedule
+    LOG_NO_SELECT_SM = 7,
+    LOG_PIO_CLOCK_DIVIDER = 8, // divider
+    LOG_GEOMETRY_INVALID = 9,
+    LOG_ARENA_ALLOC_FAILED = 10, // bytes
+    LOG_ARENA_ALLOCATED = 11,    // bytes, boards present, raster slots
+    LOG_RASTER_POOL_FULL = 12,   // raster id, bytes
+    LOG_CODE_COUNT = 13,
+} LogCode;
+
+typedef struct
+{
+    uint32_t sequence; // index of the message + 1, 0 while it is being written
+    uint16_t code;
+    const char *function; // where it was logged from, a string literal
+    int32_t args[3];
+} log_record_t;
+
+#if PIXELBLIT_LOG
+#define LOG(code, ...) log_write((code), __func__, ##__VA_ARGS__, 0, 0, 0)
+// Store a message, args beyond those the code's format uses are ignored
+#define log_write(code, function, a, b, c, ...) log_record((code), (function), (a), (b), (c))
+
+void log_record(LogCode code, const char *function, int32_t arg0, int32_t arg1, int32_t arg2);
+
+// Print up to max_messages stored messages, oldest first. Returns the number printed.
+uint32_t log_drain(uint32_t max_messages);
+
+// Messages overwritten before they were drained
+uint32_t log_dropped();
+#else
+#define LOG(code, ...) ((void)0)
+static inline uint32_t log_drain(uint32_t max_messages)
+{
+    (void)max_messages;
+    return 0;
+}
+static inline uint32_t log_dropped() { return 0; }
+#endif
+
+#endif // LOG_H
@@ -0,0 +1,54 @@
+#ifndef PIO_PROGRAMS_H
+#define PIO_PROGRAMS_H
+#include "defines.h"
+#include "encoder.h"
+
+// PIO programs of the parallel output and the pins they drive.
+// Shared by pixelblit.c and the host simulator (piosim.h).
+
+#define WS2812_PIN_BASE 3
+// First strip pin, GPIO 4. With 32 bit planes plane bit PLANE_STRIP_SHIFT drives it.
+#define STRIP_PIN_BASE (WS2812_PIN_BASE + 1)
+// Board address pins, GPIO 0-3
+#define BOARD_SELECT_PIN_BASE 0
+#define BOARD_SELECT_PIN_COUNT 4
+#if PACKED_PLANES
+// Planes are shifted out 16 bits at a time straight onto the strip pins, autopull stays at 32 so each
+// DMA word carries two planes
+#define PLANE_PIN_BASE STRIP_PIN_BASE
+#define PLANE_PIN_COUNT STRIPS
+#else
+#define PLANE_PIN_BASE WS2812_PIN_BASE
+#define PLANE_PIN_COUNT (STRIPS + WS2812_PIN_BASE)
+#endif
+
+// The programs are assembled from ws2812.pio into generated/ws2812.pio.h, by pico_generate_pio_header in
+// the Pico build and, with pioasm on the path, for the host builds too. Host builds only use the instruction
+// words and defines, not the SDK config helpers.
+#if defined(LOCAL_BUILD) && !defined(PICO_NO_HARDWARE)
+#define PICO_NO_HARDWARE 1
+#endif
+#include "../generated/ws2812.pio.h"
+
+// The data programs this build runs
+#if PACKED_PLANES
+#define plane_program_instructions ws2812_parallel_packed_program_instructions
+#define plane_program_wrap_target ws2812_parallel_packed_wrap_target
+#define plane_program_wrap ws2812_parallel_packed_wrap
+#define chained_program_instructions ws2812_parallel_chained_packed_program_instructions
+#define chained_program_wrap_target ws2812_parallel_chained_packed_wrap_target
+#define chained_program_wrap ws2812_parallel_chained_packed_wrap
+#else
+#define plane_program_instructions ws2812_parallel_program_instructions
+#define plane_program_wrap_target ws2812_parallel_wrap_target
+#define plane_program_wrap ws2812_parallel_wrap
+#define chained_program_instructions ws2812_parallel_chained_program_instructions
+#define chained_program_wrap_target ws2812_parallel_chained_wrap_target
+#define chained_program_wrap ws2812_parallel_chained_wrap
+#endif
+
+// PIO IRQ flags the two chained programs hand a board over with
+#define BOARD_SELECTED_IRQ 4
+#define BOARD_SENT_IRQ 5
+
+#endif // PIO_PROGRAMS_H
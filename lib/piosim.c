@@ -0,0 +1,587 @@
+#include "defines.h"
+#include "piosim.h"
+#include "pio_programs.h"
+
+// A WS2812 samples its input this many cycles (0.625us) after the rising edge
+#define PIOSIM_SAMPLE_CYCLES 5
+
+void piosim_init(piosim_t *sim)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->timing.zero_high_min = UINT32_MAX;
+    sim->timing.one_high_min = UINT32_MAX;
+    sim->timing.period_min = UINT32_MAX;
+}
+
+void piosim_sm_config(piosim_t *sim, uint sm, const uint16_t *instructions, uint length, uint wrap_target, uint wrap)
+{
+    piosim_sm_t *s = &sim->sm[sm];
+    s->instructions = instructions;
+    s->length = length;
+    s->wrap_target = wrap_target;
+    s->wrap = wrap;
+    // Same defaults as pio_get_default_sm_config
+    s->shift_right = true;
+    s->autopull = false;
+    s->pull_threshold = 32;
+}
+
+void piosim_sm_set_out(piosim_t *sim, uint sm, uint out_base, uint out_count, bool shift_right, bool autopull, uint pull_threshold)
+{
+    piosim_sm_t *s = &sim->sm[sm];
+    s->out_base = out_base;
+    s->out_count = out_count;
+    s->shift_right = shift_right;
+    s->autopull = autopull;
+    s->pull_threshold = pull_threshold;
+}
+
+void piosim_sm_enable(piosim_t *sim, uint sm)
+{
+    piosim_sm_t *s = &sim->sm[sm];
+    s->enabled = true;
+    s->pc = 0;
+    s->osr_count = 32;
+    s->delay = 0;
+    s->stalled = false;
+}
+
+void piosim_set_pio_pins(piosim_t *sim, uint pin_base, uint pin_count)
+{
+    for (uint pin = pin_base; pin < pin_base + pin_count; pin++)
+    {
+        sim->pio_pins |= 1u << (pin & 31);
+    }
+}
+
+void piosim_gpio_put(piosim_t *sim, uint pin, bool value)
+{
+    if (value)
+        sim->sio_out |= 1u << pin;
+    else
+        sim->sio_out &= ~(1u << pin);
+}
+
+void piosim_dma_start(piosim_t *sim, const piosim_segment_t *segments, uint count)
+{
+    sim->segments = segments;
+    sim->segment_count = count;
+    sim->segment = 0;
+    sim->segment_word = 0;
+}
+
+bool piosim_dma_busy(const piosim_t *sim)
+{
+    return sim->segment < sim->segment_count;
+}
+
+uint piosim_fragment_segments(piosim_segment_t *segments, const uintptr_t *fragments, uint words_per_fragment, uint sm)
+{
+    uint count = 0;
+    for (; fragments[count]; count++)
+    {
+        segments[count] = (piosim_segment_t){(const uint32_t *)fragments[count], words_per_fragment, sm};
+    }
+    return count;
+}
+
+static bool fifo_pop(piosim_sm_t *s, uint32_t *value)
+{
+    if (s->fifo_count == 0)
+    {
+        return false;
+    }
+    *value = s->fifo[s->fifo_head];
+    s->fifo_head = (s->fifo_head + 1) % PIOSIM_FIFO_DEPTH;
+    s->fifo_count--;
+    return true;
+}
+
+static void write_pins(piosim_t *sim, uint base, uint count, uint32_t value)
+{
+    for (uint i = 0; i < count; i++)
+    {
+        uint pin = (base + i) & 31;
+        if ((value >> i) & 1u)
+            sim->pio_out |= 1u << pin;
+        else
+            sim->pio_out &= ~(1u << pin);
+    }
+}
+
+// Shift count bits out of the OSR, as OUT does
+static uint32_t shift_osr(piosim_sm_t *s, uint count)
+{
+    uint32_t value;
+    if (count == 32)
+    {
+        value = s->osr;
+        s->osr = 0;
+    }
+    else if (s->shift_right)
+    {
+        value = s->osr & ((1u << count) - 1);
+        s->osr >>= count;
+    }
+    else
+    {
+        value = s->osr >> (32 - count);
+        s->osr <<= count;
+    }
+    s->osr_count = s->osr_count + count > 32 ? 32 : s->osr_count + count;
+    return value;
+}
+
+static uint irq_index(uint sm, uint index)
+{
+    // Bit 4 selects an index relative to the state machine number
+    if (index & 0x10)
+    {
+        return (index & 4) | ((index + sm) & 3);
+    }
+    return index & 7;
+}
+
+static uint32_t read_source(piosim_t *sim, piosim_sm_t *s, uint source)
+{
+    switch (source)
+    {
+    case 0:
+        return sim->pins;
+    case 1:
+        return s->x;
+    case 2:
+        return s->y;
+    case 3:
+        return 0;
+    case 5: // STATUS, all ones while the TX FIFO is below the default level of 0
+        return s->fifo_count < 1 ? 0xffffffffu : 0;
+    case 7:
+        return s->osr;
+    default:
+        fprintf(stderr, "piosim: unsupported source %u\n", source);
+        abort();
+    }
+}
+
+// Execute one instruction, returns false if the state machine stalled on it
+static bool execute(piosim_t *sim, uint smi)
+{
+    piosim_sm_t *s = &sim->sm[smi];
+    uint16_t instruction = s->instructions[s->pc];
+    uint opcode = instruction >> 13;
+    uint delay = (instruction >> 8) & 0x1f;
+    uint arg1 = (instruction >> 5) & 7;
+    uint arg2 = instruction & 0x1f;
+    bool jumped = false;
+
+    s->waiting_for_data = false;
+    switch (opcode)
+    {
+    case 0: // JMP
+    {
+        bool take;
+        switch (arg1)
+        {
+        case 0:
+            take = true;
+            break;
+        case 1:
+            take = s->x == 0;
+            break;
+        case 2:
+            take = s->x-- != 0;
+            break;
+        case 3:
+            take = s->y == 0;
+            break;
+        case 4:
+            take = s->y-- != 0;
+            break;
+        case 5:
+            take = s->x != s->y;
+            break;
+        case 7:
+            take = s->osr_count < s->pull_threshold;
+            break;
+        default:
+            fprintf(stderr, "piosim: unsupported jmp condition %u\n", arg1);
+            abort();
+        }
+        if (take)
+        {
+            s->pc = arg2;
+            jumped = true;
+        }
+        break;
+    }
+    case 1: // WAIT
+    {
+        bool polarity = arg1 >> 2;
+        uint source = arg1 & 3;
+        if (source == 0)
+        {
+            if (((sim->pins >> arg2) & 1u) != polarity)
+                return false;
+        }
+        else if (source == 2)
+        {
+            uint flag = 1u << irq_index(smi, arg2);
+            if (((sim->irq & flag) != 0) != polarity)
+                return false;
+            if (polarity)
+                sim->irq &= ~flag;
+        }
+        else
+        {
+            fprintf(stderr, "piosim: unsupported wait source %u\n", source);
+            abort();
+        }
+        break;
+    }
+    case 3: // OUT
+    {
+        uint count = arg2 ? arg2 : 32;
+        if (s->autopull && s->osr_count >= s->pull_threshold)
+        {
+            if (!fifo_pop(s, &s->osr))
+            {
+                s->waiting_for_data = true;
+                return false;
+            }
+            s->osr_count = 0;
+        }
+        uint32_t value = shift_osr(s, count);
+        switch (arg1)
+        {
+        case 0:
+            write_pins(sim, s->out_base, s->out_count < count ? s->out_count : count, value);
+            break;
+        case 1:
+            s->x = value;
+            break;
+        case 2:
+            s->y = value;
+            break;
+        case 3:
+            break;
+        case 5:
+            s->pc = value & 0x1f;
+            jumped = true;
+            break;
+        default:
+            fprintf(stderr, "piosim: unsupported out destination %u\n", arg1);
+            abort();
+        }
+        break;
+    }
+    case 4: // PUSH / PULL
+    {
+        if (!(instruction & 0x80))
+        {
+            fprintf(stderr, "piosim: push is not supported\n");
+            abort();
+        }
+        bool if_empty = instruction & 0x40;
+        bool block = instruction & 0x20;
+        if (if_empty && s->osr_count < s->pull_threshold)
+            break;
+        if (!fifo_pop(s, &s->osr))
+        {
+            if (block)
+            {
+                s->waiting_for_data = true;
+                return false;
+            }
+            s->osr = s->x;
+        }
+        s->osr_count = 0;
+        break;
+    }
+    case 5: // MOV
+    {
+        uint op = (arg2 >> 3) & 3;
+        uint32_t value = read_source(sim, s, arg2 & 7);
+        if (op == 1)
+        {
+            value = ~value;
+        }
+        else if (op == 2)
+        {
+            uint32_t reversed = 0;
+            for (int i = 0; i < 32; i++)
+                reversed |= ((value >> i) & 1u) << (31 - i);
+            value = reversed;
+        }
+        switch (arg1)
+        {
+        case 0:
+            write_pins(sim, s->out_base, s->out_count, value);
+            break;
+        case 1:
+            s->x = value;
+            break;
+        case 2:
+            s->y = value;
+            break;
+        case 5:
+            s->pc = value & 0x1f;
+            jumped = true;
+            break;
+        case 7:
+            s->osr = value;
+            s->osr_count = 0;
+            break;
+        default:
+            fprintf(stderr, "piosim: unsupported mov destination %u\n", arg1);
+            abort();
+        }
+        break;
+    }
+    case 6: // IRQ
+    {
+        uint flag = 1u << irq_index(smi, arg2);
+        if (instruction & 0x40)
+        {
+            sim->irq &= ~flag;
+        }
+        else
+        {
+            sim->irq |= flag;
+            if (instruction & 0x20)
+            {
+                fprintf(stderr, "piosim: irq wait is not supported\n");
+                abort();
+            }
+        }
+        break;
+    }
+    case 7: // SET
+        switch (arg1)
+        {
+        case 1:
+            s->x = arg2;
+            break;
+        case 2:
+            s->y = arg2;
+            break;
+        default:
+            fprintf(stderr, "piosim: unsupported set destination %u\n", arg1);
+            abort();
+        }
+        break;
+    default:
+        fprintf(stderr, "piosim: unsupported instruction %04x\n", instruction);
+        abort();
+    }
+
+    if (!jumped)
+    {
+        s->pc = s->pc == s->wrap ? s->wrap_target : s->pc + 1;
+    }
+    s->delay = delay;
+    return true;
+}
+
+static void decode_strips(piosim_t *sim, uint32_t old_pins)
+{
+    uint board = (sim->pins >> BOARD_SELECT_PIN_BASE) & ((1u << BOARD_SELECT_PIN_COUNT) - 1);
+    for (uint strip = 0; strip < STRIPS; strip++)
+    {
+        uint pin = STRIP_PIN_BASE + strip;
+        bool was_high = (old_pins >> pin) & 1u;
+        bool high = (sim->pins >> pin) & 1u;
+        if (high && !was_high)
+        {
+            if (board < BOARDS)
+            {
+                piosim_strip_t *s = &sim->strips[board][strip];
+                if (s->receiving && sim->cycle - s->last_fall < PIOSIM_RESET_CYCLES)
+                {
+                    uint32_t period = sim->cycle - sim->strip_rise[strip];
+                    if (sim->board_at_rise[strip] == board)
+                    {
+                        if (period < sim->timing.period_min)
+                            sim->timing.period_min = period;
+                        if (period > sim->timing.period_max)
+                            sim->timing.period_max = period;
+                    }
+                }
+                else
+                {
+                    // Low for longer than the reset time, this is the start of a new frame
+                    if (s->receiving)
+                        s->frames++;
+                    s->receiving = true;
+                    s->bits = 0;
+                }
+            }
+            sim->strip_rise[strip] = sim->cycle;
+            sim->board_at_rise[strip] = board;
+        }
+        else if (!high && was_high && sim->board_at_rise[strip] < BOARDS)
+        {
+            piosim_strip_t *s = &sim->strips[sim->board_at_rise[strip]][strip];
+            uint32_t high_cycles = sim->cycle - sim->strip_rise[strip];
+            bool bit = high_cycles >= PIOSIM_SAMPLE_CYCLES;
+            piosim_timing_t *t = &sim->timing;
+            if (bit)
+            {
+                if (high_cycles < t->one_high_min)
+                    t->one_high_min = high_cycles;
+                if (high_cycles > t->one_high_max)
+                    t->one_high_max = high_cycles;
+            }
+            else
+            {
+                if (high_cycles < t->zero_high_min)
+                    t->zero_high_min = high_cycles;
+                if (high_cycles > t->zero_high_max)
+                    t->zero_high_max = high_cycles;
+            }
+            t->bits++;
+
+            // Each pixel takes the first 24 bits it sees, MSB first, and passes the rest on
+            uint pixel = s->bits / 24;
+            if (pixel < NUM_PIXELS)
+            {
+                uint32_t mask = 1u << (23 - s->bits % 24);
+                s->pixels[pixel] = bit ? (s->pixels[pixel] | mask) : (s->pixels[pixel] & ~mask);
+            }
+            s->bits++;
+            s->last_fall = sim->cycle;
+        }
+    }
+}
+
+void piosim_step(piosim_t *sim)
+{
+    // DMA: one word per cycle, paced by the target FIFO having room
+    if (piosim_dma_busy(sim))
+    {
+        const piosim_segment_t *segment = &sim->segments[sim->segment];
+        piosim_sm_t *target = &sim->sm[segment->sm];
+        if (segment->count == 0)
+        {
+            sim->segment++;
+        }
+        else if (target->fifo_count < PIOSIM_FIFO_DEPTH)
+        {
+            target->fifo[(target->fifo_head + target->fifo_count) % PIOSIM_FIFO_DEPTH] = segment->read_addr[sim->segment_word];
+            target->fifo_count++;
+            sim->dma_words++;
+            if (++sim->segment_word == segment->count)
+            {
+                sim->segment++;
+                sim->segment_word = 0;
+            }
+        }
+        if (!piosim_dma_busy(sim))
+        {
+            sim->dma_done_cycle = sim->cycle;
+        }
+    }
+
+    for (uint i = 0; i < PIOSIM_SM_COUNT; i++)
+    {
+        piosim_sm_t *s = &sim->sm[i];
+        if (!s->enabled)
+            continue;
+        if (s->delay)
+        {
+            s->delay--;
+            continue;
+        }
+        s->stalled = !execute(sim, i);
+        if (s->stalled)
+        {
+            s->stall_cycles++;
+        }
+    }
+
+    uint32_t old_pins = sim->pins;
+    sim->pins = (sim->pio_out & sim->pio_pins) | (sim->sio_out & ~sim->pio_pins);
+    sim->cycle++;
+    if (sim->pins != old_pins)
+    {
+        decode_strips(sim, old_pins);
+    }
+}
+
+void piosim_run(piosim_t *sim, uint64_t cycles)
+{
+    for (uint64_t i = 0; i < cycles; i++)
+    {
+        piosim_step(sim);
+    }
+}
+
+bool piosim_idle(const piosim_t *sim)
+{
+    if (piosim_dma_busy(sim))
+    {
+        return false;
+    }
+    for (uint i = 0; i < PIOSIM_SM_COUNT; i++)
+    {
+        const piosim_sm_t *s = &sim->sm[i];
+        if (s->enabled && !(s->stalled && s->delay == 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void piosim_skip(piosim_t *sim, uint64_t cycles)
+{
+    if (cycles == 0)
+    {
+        return;
+    }
+    // The first step picks up what was changed from outside since the last one, after that nothing moves
+    piosim_step(sim);
+    if (!piosim_idle(sim))
+    {
+        return;
+    }
+    sim->cycle += cycles - 1;
+    for (uint i = 0; i < PIOSIM_SM_COUNT; i++)
+    {
+        if (sim->sm[i].enabled)
+        {
+            sim->sm[i].stall_cycles += cycles - 1;
+        }
+    }
+}
+
+bool piosim_run_until_drained(piosim_t *sim, uint sm, uint64_t max_cycles)
+{
+    for (uint64_t i = 0; i < max_cycles; i++)
+    {
+        piosim_step(sim);
+        const piosim_sm_t *s = &sim->sm[sm];
+        if (!piosim_dma_busy(sim) && s->fifo_count == 0 && s->waiting_for_data)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void piosim_latch(piosim_t *sim)
+{
+    piosim_run(sim, PIOSIM_RESET_CYCLES);
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        for (uint strip = 0; strip < STRIPS; strip++)
+        {
+            piosim_strip_t *s = &sim->strips[board][strip];
+            if (s->receiving && sim->cycle - s->last_fall >= PIOSIM_RESET_CYCLES)
+            {
+                s->receiving = false;
+                s->frames++;
+            }
+        }
+    }
+}
@@ -0,0 +1,140 @@
+#ifndef PIOSIM_H
+#define PIOSIM_H
+#include "defines.h"
+
+// Host simulator of the output path: PIO state machines running the real program words, a DMA
+// feeding their TX FIFOs, and a decoder that turns the strip pins back into WS2812 pixels.
+// Time is counted in PIO cycles, 10 per WS2812 bit at 800kHz.
+
+#define PIOSIM_SM_COUNT 4
+#define PIOSIM_FIFO_DEPTH 8 // TX FIFO with the RX FIFO joined to it
+#define PIOSIM_CYCLE_NS 125
+// Low time after which a WS2812 latches, 50us
+#define PIOSIM_RESET_CYCLES 400
+
+typedef struct
+{
+    // configuration, set before piosim_sm_enable
+    const uint16_t *instructions;
+    uint length;
+    uint wrap_target;
+    uint wrap;
+    uint out_base;
+    uint out_count;
+    bool shift_right;
+    bool autopull;
+    uint pull_threshold;
+
+    // state
+    bool enabled;
+    uint pc;
+    uint32_t x;
+    uint32_t y;
+    uint32_t osr;
+    uint osr_count; // bits shifted out of the osr, 32 when empty
+    uint delay;
+    uint32_t fifo[PIOSIM_FIFO_DEPTH];
+    uint fifo_head;
+    uint fifo_count;
+    bool waiting_for_data; // stalled on an OUT or PULL with an empty FIFO
+    bool stalled;          // the last instruction stalled
+    uint64_t stall_cycles;
+} piosim_sm_t;
+
+// One DMA transfer: count words from read_addr into the TX FIFO of state machine sm
+typedef struct
+{
+    const uint32_t *read_addr;
+    uint32_t count;
+    uint sm;
+} piosim_segment_t;
+
+// Bits received by one strip of one board since its last latch
+typedef struct
+{
+    uint32_t pixels[NUM_PIXELS];
+    uint32_t bits;
+    uint32_t frames; // number of times the strip latched after receiving data
+    uint64_t last_fall;
+    bool receiving;
+} piosim_strip_t;
+
+// Pulse timing seen on the strip pins, in PIO cycles
+typedef struct
+{
+    uint32_t zero_high_min;
+    uint32_t zero_high_max;
+    uint32_t one_high_min;
+    uint32_t one_high_max;
+    uint32_t period_min; // rising edge to rising edge of consecutive bits
+    uint32_t period_max;
+    uint64_t bits;
+} piosim_timing_t;
+
+typedef struct
+{
+    piosim_sm_t sm[PIOSIM_SM_COUNT];
+    uint32_t irq;      // PIO IRQ flags 0-7
+    uint32_t pio_pins; // pins whose function is the PIO, the rest follow sio_out
+    uint32_t pio_out;
+    uint32_t sio_out;
+    uint32_t pins; // levels seen by the strips
+    uint64_t cycle;
+
+    // DMA, the segments run in order and one word is moved per cycle when its FIFO has room
+    const piosim_segment_t *segments;
+    uint segment_count;
+    uint segment;
+    uint32_t segment_word;
+    uint64_t dma_words;
+    uint64_t dma_done_cycle;
+
+    // Decoder
+    piosim_strip_t strips[BOARDS][STRIPS];
+    uint64_t strip_rise[STRIPS];
+    uint board_at_rise[STRIPS];
+    piosim_timing_t timing;
+} piosim_t;
+
+void piosim_init(piosim_t *sim);
+
+// Load a program into a state machine, its jumps are relative to the start of instructions
+void piosim_sm_config(piosim_t *sim, uint sm, const uint16_t *instructions, uint length, uint wrap_target, uint wrap);
+
+void piosim_sm_set_out(piosim_t *sim, uint sm, uint out_base, uint out_count, bool shift_right, bool autopull, uint pull_threshold);
+
+void piosim_sm_enable(piosim_t *sim, uint sm);
+
+// Give pins to the PIO, like pio_gpio_init
+void piosim_set_pio_pins(piosim_t *sim, uint pin_base, uint pin_count);
+
+// Drive pins not owned by the PIO, like gpio_put
+void piosim_gpio_put(piosim_t *sim, uint pin, bool value);
+
+// Start the DMA on a list of segments, which must stay valid until it is done
+void piosim_dma_start(piosim_t *sim, const piosim_segment_t *segments, uint count);
+
+bool piosim_dma_busy(const piosim_t *sim);
+
+// The segments a fragment chain moves for a null terminated fragment list, returns the number of segments
+uint piosim_fragment_segments(piosim_segment_t *segments, const uintptr_t *fragments, uint words_per_fragment, uint sm);
+
+// Advance every enabled state machine, the DMA and the decoder by one PIO cycle
+void piosim_step(piosim_t *sim);
+
+void piosim_run(piosim_t *sim, uint64_t cycles);
+
+// True if nothing can change until the DMA is started or the pins or IRQ flags are changed from outside:
+// the DMA is done and every enabled state machine is stalled
+bool piosim_idle(const piosim_t *sim);
+
+// piosim_run for an idle simulator, without executing every cycle. Stops after one cycle if that wakes it up.
+void piosim_skip(piosim_t *sim, uint64_t cycles);
+
+// Run until the DMA is done and state machine sm is stalled on an empty FIFO, returns false on timeout
+bool piosim_run_until_drained(piosim_t *sim, uint sm, uint64_t max_cycles);
+
+// Hold the strips low long enough for every strip to latch
+void piosim_latch(piosim_t *sim);
+
+#endif // PIOSIM_H
@@ -1,14 +1,14 @@
 #include "defines.h"
 #include "pixelblit.h"
 #include <stdio.h>
-#include "hardware/pio.h"
-#include "hardware/dma.h"
-#include "hardware/irq.h"
-#include "pico/sem.h"
-#include "pico/multicore.h"
+#include "hal.h"
 #include "utils.h"
-
-#include "pico/sem.h"
+#include "encoder.h"
+#include "pio_programs.h"
+#include "trace.h"
+#include "log.h"
+#include "frame_queue.h"
+#include "geometry.h"
 
 #ifdef LOCAL_BUILD
 typedef unsigned int uint32_t;
@@ -16,218 +16,670 @@ typedef unsigned int uint;
 typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
 #endif
-#define WS2812_PIN_BASE 3
-
-// bit plane content dma channel
-#define DMA_CHANNEL 0
-// chain channel for configuring main dma channel to output from disjoint 8 word fragments of memory
-#define DMA_CB_CHANNEL 1
-
-#define DMA_CHANNEL_MASK (1u << DMA_CHANNEL)
-#define DMA_CB_CHANNEL_MASK (1u << DMA_CB_CHANNEL)
-#define DMA_CHANNELS_MASK (DMA_CHANNEL_MASK | DMA_CB_CHANNEL_MASK)
-// Check the pin is compatible with the platform
-#if WS2812_PIN_BASE >= NUM_BANK0_GPIOS
-#error Attempting to use a pin>=32 on a platform that does not support it
-#endif
+// Low time after a board's data before the strings latch and the next board can be sent
+#define RESET_DELAY_US 200
+// Time for the PIO to shift out the word it holds once its FIFO is empty (one bit is 1.25 us)
+#define PIO_DRAIN_US 2
+// PIO cycles per second of the data programs, 800kHz WS2812 bits
+#define WS2812_CYCLES_PER_SECOND (800000.0f * (ws2812_parallel_T1 + ws2812_parallel_T2 + ws2812_parallel_T3))
+
 int num_pixels;
 int board_count;
-static PIO pio;
-static uint sm;
-static uint offset;
-static struct semaphore reset_delay_complete_sem;
-static struct semaphore sending_pixels_sem;
-
-static uintptr_t fragment_start[NUM_PIXELS * 3 + 1];
-
-static const uint16_t ws2812_parallel_program_instructions[] = {
-    //     .wrap_target
-    0x6020, //  0: out    x, 32
-    0xa20b, //  1: mov    pins, !null            [2]
-    0xa201, //  2: mov    pins, x                [2]
-    0xa203, //  3: mov    pins, null             [2]
-            //     .wrap
+static int sm = -1;
+static hal_sem_t reset_delay_complete_sem;
+
+static const hal_pio_program_t plane_output_program = {
+    plane_program_instructions,
+    sizeof(plane_program_instructions) / sizeof(plane_program_instructions[0]),
+    plane_program_wrap_target,
+    plane_program_wrap,
 };
 
-#if !PICO_NO_HARDWARE
-static const struct pio_program ws2812_parallel_program = {
-    .instructions = ws2812_parallel_program_instructions,
-    .length = 4,
-    .origin = -1,
-    .pio_version = ws2812_parallel_pio_version,
-#if PICO_PIO_VERSION > 0
-    .used_gpio_ranges = 0x0
-#endif
+static const hal_pio_program_t chained_output_program = {
+    chained_program_instructions,
+    sizeof(chained_program_instructions) / sizeof(chained_program_instructions[0]),
+    chained_program_wrap_target,
+    chained_program_wrap,
 };
 
-static inline pio_sm_config ws2812_parallel_program_get_default_config(uint offset)
+static const hal_pio_program_t board_select_output_program = {
+    board_select_program_instructions,
+    sizeof(board_select_program_instructions) / sizeof(board_select_program_instructions[0]),
+    board_select_wrap_target,
+    board_select_wrap,
+};
+
+// OUTPUT_SCHEDULE_CHAINED state machines, sm runs ws2812_parallel_chained and select_sm runs board_select
+static int select_sm = -1;
+static bool output_initialized;
+
+// address, bit count, bit planes and gap of each board
+#define CHAIN_BLOCKS_PER_BOARD 4
+// Bit periods the strips are held low after the last board of a frame, at 800kHz
+#define FRAME_GAP_BITS (RESET_DELAY_US * 4 / 5)
+
+// Frame chain for each buffer
+static hal_dma_chain_t *frame_chain[2];
+static uint32_t board_address_words[BOARDS];
+// The data program loops on these, so they hold the count - 1
+static uint32_t board_bits_words[BOARDS];
+static uint32_t board_gap_word = 0;
+static uint32_t frame_gap_word = FRAME_GAP_BITS - 1;
+
+// alarm handle for handling delay
+hal_alarm_id_t reset_delay_alarm_id;
+
+// Output state machine: SENDING while the DMA feeds the PIO, LATCHING while the reset delay alarm is armed
+static volatile OutputState output_state = OUTPUT_IDLE;
+static volatile uint32_t latch_complete_us;
+static output_stats_t output_stats;
+
+static OutputSchedule output_schedule = OUTPUT_SCHEDULE_SERIAL;
+// Earliest time each board can be sent again, once its strings have latched (OUTPUT_SCHEDULE_OVERLAP)
+static uint64_t board_ready_us[BOARDS];
+// Board whose DMA was started last, -1 before the first
+static int last_board_sent = -1;
+// Set before the last board of a frame is started, so the ISR can time the frame
+static volatile bool frame_last_board;
+static volatile uint32_t frame_start_us;
+// When the output last became ready for the next board
+static volatile uint32_t output_idle_us;
+
+// Frame handoff. Core 0 encodes a frame into buffers[current_buffer] and pushes it on submit_queue, then
+// encodes the next frame into the other buffer once the output has pushed the frame sent from it on
+// done_queue. Core 1 only reads a frame's buffer between taking it from submit_queue and sending its
+// last board.
+static frame_queue_t submit_queue;
+static frame_queue_t done_queue;
+// core1_wake_sem is posted for each frame submitted and each parallel encode started, frame_done_sem
+// for each frame pushed on done_queue
+static hal_sem_t core1_wake_sem;
+static hal_sem_t frame_done_sem;
+// Frame whose last board is being sent, pushed on done_queue by the ISR
+static frame_t frame_sending;
+// Core 0: frames submitted and not yet taken back from done_queue
+static uint32_t frames_in_flight;
+
+// Parallel encode: both cores take boards of the current buffer in turn until all are encoded.
+// Core 1 helps whenever it would otherwise wait, between frames or for the output to take a board.
+static volatile bool split_active;
+static volatile uint32_t split_next_board;
+static volatile uint32_t split_boards_done;
+
+#if !STREAMING_OUTPUT
+// Core 0: frames since each board was last sent, for the forced refresh
+static uint32_t board_age[BOARDS];
+#endif
+static uint32_t board_refresh_interval;
+#if STREAMING_OUTPUT
+// posted by core 1 once the last board of a frame is encoded, so the rasters can change again
+static hal_sem_t frame_encoded_sem;
+// Board buffer the DMA is reading, NULL once it is done
+static value_bits_t *volatile sending_planes;
+#endif
+
+int64_t reset_delay_complete(hal_alarm_id_t id, void *user_data)
 {
-    pio_sm_config c = pio_get_default_sm_config();
-    sm_config_set_wrap(&c, offset + ws2812_parallel_wrap_target, offset + ws2812_parallel_wrap);
-    return c;
+    (void)id;
+    (void)user_data;
+    reset_delay_alarm_id = 0;
+    output_state = OUTPUT_IDLE;
+    latch_complete_us = hal_time_us_32();
+    output_idle_us = latch_complete_us;
+    hal_sem_release(&reset_delay_complete_sem);
+    return 0;
 }
 
-#include "hardware/clocks.h"
-static inline void ws2812_parallel_program_init(PIO pio, uint sm, uint offset, uint pin_base, uint pin_count, float freq)
+// Called from the DMA interrupt once a board's fragments or a frame chain have been moved
+void dma_complete_handler()
 {
-    for (uint i = pin_base; i < pin_base + pin_count; i++)
+    uint32_t isr_start = hal_time_us_32();
+#if STREAMING_OUTPUT
+    sending_planes = NULL;
+#endif
+    trace_event(TRACE_DMA_END, output_schedule == OUTPUT_SCHEDULE_CHAINED ? TRACE_ALL_BOARDS : last_board_sent);
+    if (frame_last_board)
+    {
+        frame_last_board = false;
+        output_stats.frames++;
+        output_stats.last_frame_us = isr_start - frame_start_us;
+        output_stats.frame_total_us += output_stats.last_frame_us;
+        trace_event(TRACE_FRAME_END, frame_sending.number);
+        frame_sending.done_us = isr_start;
+        // At most two frames are in flight, there is always room
+        frame_queue_push(&done_queue, &frame_sending);
+        hal_sem_release(&frame_done_sem);
+    }
+    if (output_schedule == OUTPUT_SCHEDULE_CHAINED)
     {
-        pio_gpio_init(pio, i);
+        // The chain hit its null block, the PIO is still sending the end of the last board and the frame gap.
+        // A new chain can start now, the board_select program holds it back until the gap has been sent.
+        output_state = OUTPUT_IDLE;
+        output_idle_us = isr_start;
+        hal_sem_release(&reset_delay_complete_sem);
     }
-    pio_sm_set_consecutive_pindirs(pio, sm, pin_base, pin_count, true);
-    pio_sm_config c = ws2812_parallel_program_get_default_config(offset);
-    sm_config_set_out_shift(&c, true, true, 32);
-    sm_config_set_out_pins(&c, pin_base, pin_count);
-    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
-    int cycles_per_bit = ws2812_parallel_T1 + ws2812_parallel_T2 + ws2812_parallel_T3;
-    float div = clock_get_hz(clk_sys) / (freq * cycles_per_bit);
-    sm_config_set_clkdiv(&c, div);
-    printf("div %d ", div);
-    // sm_config_set_clkdiv(&c,1.5d);
-    pio_sm_init(pio, sm, offset, &c);
-    pio_sm_set_enabled(pio, sm, true);
+    else if (output_schedule == OUTPUT_SCHEDULE_OVERLAP)
+    {
+        // The next board can start as soon as the PIO drains, its own latch delay is checked before sending
+        output_state = OUTPUT_IDLE;
+        output_idle_us = isr_start;
+        hal_sem_release(&reset_delay_complete_sem);
+    }
+    else
+    {
+        // when the dma is complete we start the reset delay timer, the alarm releases the next board
+        output_state = OUTPUT_LATCHING;
+        if (reset_delay_alarm_id)
+            hal_alarm_cancel(reset_delay_alarm_id);
+        reset_delay_alarm_id = hal_alarm_add_in_us(RESET_DELAY_US, reset_delay_complete, NULL);
+    }
+    uint32_t isr_us = hal_time_us_32() - isr_start;
+    output_stats.isr_count++;
+    output_stats.isr_total_us += isr_us;
+    if (isr_us > output_stats.isr_max_us)
+        output_stats.isr_max_us = isr_us;
+}
+
+void set_board_refresh_interval(uint32_t frames)
+{
+    board_refresh_interval = frames;
+}
+
+output_stats_t get_output_stats()
+{
+    return output_stats;
+}
+
+void reset_output_stats()
+{
+    memset(&output_stats, 0, sizeof(output_stats));
+}
+
+OutputState get_output_state()
+{
+    return output_state;
 }
 
+void set_output_schedule(OutputSchedule schedule)
+{
+#if STREAMING_OUTPUT
+    // The chain needs every board's planes in memory at once
+    if (schedule == OUTPUT_SCHEDULE_CHAINED)
+        return;
 #endif
-// posted when it is safe to output a new set of values
-static struct semaphore reset_delay_complete_sem;
-// alarm handle for handling delay
-alarm_id_t reset_delay_alarm_id;
+    // The chained schedule loads different PIO programs, it can't be switched to or from once running
+    if (output_initialized && (schedule == OUTPUT_SCHEDULE_CHAINED) != (output_schedule == OUTPUT_SCHEDULE_CHAINED))
+        return;
+    output_schedule = schedule;
+}
 
-int64_t reset_delay_complete(__unused alarm_id_t id, __unused void *user_data)
+OutputSchedule get_output_schedule()
 {
-    reset_delay_alarm_id = 0;
-    sem_release(&reset_delay_complete_sem);
-    printf("Reset delay complete\n");
-    return 0;
+    return output_schedule;
+}
+// Describe a frame from each buffer as one DMA chain:
+// for every board its address to board_select, then bit count, bit planes and gap to the data program.
+// Boards that aren't present are left out, and each board is sent up to its longest strip.
+static void build_frame_chains()
+{
+    static hal_dma_block_t blocks[BOARDS * CHAIN_BLOCKS_PER_BOARD];
+    uint32_t boards = present_boards();
+    uint last_board = 31 - __builtin_clz(boards);
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        board_address_words[board] = board;
+        board_bits_words[board] = board_pixel_count[board] * 3 * VALUE_PLANE_COUNT - 1;
+    }
+    for (uint buffer = 0; buffer < 2; buffer++)
+    {
+        hal_dma_block_t *block = blocks;
+        for (uint board = 0; board < BOARDS; board++)
+        {
+            if (!(boards & (1u << board)))
+                continue;
+            *block++ = (hal_dma_block_t){&board_address_words[board], 1, select_sm};
+            *block++ = (hal_dma_block_t){&board_bits_words[board], 1, sm};
+            *block++ = (hal_dma_block_t){plane_buffer(buffer, board), board_pixel_count[board] * 3 * VALUE_WORD_COUNT, sm};
+            *block++ = (hal_dma_block_t){board == last_board ? &frame_gap_word : &board_gap_word, 1, sm};
+        }
+        frame_chain[buffer] = hal_dma_create_chain(blocks, block - blocks);
+    }
 }
 
-void __isr dma_complete_handler()
+void dma_init()
 {
-    if (dma_hw->ints0 & DMA_CHANNEL_MASK)
+    hal_dma_init(dma_complete_handler);
+
+    if (output_schedule == OUTPUT_SCHEDULE_CHAINED)
     {
-        // clear IRQ
-        dma_hw->ints0 = DMA_CHANNEL_MASK;
-        // when the dma is complete we start the reset delay timer
-        reset_delay_alarm_id = 0;
-        sleep_us(200);
-        sem_release(&reset_delay_complete_sem);
-        // printf("Reset delay complete\n");
-        //  if (reset_delay_alarm_id)
-        //      cancel_alarm(reset_delay_alarm_id);
-        //  reset_delay_alarm_id = add_alarm_in_us(400, reset_delay_complete, NULL, true);
+        build_frame_chains();
+        return;
     }
+
+    // Created here, on core 1, so the reset delay callback runs on the core doing the output
+    hal_alarm_init();
 }
-void dma_init(PIO pio, uint sm)
+
+void output_strips_dma(value_bits_t *bits, uint value_length)
 {
-    dma_claim_mask(DMA_CHANNELS_MASK);
+    fill_fragment_list(fragment_list, bits, value_length);
+    // One fragment is the 8 bit planes of a value
+    hal_dma_start_fragments(fragment_list, VALUE_WORD_COUNT, sm);
+}
 
-    // main DMA channel outputs 8 word fragments, and then chains back to the chain channel
-    dma_channel_config channel_config = dma_channel_get_default_config(DMA_CHANNEL);
-    channel_config_set_dreq(&channel_config, pio_get_dreq(pio, sm, true));
-    channel_config_set_chain_to(&channel_config, DMA_CB_CHANNEL);
-    channel_config_set_irq_quiet(&channel_config, true);
-    dma_channel_configure(DMA_CHANNEL,
-                          &channel_config,
-                          &pio->txf[sm],
-                          NULL, // set by chain
-                          8,    // 8 words for 8 bit planes
-                          false);
+// Encode boards of the parallel encode until none are left to take, returns the number encoded
+static uint32_t encode_split_boards(uint32_t max_boards)
+{
+    uint32_t encoded = 0;
+    while (encoded < max_boards && __atomic_load_n(&split_active, __ATOMIC_ACQUIRE))
+    {
+        uint32_t board = hal_atomic_fetch_add(&split_next_board, 1);
+        if (board >= BOARDS)
+            break;
+        encode_queued_board(board);
+        hal_atomic_fetch_add(&split_boards_done, 1);
+        encoded++;
+    }
+    return encoded;
+}
 
-    // chain channel sends single word pointer to start of fragment each time
-    dma_channel_config chain_config = dma_channel_get_default_config(DMA_CB_CHANNEL);
-    dma_channel_configure(DMA_CB_CHANNEL,
-                          &chain_config,
-                          &dma_channel_hw_addr(
-                               DMA_CHANNEL)
-                               ->al3_read_addr_trig, // ch DMA config (target "ring" buffer size 4) - this is (read_addr trigger)
-                          NULL,                      // set later
-                          1,
-                          false);
+// Wait for the output to be ready for the next board, encoding boards of a parallel encode meanwhile
+static void wait_output_ready()
+{
+    if (!get_parallel_encode())
+    {
+        hal_sem_acquire_blocking(&reset_delay_complete_sem);
+        return;
+    }
+    while (!hal_sem_try_acquire(&reset_delay_complete_sem))
+    {
+        // One board at a time, so the output is held up by at most one board's encode
+        if (encode_split_boards(1))
+            output_stats.split_boards_core1++;
+        else
+            hal_tight_loop();
+    }
+}
 
-    irq_set_exclusive_handler(DMA_IRQ_0, dma_complete_handler);
-    dma_channel_set_irq0_enabled(DMA_CHANNEL, true);
-    irq_set_enabled(DMA_IRQ_0, true);
+#if STREAMING_OUTPUT
+static void encode_streamed_board(uint buffer, uint board)
+{
+    value_bits_t *values = plane_buffer(buffer, board);
+    // Buffers alternate so this doesn't happen, but a board being sent is never encoded over
+    if (values == sending_planes)
+    {
+        output_stats.stream_buffer_waits++;
+        while (values == sending_planes)
+            hal_tight_loop();
+    }
+    trace_event(TRACE_ENCODE_START, board);
+    encode_frame_board(board, values);
+    trace_event(TRACE_ENCODE_END, board);
 }
 
-void output_strips_dma(value_bits_t *bits, uint value_length)
+// Once board of the frame in buffer has been started, or skipped, encode the board after it
+static void stream_next_board(uint buffer, uint board)
 {
-    for (uint i = 0; i < value_length; i++)
+    if (board + 1 < BOARDS)
     {
-        fragment_start[i] = (uintptr_t)bits[i].planes; // MSB first
+        // Fill the other board buffer, its previous board finished sending before this one started
+        uint32_t encode_start = hal_time_us_32();
+        encode_streamed_board(buffer, board + 1);
+        uint32_t encode_us = hal_time_us_32() - encode_start;
+        output_stats.stream_boards_encoded++;
+        if (encode_us > output_stats.stream_encode_max_us)
+            output_stats.stream_encode_max_us = encode_us;
+        if (output_state == OUTPUT_IDLE)
+        {
+            // The output was ready for the next board before it was encoded
+            output_stats.stream_late_boards++;
+            output_stats.stream_late_total_us += hal_time_us_32() - output_idle_us;
+        }
     }
-    fragment_start[value_length] = 0;
-    dma_channel_hw_addr(DMA_CB_CHANNEL)->al3_read_addr_trig = (uintptr_t)fragment_start;
+    if (board + 2 == BOARDS || BOARDS == 1)
+    {
+        // The last board is encoded, the rasters are no longer read
+        clear_frame_shows();
+        hal_sem_release(&frame_encoded_sem);
+    }
+}
+#endif
+
+// Complete a frame with no board to send. Called holding reset_delay_complete_sem, so no DMA is running
+// and the ISR can't push on done_queue at the same time.
+static void skip_frame(const frame_t *frame)
+{
+    output_stats.boards_skipped += __builtin_popcount(present_boards());
+    output_stats.frames++;
+    frame_t done = *frame;
+    done.done_us = hal_time_us_32();
+    trace_event(TRACE_FRAME_END, frame->number);
+    frame_queue_push(&done_queue, &done);
+    hal_sem_release(&frame_done_sem);
+    hal_sem_release(&reset_delay_complete_sem);
 }
 
-// DMA the current bit plane to the PIO
-// We double buffer so we don't write to the memory while the DMA is reading from it
-void _show_pixels_internal()
+// DMA a frame's bit planes to the PIO, board by board or as one chain
+void _show_pixels_internal(const frame_t *frame)
 {
+    trace_event(TRACE_FRAME_START, frame->number);
+    if (output_schedule == OUTPUT_SCHEDULE_CHAINED)
+    {
+        trace_event(TRACE_LATCH_WAIT_START, TRACE_ALL_BOARDS);
+        wait_output_ready();
+        trace_event(TRACE_LATCH_WAIT_END, TRACE_ALL_BOARDS);
+        if (frame->boards == 0)
+        {
+            skip_frame(frame);
+            return;
+        }
+        output_state = OUTPUT_SENDING;
+        frame_start_us = hal_time_us_32();
+        frame_sending = *frame;
+        frame_last_board = true;
+        trace_event(TRACE_DMA_START, TRACE_ALL_BOARDS);
+        hal_dma_start_chain(frame_chain[frame->buffer]);
+        for (uint board = 0; board < BOARDS; board++)
+        {
+            if (board_pixel_count[board])
+                output_stats.boards_sent++;
+            output_stats.values_sent += board_pixel_count[board] * 3;
+        }
+        return;
+    }
+
+#if STREAMING_OUTPUT
+    encode_streamed_board(frame->buffer, 0);
+#else
+    if (frame->boards == 0)
+    {
+        wait_output_ready();
+        skip_frame(frame);
+        return;
+    }
+#endif
+    uint last_board = 31 - __builtin_clz(frame->boards);
+    bool first_board = true;
     for (uint board = 0; board < BOARDS; board++)
     {
-        sem_acquire_blocking(&reset_delay_complete_sem);
+        if (!(frame->boards & (1u << board)))
+        {
+            output_stats.boards_skipped++;
+#if STREAMING_OUTPUT
+            // The board after this one shares a buffer with the one before, which has to be sent first
+            wait_output_ready();
+            hal_sem_release(&reset_delay_complete_sem);
+            stream_next_board(frame->buffer, board);
+#endif
+            continue;
+        }
+        trace_event(TRACE_LATCH_WAIT_START, board);
+        wait_output_ready();
+        if (output_schedule == OUTPUT_SCHEDULE_OVERLAP)
+        {
+            if (last_board_sent >= 0)
+            {
+                // The DMA is done, but the PIO still shifts out what is in its FIFO.
+                // Let it finish before switching boards, then start that board's latch delay.
+                while (!hal_pio_tx_empty(sm))
+                    hal_tight_loop();
+                hal_busy_wait_us(PIO_DRAIN_US);
+                board_ready_us[last_board_sent] = hal_time_us_64() + RESET_DELAY_US;
+            }
+            // Only this board's own strings need to have latched
+            uint64_t now = hal_time_us_64();
+            if (now < board_ready_us[board])
+            {
+                output_stats.latch_wait_total_us += board_ready_us[board] - now;
+                hal_busy_wait_until_us(board_ready_us[board]);
+            }
+        }
+        else if (latch_complete_us)
+        {
+            // Time from the reset delay ending to this board starting
+            uint32_t latency = hal_time_us_32() - latch_complete_us;
+            latch_complete_us = 0;
+            output_stats.latch_count++;
+            output_stats.latch_latency_total_us += latency;
+            if (latency > output_stats.latch_latency_max_us)
+                output_stats.latch_latency_max_us = latency;
+        }
+        trace_event(TRACE_LATCH_WAIT_END, board);
 
         // Convert 'board' into a 4 bit integer and send its bits on gpio pins 0-3
-        gpio_put(0, (board & 1));
-        gpio_put(1, (board & 2) >> 1);
-        gpio_put(2, (board & 4) >> 2);
-        gpio_put(3, (board & 8) >> 3);
+        hal_gpio_put(0, (board & 1));
+        hal_gpio_put(1, (board & 2) >> 1);
+        hal_gpio_put(2, (board & 4) >> 2);
+        hal_gpio_put(3, (board & 8) >> 3);
 
-        output_strips_dma(buffers[current_buffer][board], NUM_PIXELS * 3);
+        output_state = OUTPUT_SENDING;
+        if (first_board)
+            frame_start_us = hal_time_us_32();
+        first_board = false;
+        if (board == last_board)
+        {
+            frame_sending = *frame;
+            frame_last_board = true;
+        }
+        last_board_sent = board;
+#if STREAMING_OUTPUT
+        sending_planes = plane_buffer(frame->buffer, board);
+#endif
+        trace_event(TRACE_DMA_START, board);
+        output_strips_dma(plane_buffer(frame->buffer, board), frame->board_values[board]);
+        output_stats.boards_sent++;
+        output_stats.values_sent += frame->board_values[board];
+#if STREAMING_OUTPUT
+        stream_next_board(frame->buffer, board);
+#endif
     }
-
-    // copy current buffer to next buffer
-    memcpy(buffers[current_buffer ^ 1], buffers[current_buffer], sizeof(buffers[0]));
-    // switch buffers
-    current_buffer ^= 1;
-    stop_timer("DMA ended");
 }
 
 void _initialize_dma()
 {
 
-    dma_init(pio, sm);
+    dma_init();
 
+    bool first_frame = true;
     while (1)
     {
-        uint32_t task = multicore_fifo_pop_blocking(); // Wait for a command
-        if (task == 1)
+        uint32_t wait_start = hal_time_us_32();
+        hal_sem_acquire_blocking(&core1_wake_sem);
+        output_stats.split_boards_core1 += encode_split_boards(BOARDS);
+        frame_t frame;
+        while (frame_queue_pop(&submit_queue, &frame))
         {
-            _show_pixels_internal(); // Execute task when received
+            if (!first_frame)
+                output_stats.output_starved_us += hal_time_us_32() - wait_start;
+            first_frame = false;
+            _show_pixels_internal(&frame);
+            wait_start = hal_time_us_32();
         }
     }
 }
 
 int initialize_dma()
 {
-    sem_init(&reset_delay_complete_sem, 1, 1); // initially posted so we don't block first time
-    // sem_init(&sending_pixels_sem, 1, 1);
-    memset(&buffers[0], 0, sizeof(buffers[0]));
-    memset(&buffers[1], 0, sizeof(buffers[1]));
-    bool success = pio_claim_free_sm_and_add_program_for_gpio_range(&ws2812_parallel_program, &pio, &sm, &offset, WS2812_PIN_BASE, STRIPS, true);
-    hard_assert(success);
-
-    ws2812_parallel_program_init(pio, sm, offset, WS2812_PIN_BASE, STRIPS + WS2812_PIN_BASE, 800000);
-    multicore_reset_core1();
-    multicore_launch_core1(_initialize_dma);
+    hal_sem_init(&reset_delay_complete_sem, 1, 1); // initially posted so we don't block first time
+    // A wake-up can be missed when it is full, core 1 takes every queued frame once woken
+    hal_sem_init(&core1_wake_sem, 0, FRAME_QUEUE_DEPTH + 1);
+    hal_sem_init(&frame_done_sem, 0, FRAME_QUEUE_DEPTH);
+#if STREAMING_OUTPUT
+    hal_sem_init(&frame_encoded_sem, 0, 1);
+#endif
+    memset(board_planes[0][0], 0, buffer_values * sizeof(value_bits_t));
+    memset(board_planes[1][0], 0, buffer_values * sizeof(value_bits_t));
+    if (output_schedule == OUTPUT_SCHEDULE_CHAINED)
+    {
+        // The data program only drives the strip pins, so the address on GPIO 0-3 is left alone
+        sm = hal_pio_claim(&chained_output_program, STRIP_PIN_BASE, STRIPS, 32, WS2812_CYCLES_PER_SECOND);
+        if (sm < 0)
+        {
+            LOG(LOG_NO_OUTPUT_SM, output_schedule);
+            return -1;
+        }
+        // One address per FIFO word, at the system clock
+        select_sm = hal_pio_claim(&board_select_output_program, BOARD_SELECT_PIN_BASE, BOARD_SELECT_PIN_COUNT, BOARD_SELECT_PIN_COUNT, 0);
+        if (select_sm < 0)
+        {
+            LOG(LOG_NO_SELECT_SM);
+            hal_pio_unclaim(sm, &chained_output_program);
+            return -1;
+        }
+        hal_pio_clear_irq(BOARD_SELECTED_IRQ);
+        hal_pio_clear_irq(BOARD_SENT_IRQ);
+        hal_pio_enable_mask((1u << sm) | (1u << select_sm));
+    }
+    else
+    {
+        sm = hal_pio_claim(&plane_output_program, PLANE_PIN_BASE, PLANE_PIN_COUNT, 32, WS2812_CYCLES_PER_SECOND);
+        if (sm < 0)
+        {
+            LOG(LOG_NO_OUTPUT_SM, output_schedule);
+            return -1;
+        }
+        hal_pio_enable_mask(1u << sm);
+        // The board address is set with hal_gpio_put, this takes GPIO 3 back from the PIO
+        for (uint pin = BOARD_SELECT_PIN_BASE; pin < BOARD_SELECT_PIN_BASE + BOARD_SELECT_PIN_COUNT; pin++)
+        {
+            hal_gpio_init_out(pin);
+        }
+    }
+    output_initialized = true;
+    hal_core1_launch(_initialize_dma);
+    return 0;
 }
 int remove_dma()
 {
-    pio_remove_program_and_unclaim_sm(&ws2812_parallel_program, pio, sm, offset);
+    if (output_schedule == OUTPUT_SCHEDULE_CHAINED)
+    {
+        hal_pio_unclaim(select_sm, &board_select_output_program);
+        hal_pio_unclaim(sm, &chained_output_program);
+    }
+    else
+    {
+        hal_pio_unclaim(sm, &plane_output_program);
+    }
+    output_initialized = false;
+    return 0;
+}
+// Take back the frames the output is done with, waiting until no more than max_in_flight are left
+static void collect_done_frames(uint32_t max_in_flight)
+{
+    uint32_t wait_start = hal_time_us_32();
+    bool stalled = false;
+    while (true)
+    {
+        frame_t frame;
+        while (frame_queue_pop(&done_queue, &frame))
+        {
+            frames_in_flight--;
+            uint32_t latency = frame.done_us - frame.submit_us;
+            output_stats.frame_latency_total_us += latency;
+            if (latency > output_stats.frame_latency_max_us)
+                output_stats.frame_latency_max_us = latency;
+        }
+        if (frames_in_flight <= max_in_flight)
+            break;
+        stalled = true;
+        // A permit can be left over from frames popped without waiting, the queue is checked again
+        hal_sem_acquire_blocking(&frame_done_sem);
+    }
+    if (stalled)
+    {
+        output_stats.submit_stalls++;
+        output_stats.submit_stall_us += hal_time_us_32() - wait_start;
+    }
 }
-// start of each value (+1 for NULL terminator)
-value_bits_t colors[NUM_PIXELS * 3];
-// double buffer the state of the pixel strip, since we update next version in parallel with DMAing out old version
 
-// posted when it is safe to output a new set of values
-static struct semaphore reset_delay_complete_sem;
-static struct semaphore sending_pixels_sem;
+// Boards to send: those that changed since the last frame, and those due a refresh
+static void boards_to_send(frame_t *frame)
+{
+#if STREAMING_OUTPUT
+    // Every board is encoded again as it is sent
+    frame->boards = present_boards();
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        frame->board_values[board] = board_pixel_count[board] * 3;
+    }
+#else
+    frame->boards = changed_boards(frame->board_values) & present_boards();
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        board_age[board]++;
+        if (board_refresh_interval && board_age[board] >= board_refresh_interval && board_pixel_count[board])
+        {
+            frame->boards |= 1u << board;
+            frame->board_values[board] = board_pixel_count[board] * 3;
+        }
+        if (frame->boards & (1u << board))
+            board_age[board] = 0;
+        // Nothing past the longest strip is there to receive it
+        if (frame->board_values[board] > board_pixel_count[board] * 3)
+            frame->board_values[board] = board_pixel_count[board] * 3;
+    }
+#endif
+}
 
-// alarm handle for handling delay
-alarm_id_t reset_delay_alarm_id;
+static void submit_frame()
+{
+    frame_t frame = {.number = output_stats.frames_submitted, .buffer = current_buffer};
+    boards_to_send(&frame);
+    frame.submit_us = hal_time_us_32();
+    // Core 1 takes frames in order and at most two are in flight, so the queue can't be full
+    frame_queue_push(&submit_queue, &frame);
+    frames_in_flight++;
+    output_stats.frames_submitted++;
+    uint32_t queued = frame_queue_count(&submit_queue);
+    if (queued > output_stats.submit_queue_max)
+        output_stats.submit_queue_max = queued;
+    hal_sem_release(&core1_wake_sem);
+}
+
+#if !STREAMING_OUTPUT
+// Encode the queued rasters into the current buffer on both cores, returns once every board is done
+static void encode_split_frame()
+{
+    // Done is cleared first: a late claim from the last frame, before the boards are handed out again,
+    // still finds none left
+    uint32_t encode_start = hal_time_us_32();
+    __atomic_store_n(&split_boards_done, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&split_next_board, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&split_active, true, __ATOMIC_RELEASE);
+    hal_sem_release(&core1_wake_sem);
+    encode_split_boards(BOARDS);
+    uint32_t wait_start = hal_time_us_32();
+    while (__atomic_load_n(&split_boards_done, __ATOMIC_ACQUIRE) < BOARDS)
+        hal_tight_loop();
+    uint32_t encode_end = hal_time_us_32();
+    output_stats.split_wait_us += encode_end - wait_start;
+    output_stats.split_encode_us += encode_end - encode_start;
+    __atomic_store_n(&split_active, false, __ATOMIC_RELEASE);
+    clear_frame_shows();
+}
+#endif
 
 void show_pixels()
 {
-    multicore_fifo_push_blocking(1);
-}
\ No newline at end of file
+#if STREAMING_OUTPUT
+    submit_frame();
+    // With an odd number of boards the next frame starts in the buffer this one ends in
+    current_buffer ^= BOARDS & 1;
+    // Core 1 encodes the boards from the rasters as it sends them, so they can't change until it is done
+    hal_sem_acquire_blocking(&frame_encoded_sem);
+    encode_stats_end_frame();
+    // No plane buffer is handed over, the frame before this one may still be sending its last board
+    collect_done_frames(2);
+#else
+    if (get_parallel_encode())
+        encode_split_frame();
+    encode_stats_end_frame();
+    submit_frame();
+    // The next frame is encoded into the other buffer, once the frame before this one has been sent from it
+    collect_done_frames(1);
+    trace_event(TRACE_SWAP_START, 0);
+    // Bring it up to date with the frame just submitted, which the output only reads
+    swap_buffers();
+    trace_event(TRACE_SWAP_END, 0);
+#endif
+}
@@ -1,28 +1,95 @@
 #ifndef PIXELBLIT_H
 #define PIXELBLIT_H
 #include "defines.h"
-// --------------- //
-// ws2812_parallel //
-// --------------- //
-
-#define ws2812_parallel_wrap_target 0
-#define ws2812_parallel_wrap 3
-#define ws2812_parallel_pio_version 0
-
-#define ws2812_parallel_T1 3
-#define ws2812_parallel_T2 3
-#define ws2812_parallel_T3 4
 #ifdef LOCAL_BUILD
 typedef unsigned int uint32_t;
 typedef unsigned int uint;
 typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
 #endif
+typedef enum
+{
+    OUTPUT_IDLE = 0,
+    // DMA is feeding a board's bit planes to the PIO
+    OUTPUT_SENDING = 1,
+    // DMA done, waiting out the reset delay before the next board
+    OUTPUT_LATCHING = 2,
+} OutputState;
+
+// How boards are sequenced within a frame
+typedef enum
+{
+    // Wait the reset delay after every board before sending the next one
+    OUTPUT_SCHEDULE_SERIAL = 0,
+    // Start the next board as soon as the previous one has been shifted out. A board's strings are
+    // not driven while another board is selected, so the reset delay is only enforced before the
+    // same board is sent again.
+    OUTPUT_SCHEDULE_OVERLAP = 1,
+    // The whole frame, board addresses included, is one DMA control block chain run by the PIO
+    // without the CPU. Boards follow each other back to back and the reset delay is sent once, after
+    // the last board. Must be selected before initialize_dma, not available with STREAMING_OUTPUT.
+    OUTPUT_SCHEDULE_CHAINED = 2,
+} OutputSchedule;
+
+// Output path instrumentation, times in microseconds
+typedef struct
+{
+    uint32_t boards_sent;
+    uint32_t boards_skipped; // unchanged since they were last sent
+    uint32_t values_sent;    // value_bits_t sent, a board is only sent up to its last changed pixel
+    uint32_t isr_count;
+    uint32_t isr_total_us; // time spent in the DMA completion ISR
+    uint32_t isr_max_us;
+    uint32_t latch_count;
+    uint32_t latch_latency_total_us; // reset delay complete to the next board's DMA start
+    uint32_t latch_latency_max_us;
+    uint32_t latch_wait_total_us; // time spent waiting for a board's own latch (OUTPUT_SCHEDULE_OVERLAP)
+    uint32_t frames;
+    uint32_t last_frame_us; // first board's DMA start to last board's DMA completion
+    uint32_t frame_total_us;
+    // STREAMING_OUTPUT: each board is encoded while the one before it is sent
+    uint32_t stream_boards_encoded;
+    uint32_t stream_encode_max_us; // longest time to encode one board
+    uint32_t stream_late_boards;   // boards still being encoded when the output was ready to send them
+    uint32_t stream_late_total_us; // time the output spent waiting for the encoder
+    uint32_t stream_buffer_waits;  // boards whose buffer was still being sent from when they were to be encoded
+    // Frame handoff between core 0 and core 1
+    uint32_t frames_submitted;
+    uint32_t submit_queue_max;       // most frames waiting for core 1
+    uint32_t submit_stalls;          // show_pixels calls that waited for the output to free a plane buffer
+    uint32_t submit_stall_us;        // time core 0 spent waiting in those
+    uint32_t output_starved_us;      // time core 1 waited for a frame after its first
+    uint32_t frame_latency_total_us; // show_pixels to the frame's last board sent
+    uint32_t frame_latency_max_us;
+    // Parallel encode (set_parallel_encode)
+    uint32_t split_boards_core1; // boards encoded by core 1
+    uint32_t split_encode_us;    // time show_pixels spent encoding, on both cores
+    uint32_t split_wait_us;      // of that, time core 0 waited for core 1 to finish its boards
+} output_stats_t;
+
 // Function prototypes
 int initialize_dma();
 
 int remove_dma();
 
+// Hand the frame encoded into the current buffer to core 1 and return once the other buffer can be
+// encoded into. It holds the frame before this one until that has been sent. With STREAMING_OUTPUT,
+// return once core 1 has encoded the frame from the rasters.
 void show_pixels();
 
+// Boards whose planes did not change are not sent, the strings hold what they were last sent, and a board
+// that changed is only sent up to its last changed pixel. Also send
+// each board at least every frames frames, 0 (the default) never forces a board out.
+void set_board_refresh_interval(uint32_t frames);
+
+output_stats_t get_output_stats();
+
+void reset_output_stats();
+
+OutputState get_output_state();
+
+void set_output_schedule(OutputSchedule schedule);
+
+OutputSchedule get_output_schedule();
+
 #endif // PIXELBLIT_H
\ No newline at end of file
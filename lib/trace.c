@@ -0,0 +1,201 @@
+#include "defines.h"
+#include "trace.h"
+#include "hal.h"
+
+#define TRACE_MAGIC 0x52544250 // "PBTR"
+#define TRACE_VERSION 1
+
+static trace_record_t records[TRACE_RECORDS];
+static volatile uint32_t next_sequence;
+static volatile bool trace_enabled;
+
+// Scratch for trace_summarize, so it needs no stack or heap. The records themselves are read from the
+// live ring, a copy of it would double its RAM.
+static uint32_t durations[TRACE_RECORDS / 2];
+
+void trace_start()
+{
+    trace_enabled = false;
+    memset(records, 0, sizeof(records));
+    next_sequence = 0;
+    trace_enabled = true;
+}
+
+void trace_stop()
+{
+    trace_enabled = false;
+}
+
+void trace_event(TraceEvent event, uint16_t arg)
+{
+    if (!trace_enabled)
+        return;
+    uint32_t sequence = hal_atomic_fetch_add(&next_sequence, 1) + 1;
+    trace_record_t *record = &records[sequence & (TRACE_RECORDS - 1)];
+    // Readers skip the slot until its sequence is written back
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    record->time_us = hal_time_us_32();
+    record->event = event;
+    record->arg = arg;
+    __atomic_store_n(&record->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+// Oldest sequence still in the ring when last is the newest
+static uint32_t first_sequence(uint32_t last)
+{
+    return last > TRACE_RECORDS ? last - TRACE_RECORDS + 1 : 1;
+}
+
+// Copy the record of sequence into copy, false if it was overwritten or is still being written
+static bool read_record(uint32_t sequence, trace_record_t *copy)
+{
+    const trace_record_t *record = &records[sequence & (TRACE_RECORDS - 1)];
+    *copy = *record;
+    return __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == sequence && copy->sequence == sequence;
+}
+
+uint32_t trace_snapshot(trace_record_t *out, uint32_t max_records)
+{
+    uint32_t last = next_sequence;
+    uint32_t count = 0;
+    for (uint32_t sequence = first_sequence(last); sequence <= last && count < max_records; sequence++)
+    {
+        if (read_record(sequence, &out[count]))
+            count++;
+    }
+    return count;
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint32_t count, uint32_t percent)
+{
+    return count ? sorted[(count - 1) * percent / 100] : 0;
+}
+
+trace_summary_t trace_summarize()
+{
+    trace_summary_t summary = {0};
+    // Both passes walk the same sequences, events recorded meanwhile are left for the next summary
+    uint32_t last = next_sequence;
+    uint32_t first = first_sequence(last);
+    uint32_t count = 0;
+    trace_record_t r;
+    summary.events = last;
+
+    // Frame periods
+    uint32_t periods = 0;
+    bool have_frame = false;
+    uint32_t last_frame_end = 0;
+    uint32_t first_frame_end = 0;
+    for (uint32_t sequence = first; sequence <= last; sequence++)
+    {
+        if (!read_record(sequence, &r))
+            continue;
+        count++;
+        if (r.event != TRACE_FRAME_END)
+            continue;
+        if (have_frame && periods < TRACE_RECORDS / 2)
+            durations[periods++] = r.time_us - last_frame_end;
+        else if (!have_frame)
+            first_frame_end = r.time_us;
+        have_frame = true;
+        last_frame_end = r.time_us;
+        summary.frames++;
+    }
+    summary.dropped = summary.events - count;
+    if (periods)
+    {
+        summary.fps = periods * 1e6f / (last_frame_end - first_frame_end);
+        qsort(durations, periods, sizeof(uint32_t), compare_uint32);
+        summary.frame_p50_us = percentile(durations, periods, 50);
+        summary.frame_p99_us = percentile(durations, periods, 99);
+        summary.frame_max_us = durations[periods - 1];
+    }
+
+    // Render times, and the time spent waiting on the output
+    uint32_t renders = 0;
+    uint32_t render_start = 0;
+    bool rendering = false;
+    uint32_t latch_wait_start = 0;
+    bool latch_waiting = false;
+    for (uint32_t sequence = first; sequence <= last; sequence++)
+    {
+        if (!read_record(sequence, &r))
+            continue;
+        switch (r.event)
+        {
+        case TRACE_RENDER_START:
+            render_start = r.time_us;
+            rendering = true;
+            break;
+        case TRACE_RENDER_END:
+            if (rendering && renders < TRACE_RECORDS / 2)
+                durations[renders++] = r.time_us - render_start;
+            rendering = false;
+            break;
+        case TRACE_LATCH_WAIT_START:
+            latch_wait_start = r.time_us;
+            latch_waiting = true;
+            break;
+        case TRACE_LATCH_WAIT_END:
+            if (latch_waiting)
+                summary.latch_wait_total_us += r.time_us - latch_wait_start;
+            latch_waiting = false;
+            break;
+        default:
+            break;
+        }
+    }
+    qsort(durations, renders, sizeof(uint32_t), compare_uint32);
+    summary.render_p50_us = percentile(durations, renders, 50);
+    summary.render_p99_us = percentile(durations, renders, 99);
+    return summary;
+}
+
+void trace_dump(FILE *f)
+{
+    // Writing out takes far longer than the ring takes to wrap, so recording pauses meanwhile
+    bool was_enabled = trace_enabled;
+    trace_enabled = false;
+    uint32_t last = next_sequence;
+    uint32_t first = first_sequence(last);
+    trace_record_t r;
+    uint32_t count = 0;
+    for (uint32_t sequence = first; sequence <= last; sequence++)
+        count += read_record(sequence, &r);
+    uint32_t header[4] = {TRACE_MAGIC, TRACE_VERSION, count, last};
+    fwrite(header, sizeof(header), 1, f);
+    uint32_t written = 0;
+    for (uint32_t sequence = first; sequence <= last && written < count; sequence++)
+    {
+        if (!read_record(sequence, &r))
+            continue;
+        fwrite(&r.time_us, sizeof(uint32_t), 1, f);
+        fwrite(&r.event, sizeof(uint16_t), 1, f);
+        fwrite(&r.arg, sizeof(uint16_t), 1, f);
+        written++;
+    }
+    // An event taken just before the pause can overwrite a counted record, keep the count in the header right
+    for (r = (trace_record_t){.event = TRACE_EVENT_COUNT}; written < count; written++)
+    {
+        fwrite(&r.time_us, sizeof(uint32_t), 1, f);
+        fwrite(&r.event, sizeof(uint16_t), 1, f);
+        fwrite(&r.arg, sizeof(uint16_t), 1, f);
+    }
+    trace_enabled = was_enabled;
+    fflush(f);
+}
+
+void trace_print_summary()
+{
+    trace_summary_t s = trace_summarize();
+    printf("Trace: %u frames, %.1f fps, frame p50 %u us p99 %u us max %u us, render p50 %u us p99 %u us, latch wait %u us, %u/%u events dropped\n",
+           s.frames, s.fps, s.frame_p50_us, s.frame_p99_us, s.frame_max_us, s.render_p50_us, s.render_p99_us,
+           s.latch_wait_total_us, s.dropped, s.events);
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include "defines.h"
+
+// Per-frame pipeline trace: a fixed ring of timestamped events written from both cores and the DMA interrupt.
+// Recording an event allocates and prints nothing. The ring is not lock-free: a slot is taken with
+// hal_atomic_fetch_add, which on the RP2040 holds a hardware spin lock with interrupts off for the one
+// increment, as the M0+ has no atomic read-modify-write. The record itself is written outside the lock.
+// Recording is off until trace_start.
+
+// Most recent events kept, a power of two
+#define TRACE_RECORDS 512
+// arg of the DMA events of a whole frame chain (OUTPUT_SCHEDULE_CHAINED)
+#define TRACE_ALL_BOARDS 0xffff
+
+typedef enum
+{
+    // core 1 takes a frame from show_pixels, arg is the frame number
+    TRACE_FRAME_START = 0,
+    // the DMA of a frame's last board is done, arg is the frame number
+    TRACE_FRAME_END = 1,
+    // the application's drawing, arg is its own
+    TRACE_RENDER_START = 2,
+    TRACE_RENDER_END = 3,
+    // raster pixels written to the bit planes, arg is the raster id, or the board in STREAMING_OUTPUT builds
+    TRACE_ENCODE_START = 4,
+    TRACE_ENCODE_END = 5,
+    // swap_buffers after a frame is sent
+    TRACE_SWAP_START = 6,
+    TRACE_SWAP_END = 7,
+    // arg is the board, or TRACE_ALL_BOARDS
+    TRACE_DMA_START = 8,
+    TRACE_DMA_END = 9,
+    // waiting for the output to take a board: the previous DMA, the PIO draining and the board's reset delay
+    TRACE_LATCH_WAIT_START = 10,
+    TRACE_LATCH_WAIT_END = 11,
+    TRACE_EVENT_COUNT = 12,
+} TraceEvent;
+
+typedef struct
+{
+    uint32_t sequence; // index of the event since trace_start + 1, 0 while it is being written
+    uint32_t time_us;
+    uint16_t event;
+    uint16_t arg;
+} trace_record_t;
+
+typedef struct
+{
+    uint32_t events;  // events recorded since trace_start
+    uint32_t dropped; // of those, overwritten before the summary
+    uint32_t frames;  // frames completed within the ring
+    float fps;        // frames per second over the completed frames in the ring
+    // frame end to the next frame end
+    uint32_t frame_p50_us;
+    uint32_t frame_p99_us;
+    uint32_t frame_max_us;
+    uint32_t render_p50_us;
+    uint32_t render_p99_us;
+    uint32_t latch_wait_total_us;
+} trace_summary_t;
+
+// Clear the ring and start recording
+void trace_start();
+
+void trace_stop();
+
+void trace_event(TraceEvent event, uint16_t arg);
+
+// Copy the recorded events still in the ring into records, oldest first. Returns the number copied.
+uint32_t trace_snapshot(trace_record_t *records, uint32_t max_records);
+
+trace_summary_t trace_summarize();
+
+// Write the ring as a header ("PBTR", version, record count, events recorded) and the records, oldest first:
+// time_us (32 bits), event (16 bits), arg (16 bits), little endian. Recording pauses while it writes.
+// A record overwritten while it was being written out is written as event TRACE_EVENT_COUNT.
+void trace_dump(FILE *f);
+
+void trace_print_summary();
+
+#endif // TRACE_H
@@ -2,6 +2,11 @@
 #include <stdlib.h> // Required for malloc
 #include <stdio.h>
 #include "utils.h"
+#include "encoder.h"
+#include "trace.h"
+#include "log.h"
+#include "geometry.h"
+#include "gradient.h"
 #include <math.h>
 #include <float.h>
 #ifdef LOCAL_BUILD
@@ -10,9 +15,12 @@ typedef unsigned int uint;
 typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
 
-void show_pixels()
+#include <time.h>
+uint64_t time_us_64()
 {
-    // stub
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000u;
 }
 #endif
 #ifndef LOCAL_BUILD
@@ -21,61 +29,301 @@ void show_pixels()
 #endif
 
 uint current_buffer = 0;
-// Up to 100 raster objects
-raster_object_t *raster_object[MAX_RASTER_OBJECTS];
+int raster_object_count = -1;
 
-// double buffer the state of the pixel strip, since we update next version in parallel with DMAing out old version
-value_bits_t buffers[2][BOARDS][NUM_PIXELS * 3];
+// Raster storage. Each raster's pixels, palette, mapping, row pointers, dirty ranges and encode plan are one block of
+// the raster pool, and the blocks are kept packed from the start of the pool in the order they were taken. Releasing
+// or resizing a block moves the ones after it, so the free space is always one run at the end.
 
-int raster_object_count = -1;
+static inline uint32_t raster_pool_align(uint32_t bytes)
+{
+    return (bytes + 7) & ~7u;
+}
 
-int create_raster(uint16_t height, uint16_t width, uint board, uint strip, uint pixel, WrapMode wrap)
+static inline uint32_t raster_pixel_bytes(uint8_t format)
+{
+    return format == RASTER_PALETTE8 ? 1 : format == RASTER_RGB565 ? 2 : 4;
+}
 
+static uint32_t raster_storage_bytes(uint16_t height, uint16_t width, uint8_t format)
 {
+    return raster_pool_align(height * width * raster_pixel_bytes(format)) +
+           (format == RASTER_PALETTE8 ? 256 * sizeof(uint32_t) : 0) +
+           raster_pool_align(height * width * sizeof(pixel_address_t)) +
+           (format == RASTER_RGB888 ? raster_pool_align(height * sizeof(uint32_t *)) : 0) +
+           raster_pool_align(height * sizeof(pixel_address_t *)) +
+           2 * raster_pool_align(height * sizeof(uint16_t));
+}
+
+// The encode plan at the end of a block
+static inline uint32_t plan_storage_bytes(uint32_t source_count, uint32_t column_count)
+{
+    return raster_pool_align(source_count * sizeof(encode_source_t)) + raster_pool_align(column_count * sizeof(encode_column_t));
+}
 
-    raster_object_count++;
-    if (raster_object_count >= MAX_RASTER_OBJECTS)
+// Point the raster at its block, laid out for its height, width, format and plan. The pixels come first.
+static void point_raster_storage(raster_object_t *raster, uint8_t *storage)
+{
+    uint height = raster->height;
+    uint width = raster->width;
+    raster->storage = storage;
+    raster->storage_bytes = raster_storage_bytes(height, width, raster->format) +
+                            plan_storage_bytes(raster->plan.source_count, raster->plan.column_count);
+    raster->pixels = NULL;
+    raster->indices = NULL;
+    raster->pixels565 = NULL;
+    raster->palette = NULL;
+    raster->raster = NULL;
+    switch (raster->format)
+    {
+    case RASTER_PALETTE8:
+        raster->indices = storage;
+        break;
+    case RASTER_RGB565:
+        raster->pixels565 = (uint16_t *)storage;
+        break;
+    default:
+        raster->pixels = (uint32_t *)storage;
+        break;
+    }
+    storage += raster_pool_align(height * width * raster_pixel_bytes(raster->format));
+    if (raster->format == RASTER_PALETTE8)
+    {
+        raster->palette = (uint32_t *)storage;
+        storage += 256 * sizeof(uint32_t);
+    }
+    raster->mapping = (pixel_address_t *)storage;
+    storage += raster_pool_align(height * width * sizeof(pixel_address_t));
+    if (raster->format == RASTER_RGB888)
+    {
+        raster->raster = (uint32_t **)storage;
+        storage += raster_pool_align(height * sizeof(uint32_t *));
+    }
+    raster->pixel_mapping = (pixel_address_t **)storage;
+    storage += raster_pool_align(height * sizeof(pixel_address_t *));
+    raster->dirty_x0 = (uint16_t *)storage;
+    storage += raster_pool_align(height * sizeof(uint16_t));
+    raster->dirty_x1 = (uint16_t *)storage;
+    storage += raster_pool_align(height * sizeof(uint16_t));
+    raster->plan.sources = (encode_source_t *)storage;
+    storage += raster_pool_align(raster->plan.source_count * sizeof(encode_source_t));
+    raster->plan.columns = (encode_column_t *)storage;
+    for (uint i = 0; i < height; i++)
     {
-        printf("Max raster objects reached, not creating new raster object\n");
+        if (raster->raster)
+            raster->raster[i] = raster->pixels + i * width;
+        raster->pixel_mapping[i] = raster->mapping + i * width;
+    }
+}
+
+static uint8_t *raster_pool_take(uint32_t bytes)
+{
+    if (bytes > raster_pool_bytes - raster_pool_used)
+    {
+        return NULL;
+    }
+    uint8_t *storage = raster_pool + raster_pool_used;
+    raster_pool_used += bytes;
+    return storage;
+}
+
+// Move the blocks from `from` on by offset bytes
+static void raster_pool_shift(uint8_t *from, int32_t offset)
+{
+    if (offset == 0)
+    {
+        return;
+    }
+    memmove(from + offset, from, raster_pool + raster_pool_used - from);
+    raster_pool_used += offset;
+    for (int i = 0; i <= raster_object_count; i++)
+    {
+        raster_object_t *raster = &raster_object[i];
+        if (raster->storage != NULL && raster->storage >= from)
+        {
+            point_raster_storage(raster, raster->storage + offset);
+        }
+    }
+}
+
+// Give a block back, moving every block after it down over it
+static void raster_pool_release(uint8_t *storage, uint32_t bytes)
+{
+    raster_pool_shift(storage + bytes, -(int32_t)bytes);
+}
+
+static raster_object_t *get_raster_ptr(int raster_id)
+{
+    if (raster_id < 0 || raster_id > raster_object_count || raster_object[raster_id].storage == NULL)
+    {
+        return NULL;
+    }
+    return &raster_object[raster_id];
+}
+
+static void map_raster(raster_object_t *raster, uint board, uint strip, uint pixel, WrapMode wrap);
+static int compile_plan(raster_object_t *raster, int raster_id);
+
+int create_raster(uint16_t height, uint16_t width, uint board, uint strip, uint pixel, WrapMode wrap)
+{
+    return create_raster_format(height, width, board, strip, pixel, wrap, RASTER_RGB888);
+}
+
+int create_raster_format(uint16_t height, uint16_t width, uint board, uint strip, uint pixel, WrapMode wrap, RasterFormat format)
+{
+    int raster_id;
+    if (free_raster_id_count)
+    {
+        raster_id = free_raster_ids[free_raster_id_count - 1];
+    }
+    else if (raster_object_count + 1 < (int)max_raster_objects)
+    {
+        raster_id = raster_object_count + 1;
+    }
+    else
+    {
+        LOG(LOG_RASTER_LIMIT);
         return -1;
     }
-    printf("Creating raster object %d\n", raster_object_count);
-    uint offset = pixel;
+    uint8_t *storage = raster_pool_take(raster_storage_bytes(height, width, format));
+    if (storage == NULL)
+    {
+        LOG(LOG_RASTER_POOL_FULL, raster_id, raster_storage_bytes(height, width, format));
+        return -1;
+    }
+    if (raster_id > raster_object_count)
+        raster_object_count = raster_id;
+    else
+        free_raster_id_count--;
 
-    raster_object_t *raster = malloc(sizeof(raster_object_t));
-    printf("Height: %d, Width: %d\n", height, width);
+    raster_object_t *raster = &raster_object[raster_id];
+    LOG(LOG_RASTER_CREATED, raster_id, height, width);
+    memset(raster, 0, sizeof(raster_object_t));
     raster->height = height;
     raster->width = width;
-    uint32_t *raster_data = malloc(height * width * sizeof(uint32_t));
+    raster->board = board;
+    raster->strip = strip;
+    raster->pixel = pixel;
+    raster->wrap = wrap;
+    raster->format = format;
+    point_raster_storage(raster, storage);
+    memset(storage, 0, height * width * raster_pixel_bytes(format));
+    if (raster->palette)
+    {
+        // A grey ramp until the palette is set
+        for (uint i = 0; i < 256; i++)
+        {
+            raster->palette[i] = i * 0x010101;
+        }
+    }
+    map_raster(raster, board, strip, pixel, wrap);
+    if (compile_plan(raster, raster_id) != 0)
+    {
+        destroy_raster(raster_id);
+        return -1;
+    }
+    // Nothing has been encoded yet
+    mark_raster_all_dirty(raster_id);
+    return raster_id;
+}
 
-    pixel_address_t *pixel_mapping_data = malloc(height * width * sizeof(pixel_address_t));
+static void drop_frame_shows(int raster_id);
 
-    raster->raster = malloc(height * sizeof(uint32_t *));
-    if (!raster->raster)
+int destroy_raster(int raster_id)
+{
+    raster_object_t *raster = get_raster_ptr(raster_id);
+    if (raster == NULL)
     {
-        perror("Failed to allocate row pointers");
-        return 1;
+        LOG(LOG_INVALID_RASTER, raster_id);
+        return -1;
     }
-    raster->pixel_mapping = malloc(height * sizeof(pixel_address_t *));
-    for (int i = 0; i < height; i++)
+    drop_frame_shows(raster_id);
+    uint8_t *storage = raster->storage;
+    uint32_t bytes = raster->storage_bytes;
+    memset(raster, 0, sizeof(raster_object_t));
+    raster_pool_release(storage, bytes);
+    free_raster_ids[free_raster_id_count++] = raster_id;
+    return 0;
+}
+
+int resize_raster(int raster_id, uint16_t height, uint16_t width)
+{
+    raster_object_t *raster = get_raster_ptr(raster_id);
+    if (raster == NULL)
     {
+        LOG(LOG_INVALID_RASTER, raster_id);
+        return -1;
+    }
+    // The new block is taken before the old one is given back, so the pixels can be copied across
+    uint8_t *storage = raster_pool_take(raster_storage_bytes(height, width, raster->format));
+    if (storage == NULL)
+    {
+        LOG(LOG_RASTER_POOL_FULL, raster_id, raster_storage_bytes(height, width, raster->format));
+        return -1;
+    }
+    raster_object_t resized = *raster;
+    resized.height = height;
+    resized.width = width;
+    memset(&resized.plan, 0, sizeof(resized.plan));
+    point_raster_storage(&resized, storage);
+    map_raster(&resized, raster->board, raster->strip, raster->pixel, raster->wrap);
+    uint32_t pixel_bytes = raster_pixel_bytes(raster->format);
+    memset(storage, 0, height * width * pixel_bytes);
+    uint copy_height = height < raster->height ? height : raster->height;
+    uint copy_width = width < raster->width ? width : raster->width;
+    for (uint i = 0; i < copy_height; i++)
+    {
+        memcpy(storage + i * width * pixel_bytes, raster->storage + i * raster->width * pixel_bytes, copy_width * pixel_bytes);
+    }
+    if (raster->palette)
+    {
+        memcpy(resized.palette, raster->palette, 256 * sizeof(uint32_t));
+    }
+    // The new block is the last one, its plan can grow into the free space
+    if (compile_plan(&resized, raster_id) != 0)
+    {
+        raster_pool_release(storage, resized.storage_bytes);
+        return -1;
+    }
+    uint8_t *old_storage = raster->storage;
+    uint32_t old_bytes = raster->storage_bytes;
+    *raster = resized;
+    raster_pool_release(old_storage, old_bytes);
+    mark_raster_all_dirty(raster_id);
+    return 0;
+}
 
-        raster->raster[i] = raster_data + i * width;
-        raster->pixel_mapping[i] = pixel_mapping_data + i * width;
+// Lay the raster's pixels out from board, strip and pixel as the wrap mode says
+// Move board and strip on to the next strip that has pixels, so a raster running along the strips
+// doesn't leave any of its pixels on a missing board or strip. Stays put if no strip has any.
+static void skip_absent_strips(uint *board, uint *strip)
+{
+    for (uint i = 0; i < BOARDS * STRIPS && strip_pixels(*board, *strip) == 0; i++)
+    {
+        if (++*strip >= STRIPS)
+        {
+            *strip = 0;
+            if (++*board >= BOARDS)
+                *board = 0;
+        }
     }
+}
 
-    uint wrap_width = 0;
+static void map_raster(raster_object_t *raster, uint board, uint strip, uint pixel, WrapMode wrap)
+{
+    uint16_t height = raster->height;
+    uint16_t width = raster->width;
+    uint offset = pixel;
     uint current_wrap = 0;
 
+    if (wrap != CLIP)
+        skip_absent_strips(&board, &strip);
     if (wrap == WRAP)
     {
-        if (NUM_PIXELS % width != 0)
-        {
-            printf("Width does not evenly divide NUM_PIXELS, WRAP mode disabled, NO_WRAP defaulting\n");
-        }
-        else
+        uint length = strip_pixels(board, strip);
+        if (length == 0 || length % width != 0)
         {
-            wrap_width = NUM_PIXELS / width;
+            LOG(LOG_WRAP_DISABLED, width);
         }
     }
     current_wrap = 0;
@@ -84,10 +332,7 @@ int create_raster(uint16_t height, uint16_t width, uint board, uint strip, uint
 
         for (int j = 0; j < width; j++)
         {
-            raster->raster[i][j] = 0;
-            raster->pixel_mapping[i][j].board = board;
-            raster->pixel_mapping[i][j].strip = strip;
-            raster->pixel_mapping[i][j].pixel = offset;
+            raster->mapping[i * width + j] = (pixel_address_t){board, strip, offset};
 
             if (j == 0)
             {
@@ -143,13 +388,12 @@ int create_raster(uint16_t height, uint16_t width, uint board, uint strip, uint
                 offset = pixel;
             }
 
-            raster->raster[i][j] = 0;
-            raster->pixel_mapping[i][j].board = board;
-            raster->pixel_mapping[i][j].strip = strip;
-            raster->pixel_mapping[i][j].pixel = offset;
+            raster->mapping[i * width + j] = (pixel_address_t){board, strip, offset};
 
             pixel++;
-            if (pixel >= NUM_PIXELS)
+            // CLIP rows keep to their strip, pixels past its real end are dropped when the raster is compiled.
+            // The other modes carry on along the next strip.
+            if (pixel >= (wrap == CLIP ? NUM_PIXELS : strip_pixels(board, strip)))
             {
                 pixel = 0;
                 current_wrap = 0;
@@ -163,121 +407,486 @@ int create_raster(uint16_t height, uint16_t width, uint board, uint strip, uint
                         board = 0;
                     }
                 }
+                if (wrap != CLIP)
+                    skip_absent_strips(&board, &strip);
+            }
+        }
+    }
+}
+
+// Sort key of a plan source: board * NUM_PIXELS + pixel, the order of the columns in the plane buffers,
+// then strip, then row major position in the raster, so later pixels win if two map to the same strip
+static inline uint64_t source_key(const raster_object_t *raster, encode_source_t source)
+{
+    uint32_t order = source.y * raster->width + source.x;
+    pixel_address_t address = raster->mapping[order];
+    return ((uint64_t)(address.board * NUM_PIXELS + address.pixel) << 40) | ((uint64_t)address.strip << 32) | order;
+}
+
+// In place heap sort of the sources by source_key, qsort may allocate
+static void sift_source(const raster_object_t *raster, encode_source_t *sources, uint root, uint count)
+{
+    encode_source_t item = sources[root];
+    uint64_t key = source_key(raster, item);
+    uint child;
+    while ((child = 2 * root + 1) < count)
+    {
+        if (child + 1 < count && source_key(raster, sources[child + 1]) > source_key(raster, sources[child]))
+        {
+            child++;
+        }
+        if (source_key(raster, sources[child]) <= key)
+        {
+            break;
+        }
+        sources[root] = sources[child];
+        root = child;
+    }
+    sources[root] = item;
+}
+
+static void sort_sources(const raster_object_t *raster, encode_source_t *sources, uint count)
+{
+    for (uint i = count / 2; i-- > 0;)
+    {
+        sift_source(raster, sources, i, count);
+    }
+    for (uint end = count; end-- > 1;)
+    {
+        encode_source_t last = sources[end];
+        sources[end] = sources[0];
+        sources[0] = last;
+        sift_source(raster, sources, 0, end);
+    }
+}
+
+// Build the plan at the end of the raster's block, resizing the block to fit it. The sources are gathered and
+// sorted just past the block, where the new plan goes, with the blocks after it moved up to make room, so a
+// raster's first plan takes no more of the pool than the plan itself. Fails, keeping the plan it had, if the
+// pool hasn't the room.
+static int compile_plan(raster_object_t *raster, int raster_id)
+{
+    // Only logged
+    (void)raster_id;
+    uint count = raster->height * raster->width;
+    uint32_t gather_bytes = raster_pool_align(count * sizeof(encode_source_t));
+    if (gather_bytes > raster_pool_bytes - raster_pool_used)
+    {
+        LOG(LOG_PLAN_ALLOC_FAILED, raster_id);
+        return -1;
+    }
+    uint8_t *end = raster->storage + raster->storage_bytes;
+    raster_pool_shift(end, gather_bytes);
+    encode_source_t *sources = (encode_source_t *)end;
+    uint mapped = 0;
+    for (uint i = 0; i < raster->height; i++)
+    {
+        for (uint j = 0; j < raster->width; j++)
+        {
+            pixel_address_t address = raster->mapping[i * raster->width + j];
+            // Past the end of its strip, or on a strip or board that isn't there
+            if (address.pixel >= strip_pixels(address.board, address.strip))
+            {
+                continue;
             }
+            sources[mapped++] = (encode_source_t){j, i};
+        }
+    }
+    sort_sources(raster, sources, mapped);
+
+    // Only the last raster pixel mapped to a physical pixel is shown, same as writing them in order
+    uint32_t source_count = 0;
+    uint32_t column_count = 0;
+    for (uint i = 0; i < mapped; i++)
+    {
+        uint64_t key = source_key(raster, sources[i]);
+        if (i + 1 < mapped && source_key(raster, sources[i + 1]) >> 32 == key >> 32)
+        {
+            continue;
+        }
+        if (source_count == 0 || source_key(raster, sources[source_count - 1]) >> 40 != key >> 40)
+        {
+            column_count++;
+        }
+        sources[source_count++] = sources[i];
+    }
+
+    // Make the block the size of the new plan. The blocks after it are gather_bytes up from where they end up.
+    uint32_t bytes = raster_storage_bytes(raster->height, raster->width, raster->format) + plan_storage_bytes(source_count, column_count);
+    int32_t move = (int32_t)bytes - (int32_t)raster->storage_bytes - (int32_t)gather_bytes;
+    if (move > 0 && (uint32_t)move > raster_pool_bytes - raster_pool_used)
+    {
+        raster_pool_shift(end + gather_bytes, -(int32_t)gather_bytes);
+        LOG(LOG_PLAN_ALLOC_FAILED, raster_id);
+        return -1;
+    }
+    raster->plan.source_count = source_count;
+    raster->plan.column_count = column_count;
+    point_raster_storage(raster, raster->storage);
+    // The new sources start at or below where they were gathered, and end below the blocks after
+    memmove(raster->plan.sources, sources, source_count * sizeof(encode_source_t));
+    raster_pool_shift(end + gather_bytes, move);
+
+    encode_column_t *columns = raster->plan.columns;
+    uint32_t c = 0;
+    uint32_t column_key = 0;
+    for (uint32_t i = 0; i < source_count; i++)
+    {
+        encode_source_t source = raster->plan.sources[i];
+        pixel_address_t address = raster->mapping[source.y * raster->width + source.x];
+        uint32_t key = address.board * NUM_PIXELS + address.pixel;
+        if (c == 0 || key != column_key)
+        {
+            column_key = key;
+            columns[c++] = (encode_column_t){address.board, address.pixel * 3, 0, i};
+        }
+        columns[c - 1].strip_mask |= 1u << address.strip;
+    }
+
+    // Columns are sorted by board, so each board's columns are a contiguous range
+    c = 0;
+    for (uint board = 0; board <= BOARDS; board++)
+    {
+        while (c < column_count && columns[c].board < board)
+        {
+            c++;
         }
+        raster->plan.board_start[board] = c;
     }
-    raster_object[raster_object_count] = raster;
-    return raster_object_count;
+    return 0;
+}
+
+int compile_raster(int raster_id)
+{
+    raster_object_t *raster = get_raster_ptr(raster_id);
+    if (raster == NULL)
+    {
+        LOG(LOG_INVALID_RASTER, raster_id);
+        return -1;
+    }
+    return compile_plan(raster, raster_id);
 }
 
 raster_object_t get_raster(uint raster_id)
 {
-    if (raster_id <= raster_object_count)
+    if (get_raster_ptr(raster_id) != NULL)
     {
-        return *raster_object[raster_id];
+        return raster_object[raster_id];
     }
     else
     {
-        printf("Invalid raster id\n");
-        raster_object_t empty;
-        empty.height = 0;
-        empty.width = 0;
-        empty.raster = NULL;
-        empty.pixel_mapping = NULL;
+        LOG(LOG_INVALID_RASTER, raster_id);
+        raster_object_t empty = {0};
         return empty;
     }
 }
 
+raster_object_t *get_raster_handle(int raster_id)
+{
+    raster_object_t *raster = get_raster_ptr(raster_id);
+    if (raster == NULL)
+    {
+        LOG(LOG_INVALID_RASTER, raster_id);
+    }
+    return raster;
+}
+
 // Move all raster objects to the display buffer, and write to the strings
 void show_all_raster_objects()
 {
     for (int i = 0; i <= raster_object_count; i++)
     {
-        show_raster_object(i);
+        if (raster_object[i].storage != NULL)
+            show_raster_object(i);
     }
     show_pixels();
 }
 
-/**
- * Put a pixel into the bit plane buffer
- */
-void put_pixel(uint board, uint strip, uint pixel, uint32_t pixel_rgb)
+static void mark_clean(raster_object_t *raster)
 {
+    for (int i = 0; i < raster->height; i++)
+    {
+        raster->dirty_x0[i] = UINT16_MAX;
+        raster->dirty_x1[i] = 0;
+    }
+    raster->dirty_y0 = UINT16_MAX;
+    raster->dirty_y1 = 0;
+}
 
-    uint b = pixel_rgb & 0xffu;
-    uint g = (pixel_rgb >> 8u) & 0xffu;
-    uint r = (pixel_rgb >> 16u) & 0xffu;
-    uint v = pixel * 3;
+static void mark_rect_dirty(raster_object_t *raster, int x0, int y0, int x1, int y1);
 
-    uint32_t mask = 1 << (strip + 1); // The mask for the current strip
+void mark_raster_rect_dirty(int raster_id, int x0, int y0, int x1, int y1)
+{
+    raster_object_t *raster = get_raster_ptr(raster_id);
+    if (raster == NULL)
+    {
+        LOG(LOG_INVALID_RASTER, raster_id);
+        return;
+    }
+    mark_rect_dirty(raster, x0, y0, x1, y1);
+}
 
-    uint color_array[3] = {r, g, b};
+static void mark_rect_dirty(raster_object_t *raster, int x0, int y0, int x1, int y1)
+{
+    // Clip to the raster
+    if (x0 < 0)
+        x0 = 0;
+    if (y0 < 0)
+        y0 = 0;
+    if (x1 >= raster->width)
+        x1 = raster->width - 1;
+    if (y1 >= raster->height)
+        y1 = raster->height - 1;
+    if (x0 > x1 || y0 > y1)
+    {
+        return;
+    }
+    for (int y = y0; y <= y1; y++)
+    {
+        if (x0 < raster->dirty_x0[y])
+            raster->dirty_x0[y] = x0;
+        if (x1 > raster->dirty_x1[y])
+            raster->dirty_x1[y] = x1;
+    }
+    if (y0 < raster->dirty_y0)
+        raster->dirty_y0 = y0;
+    if (y1 > raster->dirty_y1)
+        raster->dirty_y1 = y1;
+}
 
-    // Iterate through the colors
-    for (int i = 0; i < 3; i++)
-    { // Each bit plane is 32 bits, one bit for each strip, with the MSB being the first strip
-        // There are three bit planes, one for each color
-        uint32_t *values = buffers[current_buffer][board][v + i].planes;
-        uint32_t color = color_array[i];
-        // Iterate through the 8 bits in each color
-        for (uint bit = 0; bit < 8; bit++)
-        {
-            // Get the current color at this bit plane location
-            uint32_t value = values[bit];
-            // Calculate the bit we are setting.
-            uint color_bit = (color >> (7 - bit)) & 1;
-            // Calculate the new value in the bit plane.
-            values[bit] = (color_bit) ? (value | (mask)) : (value & ~(mask));
-        }
+void mark_raster_dirty(int raster_id, int x, int y)
+{
+    mark_raster_rect_dirty(raster_id, x, y, x, y);
+}
+
+void mark_raster_all_dirty(int raster_id)
+{
+    mark_raster_rect_dirty(raster_id, 0, 0, UINT16_MAX, UINT16_MAX);
+}
+
+// Store a 0xRRGGBB color, or for RASTER_PALETTE8 a palette index, at row major index i
+static inline void store_pixel(raster_object_t *raster, uint32_t i, uint32_t color)
+{
+    switch (raster->format)
+    {
+    case RASTER_PALETTE8:
+        raster->indices[i] = color;
+        break;
+    case RASTER_RGB565:
+        raster->pixels565[i] = rgb_to_565(color);
+        break;
+    default:
+        raster->pixels[i] = color;
+        break;
     }
 }
 
 void draw_pixel(int raster_id, int x, int y, uint32_t color)
 {
-    raster_object_t raster = get_raster(raster_id);
-    if (raster.raster == NULL || raster.pixel_mapping == NULL)
+    raster_object_t *raster = get_raster_handle(raster_id);
+    if (raster == NULL || x < 0 || x >= raster->width || y < 0 || y >= raster->height)
     {
-        printf("Invalid raster object in draw_pixel: %i\n", raster_id);
         return;
     }
-    uint index = y * raster.width + x;
-    raster.raster[x][y] = color;
+    store_pixel(raster, y * raster->width + x, color);
+    mark_rect_dirty(raster, x, y, x, y);
 }
 
 void fill_raster(int raster_id, uint32_t color)
 {
-    raster_object_t raster = get_raster(raster_id);
-    if (raster.raster == NULL || raster.pixel_mapping == NULL)
+    raster_object_t *raster = get_raster_handle(raster_id);
+    if (raster == NULL)
     {
-        printf("Invalid raster object in fill_raster: %i\n", raster_id);
         return;
     }
-    for (int i = 0; i < raster.height; i++)
+    uint32_t count = raster->height * raster->width;
+    switch (raster->format)
     {
-        for (int j = 0; j < raster.width; j++)
+    case RASTER_PALETTE8:
+        memset(raster->indices, color, count);
+        break;
+    case RASTER_RGB565:
+        for (uint32_t i = 0; i < count; i++)
         {
-            raster.raster[i][j] = color;
+            raster->pixels565[i] = rgb_to_565(color);
         }
+        break;
+    default:
+        for (uint32_t i = 0; i < count; i++)
+        {
+            raster->pixels[i] = color;
+        }
+        break;
     }
+    mark_rect_dirty(raster, 0, 0, UINT16_MAX, UINT16_MAX);
 }
 
-void show_raster_object(int i)
+int set_raster_palette(int raster_id, uint first, uint count, const uint32_t *colors)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    if (raster == NULL || raster->palette == NULL || first + count > 256)
+    {
+        return -1;
+    }
+    memcpy(&raster->palette[first], colors, count * sizeof(uint32_t));
+    // Any pixel could use the changed entries
+    mark_rect_dirty(raster, 0, 0, UINT16_MAX, UINT16_MAX);
+    return 0;
+}
+
+// Shows queued in frame_shows
+static uint frame_show_count;
+
+static void encode_shifted_columns(const raster_object_t *raster, uint32_t first, uint32_t end, float shift_x, float shift_y, value_bits_t *board_values);
+
+static void queue_frame_show(int i, bool shifted, float shift_x, float shift_y)
 {
-    raster_object_t raster = get_raster(i);
-    if (raster.raster == NULL || raster.pixel_mapping == NULL)
+    raster_object_t *raster = get_raster_ptr(i);
+    if (raster == NULL)
+    {
+        LOG(LOG_INVALID_RASTER, i);
+        return;
+    }
+    if (frame_show_count >= max_raster_objects)
     {
-        printf("Invalid raster object in put_raster_object: %i\n", i);
+        LOG(LOG_SHOW_QUEUE_FULL, i);
         return;
     }
-    for (int j = 0; j < raster.height; j++)
+    frame_shows[frame_show_count++] = (frame_show_t){i, shifted, shift_x, shift_y};
+    // Every mapped pixel will be encoded from the raster as it is when the frame is sent
+    mark_clean(raster);
+}
+
+void queue_raster_show(int i)
+{
+    queue_frame_show(i, false, 0, 0);
+}
+
+void queue_raster_show_with_shift(int i, float shift_x, float shift_y)
+{
+    queue_frame_show(i, true, shift_x, shift_y);
+}
+
+static bool parallel_encode;
+
+void set_parallel_encode(bool enabled)
+{
+#if !STREAMING_OUTPUT
+    parallel_encode = enabled;
+#else
+    (void)enabled;
+#endif
+}
+
+bool get_parallel_encode()
+{
+    return parallel_encode;
+}
+
+// Encode one board of every queued raster into values, which holds the board's planes
+static void encode_board_shows(uint board, value_bits_t *values)
+{
+    for (uint s = 0; s < frame_show_count; s++)
     {
-        for (int k = 0; k < raster.width; k++)
+        const raster_object_t *raster = &raster_object[frame_shows[s].raster_id];
+        uint32_t first = raster->plan.board_start[board];
+        uint32_t end = raster->plan.board_start[board + 1];
+        if (frame_shows[s].shifted)
+        {
+            encode_shifted_columns(raster, first, end, frame_shows[s].shift_x, frame_shows[s].shift_y, values);
+        }
+        else
         {
+            encode_plan_columns(raster, first, end, values);
+        }
+    }
+}
 
-            uint32_t color = raster.raster[j][k];
-            put_pixel(raster.pixel_mapping[j][k].board, raster.pixel_mapping[j][k].strip, raster.pixel_mapping[j][k].pixel, color);
+void encode_frame_board(uint board, value_bits_t *values)
+{
+    memset(values, 0, board_pixel_count[board] * 3 * sizeof(value_bits_t));
+    encode_board_shows(board, values);
+}
+
+void encode_queued_board(uint board)
+{
+    trace_event(TRACE_ENCODE_START, board);
+    encode_board_shows(board, plane_buffer(current_buffer, board));
+    // Each board is only encoded by one core, so its written range can be tracked without a lock
+    for (uint s = 0; s < frame_show_count; s++)
+    {
+        const encode_plan_t *plan = &raster_object[frame_shows[s].raster_id].plan;
+        uint32_t first = plan->board_start[board];
+        uint32_t end = plan->board_start[board + 1];
+        if (first < end)
+        {
+            uint start = plan->columns[first].plane_offset;
+            mark_planes_written(board, start, plan->columns[end - 1].plane_offset + 3 - start);
         }
     }
+    trace_event(TRACE_ENCODE_END, board);
+}
+
+void clear_frame_shows()
+{
+    frame_show_count = 0;
+}
+
+// Forget a raster that is being destroyed from the shows queued for the next frame
+static void drop_frame_shows(int raster_id)
+{
+    uint kept = 0;
+    for (uint s = 0; s < frame_show_count; s++)
+    {
+        if (frame_shows[s].raster_id != raster_id)
+            frame_shows[kept++] = frame_shows[s];
+    }
+    frame_show_count = kept;
+}
+
+void show_raster_object(int i)
+{
+#if STREAMING_OUTPUT
+    queue_raster_show(i);
+#else
+    if (parallel_encode)
+    {
+        queue_raster_show(i);
+        return;
+    }
+    raster_object_t *raster = get_raster_handle(i);
+    if (raster == NULL)
+    {
+        return;
+    }
+    trace_event(TRACE_ENCODE_START, i);
+    encode_plan(raster);
+    trace_event(TRACE_ENCODE_END, i);
+    mark_clean(raster);
+#endif
+}
+
+void show_raster_object_dirty(int i)
+{
+#if STREAMING_OUTPUT
+    // Nothing is kept between frames, so every shown raster is encoded in full
+    queue_raster_show(i);
+#else
+    raster_object_t *raster = get_raster_ptr(i);
+    if (raster == NULL)
+    {
+        LOG(LOG_INVALID_RASTER, i);
+        return;
+    }
+    if (raster->dirty_y0 > raster->dirty_y1)
+    {
+        return;
+    }
+    trace_event(TRACE_ENCODE_START, i);
+    encode_plan_dirty(raster);
+    trace_event(TRACE_ENCODE_END, i);
+    mark_clean(raster);
+#endif
 }
 
 uint32_t fade_rgb(uint32_t rgb, uint8_t fade)
@@ -300,15 +909,35 @@ uint32_t fade_rgb(uint32_t rgb, uint8_t fade)
 // amount is a value between 0 and 255, 255 is min fade, 0 is full fade
 void fade_raster(uint raster_index, uint8_t amount)
 {
-    raster_object_t *raster = raster_object[raster_index];
-    for (int i = 0; i < raster->height; i++)
+    raster_object_t *raster = get_raster_handle(raster_index);
+    if (raster == NULL)
+    {
+        return;
+    }
+    uint32_t count = raster->height * raster->width;
+    if (raster->format == RASTER_PALETTE8)
+    {
+        // Fading the palette fades every pixel
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            raster->palette[i] = fade_rgb(raster->palette[i], amount);
+        }
+    }
+    else if (raster->format == RASTER_RGB565)
     {
-        for (int j = 0; j < raster->width; j++)
+        for (uint32_t i = 0; i < count; i++)
         {
-            uint32_t rgb = raster->raster[i][j];
-            raster->raster[i][j] = fade_rgb(rgb, amount);
+            raster->pixels565[i] = rgb_to_565(fade_rgb(rgb565_to_rgb(raster->pixels565[i]), amount));
         }
     }
+    else
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            raster->pixels[i] = fade_rgb(raster->pixels[i], amount);
+        }
+    }
+    mark_raster_all_dirty(raster_index);
 }
 
 uint32_t hsl_to_rgb(float h, float s, float l)
@@ -447,77 +1076,87 @@ uint32_t mix_rgb(uint32_t rgb1, uint32_t rgb2, float amount)
 void rainbow(int raster_id)
 {
 
-    raster_object_t raster = get_raster(raster_id);
-    if (raster.raster == NULL || raster.pixel_mapping == NULL)
+    raster_object_t *raster = get_raster_handle(raster_id);
+    if (raster == NULL)
     {
-        printf("Invalid raster object in rainbow: %i\n", raster_id);
         return;
     }
 
-    // for (uint i = 0; i < raster.height; i++)
-    // {
-    //     for (uint j = 0; j < raster.width; j++)
-    //     {
-    //         uint32_t rgb = raster.raster[i][j];
-    //         float h, s, l;
-    //         rgb_to_hsl(rgb, &h, &s, &l);
-    //         //  printf("HSL: %d %d %d\n", h, s2, l2);
-    //         h += 0.01;
-    //         if (h > 1)
-    //         {
-    //             h -= 1;
-    //         }
-    //         uint32_t new_rgb = hsl_to_rgb(h, s, l);
-    //         // printBinary("New RGB", new_rgb);
-    //         raster.raster[i][j] = new_rgb;
-    //     }
-    // }
-    // uint32_t *temp = malloc(raster.width * sizeof(uint32_t));
-
-    for (uint i = 0; i < raster.height; i++)
-    {
-        uint32_t save = raster.raster[i][0];
-        for (uint j = 0; j < raster.width - 1; j++)
+    if (raster->format == RASTER_PALETTE8)
+    {
+        // Palette cycling, every pixel moves along the palette by one entry
+        uint32_t save = raster->palette[0];
+        memmove(&raster->palette[0], &raster->palette[1], 255 * sizeof(uint32_t));
+        raster->palette[255] = save;
+        mark_rect_dirty(raster, 0, 0, UINT16_MAX, UINT16_MAX);
+        return;
+    }
+    for (uint i = 0; i < raster->height; i++)
+    {
+        uint32_t row = i * raster->width;
+        uint32_t save = raster_color(raster, row);
+        for (uint j = 0; j + 1 < raster->width; j++)
         {
 
-            raster.raster[i][j] = mix_rgb(raster.raster[i][j], raster.raster[i][j + 1], 0.5);
+            store_pixel(raster, row + j, mix_rgb(raster_color(raster, row + j), raster_color(raster, row + j + 1), 0.5));
 
-            // raster.raster[i][j] = fade_rgb(raster.raster[i][j], 128) + fade_rgb(raster.raster[i][j + 1], 128);
+            // row[j] = fade_rgb(row[j], 128) + fade_rgb(row[j + 1], 128);
         }
-        raster.raster[i][raster.width - 1] = mix_rgb(save, raster.raster[i][raster.width - 1], 0.5);
+        store_pixel(raster, row + raster->width - 1, mix_rgb(save, raster_color(raster, row + raster->width - 1), 0.5));
     }
+    mark_rect_dirty(raster, 0, 0, UINT16_MAX, UINT16_MAX);
 }
 
-void init_rainbow(int raster_id)
+void fill_gradient(int raster_id, const gradient_t *g, uint16_t phase, uint16_t step_x, uint16_t step_y)
 {
-    float h = 0;
-    float s = 1;
-    float l = 0.5;
-
-    raster_object_t raster = get_raster(raster_id);
-    if (raster.raster == NULL || raster.pixel_mapping == NULL)
+    raster_object_t *raster = get_raster_handle(raster_id);
+    if (raster == NULL)
     {
-        printf("Invalid raster object in rainbow: %i\n", raster_id);
         return;
     }
-    for (uint board = 0; board < BOARDS; board++)
+    if (raster->format == RASTER_PALETTE8)
     {
-        for (uint i = 0; i < raster.height; i++)
+        // The gradient goes in the palette, each pixel indexes its phase
+        for (uint i = 0; i < 256; i++)
         {
-            for (uint j = 0; j < raster.width; j++)
+            raster->palette[i] = gradient_color(g, i << 8);
+        }
+    }
+    uint16_t row_phase = phase;
+    for (uint i = 0; i < raster->height; i++, row_phase += step_y)
+    {
+        uint32_t row = i * raster->width;
+        uint16_t pixel_phase = row_phase;
+        if (raster->format == RASTER_PALETTE8)
+        {
+            for (uint j = 0; j < raster->width; j++, pixel_phase += step_x)
             {
-
-                h = (float)j / raster.width;
-                h = h + (float)i / raster.height;
-                if (h > 1)
-                {
-                    h -= 1;
-                }
-                uint32_t new_rgb = hsl_to_rgb(h, s, l);
-                raster.raster[i][j] = new_rgb;
+                raster->indices[row + j] = pixel_phase >> 8;
             }
+            continue;
+        }
+        for (uint j = 0; j < raster->width; j++, pixel_phase += step_x)
+        {
+            store_pixel(raster, row + j, gradient_color(g, pixel_phase));
         }
     }
+    mark_rect_dirty(raster, 0, 0, UINT16_MAX, UINT16_MAX);
+}
+
+void draw_rainbow(int raster_id, uint16_t phase)
+{
+    raster_object_t *raster = get_raster_handle(raster_id);
+    if (raster == NULL)
+    {
+        return;
+    }
+    // Once round the hue wheel across the width and again down the height
+    fill_gradient(raster_id, rainbow_gradient(), phase, 0x10000 / raster->width, 0x10000 / raster->height);
+}
+
+void init_rainbow(int raster_id)
+{
+    draw_rainbow(raster_id, 0);
 }
 
 // Fast integer-based bilinear interpolation (16-bit precision)
@@ -551,45 +1190,104 @@ static inline uint32_t bilinear_interpolate(uint32_t c00, uint32_t c10, uint32_t
 // this can be used to animate a raster object by moving it across the display in both directions
 void show_raster_object_with_shift(int i, float shift_x, float shift_y)
 {
-    raster_object_t raster = get_raster(i);
-    if (raster.raster == NULL || raster.pixel_mapping == NULL)
+#if STREAMING_OUTPUT
+    queue_raster_show_with_shift(i, shift_x, shift_y);
+#else
+    if (parallel_encode)
+    {
+        queue_raster_show_with_shift(i, shift_x, shift_y);
+        return;
+    }
+    raster_object_t *raster = get_raster_handle(i);
+    if (raster == NULL)
+    {
+        return;
+    }
+    trace_event(TRACE_ENCODE_START, i);
+    encode_shifted_columns(raster, 0, raster->plan.column_count, shift_x, shift_y, NULL);
+    trace_event(TRACE_ENCODE_END, i);
+    // Every mapped pixel has been rewritten
+    mark_clean(raster);
+#endif
+}
+
+// Encode the plan columns first..end - 1 of a raster shifted by shift_x, shift_y.
+// With board_values they all belong to one board and are written there, as in encode_plan_columns.
+static void encode_shifted_columns(const raster_object_t *raster, uint32_t first, uint32_t end, float shift_x, float shift_y, value_bits_t *board_values)
+{
+    if (first >= end)
     {
-        printf("Invalid raster object in put_raster_object: %i\n", i);
         return;
     }
-    int width = raster.width;
-    int height = raster.height;
+    int width = raster->width;
+    int height = raster->height;
     // Convert shift values to pixel space with 16-bit fixed-point precision
     int dx = (int)(shift_x * width * 65536);
     int dy = (int)(shift_y * height * 65536);
 
     int shift_x_int = dx >> 16; // Integer pixel shift
     int shift_y_int = dy >> 16;
-    int fx = 0xFFFF - dx & 0xFFFF; // Fractional part (16-bit precision)
-    int fy = 0xFFFF - dy & 0xFFFF;
-
-    for (int y = 0; y < height; y++)
+    int fx = (0xFFFF - dx) & 0xFFFF; // Fractional part (16-bit precision)
+    int fy = (0xFFFF - dy) & 0xFFFF;
+
+    // Walk the encode plan so the bit planes are written in order, a pixel index at a time
+    uint32_t colors[STRIP_GROUPS * 8] = {0};
+    EncodeMode mode = get_encode_mode();
+    const encode_source_t *first_source = raster->plan.sources + raster->plan.columns[first].first_source;
+    const encode_source_t *source = first_source;
+    for (uint32_t c = first; c < end; c++)
     {
-        // Compute wrapped Y indices using modulo
-        int y0 = (y - shift_y_int + height) % height;
-        int y1 = (y0 + 1) % height;
-
-        for (int x = 0; x < width; x++)
+        const encode_column_t *column = &raster->plan.columns[c];
+        value_bits_t *values;
+        if (board_values)
         {
-            // Compute wrapped X indices using modulo
+            values = board_values + column->plane_offset;
+        }
+        else
+        {
+            values = plane_buffer(current_buffer, column->board) + column->plane_offset;
+            mark_planes_written(column->board, column->plane_offset, 3);
+        }
+        for (uint strip = 0; strip < STRIPS; strip++)
+        {
+            if (!(column->strip_mask & (1u << strip)))
+            {
+                continue;
+            }
+            int x = source->x;
+            int y = source->y;
+            source++;
+
+            // Compute wrapped X and Y indices using modulo
             int x0 = (x - shift_x_int + width) % width;
             int x1 = (x0 + 1) % width;
+            int y0 = (y - shift_y_int + height) % height;
+            int y1 = (y0 + 1) % height;
 
             // Fetch four neighboring pixels
-            uint32_t c00 = raster.raster[y0][x0];
-
-            uint32_t c10 = raster.raster[y0][x1];
-            uint32_t c01 = raster.raster[y1][x0];
-            uint32_t c11 = raster.raster[y1][x1];
+            uint32_t row0 = y0 * width;
+            uint32_t row1 = y1 * width;
+            uint32_t c00 = raster_color(raster, row0 + x0);
+            uint32_t c10 = raster_color(raster, row0 + x1);
+            uint32_t c01 = raster_color(raster, row1 + x0);
+            uint32_t c11 = raster_color(raster, row1 + x1);
             //  Apply bilinear interpolation using 16-bit integer math
-            put_pixel(raster.pixel_mapping[y][x].board, raster.pixel_mapping[y][x].strip, raster.pixel_mapping[y][x].pixel, bilinear_interpolate(c00, c10, c01, c11, fx, fy));
+            uint32_t color = bilinear_interpolate(c00, c10, c01, c11, fx, fy);
+            if (mode == ENCODE_TRANSPOSE)
+            {
+                colors[strip] = color;
+            }
+            else
+            {
+                put_pixel_planes(values, strip, color);
+            }
+        }
+        if (mode == ENCODE_TRANSPOSE)
+        {
+            encode_column(values, colors, column->strip_mask);
         }
     }
+    encode_stats_add(source - first_source);
 }
 
 static uint64_t start_time = 0;
@@ -607,7 +1305,7 @@ uint64_t stop_timer(const char *log_message)
         return 0;
     }
     uint64_t elapsed_time = (time_us_64() - start_time); // Convert to milliseconds
-    printf("%s: Elapsed time = %llu us\n", log_message, elapsed_time);
+    printf("%s: Elapsed time = %llu us\n", log_message, (unsigned long long)elapsed_time);
     start_time = 0; // Reset timer
     return elapsed_time;
 }
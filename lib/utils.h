@@ -6,6 +6,8 @@ typedef unsigned short uint16_t;
 typedef unsigned char uint8_t;
 #endif
 #include "pixelblit.h"
+#include "encoder.h"
+#include "gradient.h"
 // Create a direct raster object. starting at the given board, strip, and pixel
 // This is useful for creating a raster object that is a subset of the display
 // This simplistically just tries to map a width x height grid, just advancing first the pixel,
@@ -19,21 +21,135 @@ typedef unsigned char uint8_t;
 // create 4, 25 pixel strips. WrapMode WRAP will map the pixels in the order 0-24, 49-25, 50-74, 99-75
 
 // Height is the strip number, width is the pixel number.
-// Boards are assumed to have 16 strips and NUM_PIXELS pixels on each strip
-// If this isn't true, just ensure that NUM_PIXELS is the number of pixels on the longest strip
+// Strip lengths come from the geometry (geometry.h), raster pixels past the end of a strip, or on a
+// board that isn't present, are not shown. NO_WRAP and WRAP carry on along the next strip at its end.
 //
 
 int create_raster(uint16_t height, uint16_t width, uint board, uint strip, uint pixel, WrapMode wrap);
 
+// create_raster for a raster stored in the given format, create_raster makes RASTER_RGB888 rasters.
+// A RASTER_PALETTE8 pixel takes a quarter of the memory and RASTER_RGB565 half. Palette rasters start
+// with a grey ramp, palette[i] = i * 0x010101.
+int create_raster_format(uint16_t height, uint16_t width, uint board, uint strip, uint pixel, WrapMode wrap, RasterFormat format);
+
+// Set palette entries first..first + count - 1 of a RASTER_PALETTE8 raster. Every pixel is encoded again
+// the next time it is shown, so cycling colors costs 256 entries, not a pass over the pixels.
+// Returns -1 if the raster has no palette or the entries don't fit.
+int set_raster_palette(int raster_id, uint first, uint count, const uint32_t *colors);
+
+// Raster lifecycle. Each raster's storage is one block of the raster pool given to init_geometry, and the
+// blocks are kept packed, so rasters can be created and destroyed for as long as they fit.
+// destroy_raster frees the raster and its id, which the next create_raster reuses. What it last encoded
+// stays in the plane buffers until something is shown over it.
+// resize_raster maps the raster again from where it was created at the new size, keeping the pixels that
+// are in both sizes. It fails, leaving the raster as it was, if the pool can't hold both sizes at once.
+// Both move the other rasters' storage: pointers taken from get_raster() are only good until the next call.
+// Neither can be called while a frame is being encoded. Both return -1 on failure.
+int destroy_raster(int raster_id);
+int resize_raster(int raster_id, uint16_t height, uint16_t width);
+
+// Rebuild the encode plan of a raster from its pixel_mapping. create_raster does this already,
+// call it again after editing pixel_mapping by hand. The plan is part of the raster's block of the pool,
+// so this can move the other rasters, and the new plan is built beside the old one: it needs 4 bytes a
+// pixel of free pool while it sorts.
+// Returns -1, keeping the old plan, if the pool hasn't the room.
+int compile_raster(int raster_id);
+
+// A copy of the raster, zeroed if the id isn't a raster. Its pointers are only good until the next
+// destroy_raster or resize_raster.
 raster_object_t get_raster(uint raster_id);
 
+// The raster itself, resolved once, or NULL (and logged) if the id isn't a raster. It stays valid until the
+// raster is destroyed, and its pixels and mapping pointers are kept up to date when the pool moves.
+raster_object_t *get_raster_handle(int raster_id);
+
+// Flat pixel access through a handle, none of it marks anything dirty. With RASTER_BOUNDS_CHECK=0 the
+// coordinates aren't checked, for loops that already keep to the raster. Values are in the raster's format:
+// 0xRRGGBB for RASTER_RGB888, a palette index for RASTER_PALETTE8 and a 565 value for RASTER_RGB565.
+#ifndef RASTER_BOUNDS_CHECK
+#define RASTER_BOUNDS_CHECK 1
+#endif
+
+static inline uint32_t raster_get(const raster_object_t *raster, int x, int y)
+{
+#if RASTER_BOUNDS_CHECK
+    if ((uint)x >= raster->width || (uint)y >= raster->height)
+        return 0;
+#endif
+    uint32_t i = y * raster->width + x;
+    switch (raster->format)
+    {
+    case RASTER_PALETTE8:
+        return raster->indices[i];
+    case RASTER_RGB565:
+        return raster->pixels565[i];
+    default:
+        return raster->pixels[i];
+    }
+}
+
+static inline void raster_set(raster_object_t *raster, int x, int y, uint32_t value)
+{
+#if RASTER_BOUNDS_CHECK
+    if ((uint)x >= raster->width || (uint)y >= raster->height)
+        return;
+#endif
+    uint32_t i = y * raster->width + x;
+    switch (raster->format)
+    {
+    case RASTER_PALETTE8:
+        raster->indices[i] = value;
+        break;
+    case RASTER_RGB565:
+        raster->pixels565[i] = value;
+        break;
+    default:
+        raster->pixels[i] = value;
+        break;
+    }
+}
+
+// Pixels of row y of a RASTER_RGB888 raster, width of them
+static inline uint32_t *raster_row(raster_object_t *raster, int y)
+{
+    return &raster->pixels[y * raster->width];
+}
+
 void show_all_raster_objects();
 
 void show_raster_object(int i);
+// Like show_raster_object, but only re-encodes the pixels marked dirty since the raster was last shown
+void show_raster_object_dirty(int i);
 void show_raster_object_with_shift(int i, float shift_x, float shift_y);
 
+// Streaming output. In STREAMING_OUTPUT builds the show_raster_object functions only queue the raster,
+// and each board is encoded from the queue just before it is sent.
+void queue_raster_show(int raster_id);
+void queue_raster_show_with_shift(int raster_id, float shift_x, float shift_y);
+// Clear values and encode one board of every queued raster into it
+void encode_frame_board(uint board, value_bits_t *values);
+// Empty the queue once the frame has been encoded
+void clear_frame_shows();
+
+// Parallel encode. show_raster_object and show_raster_object_with_shift only queue the raster, and
+// show_pixels encodes the queue into the current buffer a board at a time on both cores.
+// show_raster_object_dirty still encodes straight away. Not available with STREAMING_OUTPUT.
+void set_parallel_encode(bool enabled);
+bool get_parallel_encode();
+// Encode one board of every queued raster into the current buffer, leaving the rest of its planes as they are
+void encode_queued_board(uint board);
+
+// color is 0xRRGGBB, or a palette index for RASTER_PALETTE8 rasters. fill_raster is the same.
+// fade_raster and rainbow work on the palette of RASTER_PALETTE8 rasters, rainbow cycles it by one entry.
 void draw_pixel(int raster_id, int x, int y, uint32_t color);
 
+// Dirty tracking. draw_pixel, fill_raster, fade_raster and the effects mark what they change,
+// pixels written directly through a handle or get_raster().raster must be marked with these.
+void mark_raster_dirty(int raster_id, int x, int y);
+// Mark the rectangle x0..x1, y0..y1 (inclusive) dirty
+void mark_raster_rect_dirty(int raster_id, int x0, int y0, int x1, int y1);
+void mark_raster_all_dirty(int raster_id);
+
 void fill_raster(int raster_id, uint32_t color);
 
 void fade_raster(uint raster_index, uint8_t amount);
@@ -42,9 +158,18 @@ void fade_raster(uint raster_index, uint8_t amount);
 uint32_t hsl_to_rgb(float h, float s, float l);
 // RGB to HSL
 void rgb_to_hsl(uint32_t rgb, float *h, float *s, float *l);
+// Blend two colors, amount 0 is rgb1 and 1 is rgb2
+uint32_t mix_rgb(uint32_t rgb1, uint32_t rgb2, float amount);
 
 void rainbow(int raster_id);
 
+// Fill a raster from gradient g, pixel x, y gets the color at phase + x * step_x + y * step_y.
+// A RASTER_PALETTE8 raster gets the gradient as its palette and indexes it.
+void fill_gradient(int raster_id, const gradient_t *g, uint16_t phase, uint16_t step_x, uint16_t step_y);
+// Diagonal rainbow from rainbow_gradient, once round the hues across the raster and once down it.
+// Step phase each frame to animate it.
+void draw_rainbow(int raster_id, uint16_t phase);
+// draw_rainbow at phase 0
 void init_rainbow(int raster_id);
 
 void start_timer();
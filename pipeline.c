@@ -0,0 +1,208 @@
+// Runs the render -> encode -> output pipeline of ws2812_parallel.c on the host: pixelblit.c on the host
+// HAL (lib/hal_host.c), core 1 as a thread, and the PIO and DMA in the simulator. Checks that the strips
+// received the last frame sent and reports where the time went.
+//
+// ./pipeline [serial|overlap|chained] [frames] [split]
+//
+// split encodes each frame on both cores (set_parallel_encode).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "lib/defines.h"
+#include "lib/utils.h"
+#include "lib/encoder.h"
+#include "lib/pixelblit.h"
+#include "lib/hal.h"
+#include "lib/pio_programs.h"
+#include "lib/trace.h"
+#include "lib/log.h"
+#include "lib/geometry.h"
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Color of a strip's pixel as the planes of a board send it, r, g then b, MSB first
+static uint32_t planes_pixel(const value_bits_t *values, uint strip, uint pixel)
+{
+    uint32_t rgb = 0;
+    for (uint channel = 0; channel < 3; channel++)
+    {
+        const value_bits_t *value = &values[pixel * 3 + channel];
+        for (uint bit = 0; bit < 8; bit++)
+        {
+            uint32_t level = (value->planes[bit] >> (strip + PLANE_STRIP_SHIFT)) & 1u;
+            rgb |= level << (23 - channel * 8 - bit);
+        }
+    }
+    return rgb;
+}
+
+// The scene: both rasters drifting along their rainbows
+static void show_scene(int board1, int board2, uint time)
+{
+    float shift_x = fmodf(time * 0.001f, 1.0f);
+    float shift_y = fmodf(time * 0.001f, 1.0f);
+    show_raster_object_with_shift(board1, shift_x, shift_y);
+    show_raster_object_with_shift(board2, shift_x, shift_y);
+}
+
+// Compare what every strip latched with the frame that was sent last, returns the number of wrong pixels
+static uint check_strips(const piosim_t *sim, int board1, int board2, uint last_time)
+{
+    uint wrong = 0;
+#if STREAMING_OUTPUT
+    // The board buffers only hold the last two boards, every board is encoded again from the last frame's shows
+    static value_bits_t streamed[NUM_PIXELS * 3];
+    show_scene(board1, board2, last_time);
+#else
+    (void)board1;
+    (void)board2;
+    (void)last_time;
+#endif
+    for (uint board = 0; board < BOARDS; board++)
+    {
+#if STREAMING_OUTPUT
+        encode_frame_board(board, streamed);
+        const value_bits_t *values = streamed;
+#else
+        // The buffers were swapped after the last frame was sent
+        const value_bits_t *values = plane_buffer(current_buffer ^ 1, board);
+#endif
+        for (uint strip = 0; strip < STRIPS; strip++)
+        {
+            const piosim_strip_t *s = &sim->strips[board][strip];
+            for (uint pixel = 0; pixel < NUM_PIXELS; pixel++)
+            {
+                // Boards that never changed are never sent, and stay black
+                uint32_t latched = s->frames ? s->pixels[pixel] : 0;
+                if (latched != planes_pixel(values, strip, pixel))
+                    wrong++;
+            }
+        }
+    }
+#if STREAMING_OUTPUT
+    clear_frame_shows();
+#endif
+    return wrong;
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[] = {"serial", "overlap", "chained"};
+    OutputSchedule schedule = OUTPUT_SCHEDULE_OVERLAP;
+    uint frames = 20;
+    if (argc > 1)
+    {
+        int found = -1;
+        for (int i = 0; i < 3; i++)
+        {
+            if (strcmp(argv[1], names[i]) == 0)
+                found = i;
+        }
+        if (found < 0)
+        {
+            printf("usage: %s [serial|overlap|chained] [frames] [split]\n", argv[0]);
+            return 2;
+        }
+        schedule = (OutputSchedule)found;
+    }
+    if (argc > 2)
+        frames = atoi(argv[2]);
+    bool split = argc > 3 && strcmp(argv[3], "split") == 0;
+
+    set_output_schedule(schedule);
+    if (get_output_schedule() != schedule)
+    {
+        printf("The %s schedule is not available in this build\n", names[schedule]);
+        return 2;
+    }
+    geometry_t g;
+    default_geometry(&g);
+    if (init_geometry(&g, MAX_RASTER_OBJECTS, RASTER_POOL_BYTES) != 0 || initialize_dma() != 0)
+    {
+        log_drain(LOG_RECORDS);
+        return 1;
+    }
+    set_encode_mode(ENCODE_TRANSPOSE);
+    set_buffer_copy_mode(BUFFER_COPY_WRITTEN);
+    set_parallel_encode(split);
+    int board1 = create_raster(16, 100, 0, 0, 0, CLIP);
+    int board2 = create_raster(16, 100, BOARDS - 1, 0, 0, CLIP);
+    if (board1 < 0 || board2 < 0)
+    {
+        log_drain(LOG_RECORDS);
+        printf("FAILED: the rasters don't fit in the raster pool\n");
+        return 1;
+    }
+    init_rainbow(board1);
+    init_rainbow(board2);
+    log_drain(LOG_RECORDS);
+
+    trace_start();
+    uint64_t render_ns = 0;
+    uint64_t start_ns = now_ns();
+    uint64_t start_us = hal_time_us_64();
+    for (uint time = 0; time < frames; time++)
+    {
+        uint64_t render_start = now_ns();
+        trace_event(TRACE_RENDER_START, time);
+        show_scene(board1, board2, time);
+        trace_event(TRACE_RENDER_END, time);
+        render_ns += now_ns() - render_start;
+
+        show_pixels();
+    }
+    while (get_output_stats().frames < frames)
+        hal_tight_loop();
+    hal_host_wait_idle();
+    log_drain(LOG_RECORDS);
+    uint64_t wall_ns = now_ns() - start_ns;
+    uint64_t output_us = hal_time_us_64() - start_us;
+
+    hal_host_sim_lock();
+    uint wrong = check_strips(hal_host_sim(), board1, board2, frames - 1);
+    piosim_timing_t timing = hal_host_sim()->timing;
+    hal_host_sim_unlock();
+
+    output_stats_t stats = get_output_stats();
+    printf("Pipeline %s, %u frames of %u boards%s\n", names[schedule], frames, BOARDS, split ? ", parallel encode" : "");
+    printf("Output: %.1f fps, %.1f us/frame sent, %u boards sent (%.1f%% of their pixels), %u unchanged skipped\n", frames * 1e6 / output_us,
+           (double)stats.frame_total_us / stats.frames, stats.boards_sent,
+           stats.boards_sent ? 100.0 * stats.values_sent / (stats.boards_sent * NUM_PIXELS * 3.0) : 0.0, stats.boards_skipped);
+    printf("ISR: %u calls, %.2f us avg, %u us max\n", stats.isr_count,
+           stats.isr_count ? (double)stats.isr_total_us / stats.isr_count : 0.0, stats.isr_max_us);
+    printf("Render: %.1f us/frame on the host\n", render_ns / 1000.0 / frames);
+    if (split)
+        printf("Parallel encode: %.1f us/frame, core 1 encoded %u of %u boards, core 0 waited %u us for it\n",
+               (double)stats.split_encode_us / frames, stats.split_boards_core1, frames * BOARDS, stats.split_wait_us);
+    printf("Handoff: %u frames submitted, %u queued at most, core 0 stalled %u times for %u us, core 1 starved %u us, latency %.1f us avg %u us max\n",
+           stats.frames_submitted, stats.submit_queue_max, stats.submit_stalls, stats.submit_stall_us, stats.output_starved_us,
+           stats.frames ? (double)stats.frame_latency_total_us / stats.frames : 0.0, stats.frame_latency_max_us);
+    printf("Bits: 0 high %u-%u, 1 high %u-%u, period %u-%u cycles\n", timing.zero_high_min, timing.zero_high_max,
+           timing.one_high_min, timing.one_high_max, timing.period_min, timing.period_max);
+    printf("Simulated %.1f ms of output in %.1f ms\n", output_us / 1000.0, wall_ns / 1e6);
+    trace_print_summary();
+#if STREAMING_OUTPUT
+    printf("Streaming: %u boards encoded, %u us longest, %u late for %u us, %u waited for their buffer\n", stats.stream_boards_encoded,
+           stats.stream_encode_max_us, stats.stream_late_boards, stats.stream_late_total_us, stats.stream_buffer_waits);
+    if (stats.stream_buffer_waits)
+    {
+        printf("FAILED: %u boards waited for the board before them to be sent from their buffer\n", stats.stream_buffer_waits);
+        return 1;
+    }
+#endif
+    if (wrong)
+    {
+        printf("FAILED: %u pixels differ from the last frame sent\n", wrong);
+        return 1;
+    }
+    printf("Strips match the last frame sent\n");
+    return 0;
+}
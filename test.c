@@ -14,7 +14,21 @@ typedef unsigned char uint8_t;
 #include <math.h>
 #include "lib/utils.h"
 #include "lib/defines.h"
+#include "lib/encoder.h"
+#include "lib/piosim.h"
+#include "lib/pio_programs.h"
+#include "lib/trace.h"
+#include "lib/log.h"
+#include "lib/frame_queue.h"
+#include "lib/geometry.h"
+#include "lib/hal.h"
 #include <assert.h>
+
+// Plane bytes of a board and of a whole buffer, the tests run with every board at full length
+#define BOARD_PLANE_BYTES (NUM_PIXELS * 3 * sizeof(value_bits_t))
+#define FRAME_PLANE_BYTES (buffer_values * sizeof(value_bits_t))
+// Rasters are never destroyed by most tests, so there is room for all of them
+#define TEST_RASTER_POOL_BYTES (1024 * 1024)
 void printBinary(const char *description, unsigned int number)
 {
     printf("%s: ", description); // Print the description
@@ -29,8 +43,1261 @@ void printBinary(const char *description, unsigned int number)
     printf("\n"); // Newline at the end
 }
 
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void show_pixels()
+{
+    // stub, no DMA so the buffers are swapped straight away. ./pipeline runs the real output path.
+    encode_stats_end_frame();
+#if STREAMING_OUTPUT
+    // The queued shows would be encoded as the frame is sent
+    clear_frame_shows();
+#endif
+    swap_buffers();
+    log_drain(LOG_RECORDS);
+}
+
+// Time show_raster_object on a full board in the given encode mode, returns ns per pixel
+double benchmark_encode_mode(int raster_id, EncodeMode mode, int iterations)
+{
+    raster_object_t ro = get_raster(raster_id);
+    set_encode_mode(mode);
+    show_raster_object(raster_id); // warm up
+    uint64_t start = now_ns();
+    for (int i = 0; i < iterations; i++)
+    {
+        show_raster_object(raster_id);
+    }
+    uint64_t elapsed = now_ns() - start;
+    return (double)elapsed / ((double)iterations * ro.width * ro.height);
+}
+
+// Compare the put_pixel and transpose encoders on one 16x100 board
+void benchmark_encoders()
+{
+    int obj = create_raster(STRIPS, NUM_PIXELS, 2, 0, 0, CLIP);
+    raster_object_t ro = get_raster(obj);
+    srand(1);
+    for (int i = 0; i < ro.height; i++)
+    {
+        for (int j = 0; j < ro.width; j++)
+        {
+            ro.raster[i][j] = rand() & 0xffffff;
+        }
+    }
+
+    // Both encoders must produce identical planes, the transpose encoder without reading the old ones
+    memset(plane_buffer(current_buffer, 2), 0, BOARD_PLANE_BYTES);
+    set_encode_mode(ENCODE_PUT_PIXEL);
+    show_raster_object(obj);
+    static value_bits_t expected[NUM_PIXELS * 3];
+    memcpy(expected, plane_buffer(current_buffer, 2), sizeof(expected));
+    for (int i = 0; i < NUM_PIXELS * 3; i++)
+    {
+        for (int bit = 0; bit < VALUE_PLANE_COUNT; bit++)
+        {
+            plane_buffer(current_buffer, 2)[i].planes[bit] = ALL_STRIPS_MASK << PLANE_STRIP_SHIFT;
+        }
+    }
+    set_encode_mode(ENCODE_TRANSPOSE);
+    show_raster_object(obj);
+    assert(memcmp(expected, plane_buffer(current_buffer, 2), sizeof(expected)) == 0);
+
+    // A raster covering only some strips must leave the other strips alone
+    int partial = create_raster(5, NUM_PIXELS, 3, 4, 0, CLIP);
+    fill_raster(partial, 0x123456);
+    memset(plane_buffer(current_buffer, 3), 0xa5, BOARD_PLANE_BYTES);
+    set_encode_mode(ENCODE_PUT_PIXEL);
+    show_raster_object(partial);
+    memcpy(expected, plane_buffer(current_buffer, 3), sizeof(expected));
+    memset(plane_buffer(current_buffer, 3), 0xa5, BOARD_PLANE_BYTES);
+    set_encode_mode(ENCODE_TRANSPOSE);
+    show_raster_object(partial);
+    assert(memcmp(expected, plane_buffer(current_buffer, 3), sizeof(expected)) == 0);
+
+    // Same for the shifted path
+    memset(plane_buffer(current_buffer, 2), 0, BOARD_PLANE_BYTES);
+    set_encode_mode(ENCODE_PUT_PIXEL);
+    show_raster_object_with_shift(obj, 0.3f, 0.7f);
+    memcpy(expected, plane_buffer(current_buffer, 2), sizeof(expected));
+    set_encode_mode(ENCODE_TRANSPOSE);
+    show_raster_object_with_shift(obj, 0.3f, 0.7f);
+    assert(memcmp(expected, plane_buffer(current_buffer, 2), sizeof(expected)) == 0);
+
+    int iterations = 2000;
+    double put_pixel_ns = benchmark_encode_mode(obj, ENCODE_PUT_PIXEL, iterations);
+    double transpose_ns = benchmark_encode_mode(obj, ENCODE_TRANSPOSE, iterations);
+    printf("Encode put_pixel: %.2f ns/pixel\n", put_pixel_ns);
+    printf("Encode transpose: %.2f ns/pixel (%.1fx)\n", transpose_ns, put_pixel_ns / transpose_ns);
+    set_encode_mode(ENCODE_PUT_PIXEL);
+}
+
+// Strip levels the data program drives during the data part of one bit period. The DMA hands the
+// PIO 32 bit words and out x shifts one plane at a time off the bottom of each word.
+static uint32_t emitted_strip_levels(uint board, uint bit_index)
+{
+    const uint32_t *words = (const uint32_t *)plane_buffer(current_buffer, board);
+    uint plane_bits = 8 * sizeof(plane_word_t);
+    uint planes_per_word = 32 / plane_bits;
+    uint32_t plane = words[bit_index / planes_per_word] >> ((bit_index % planes_per_word) * plane_bits);
+    if (plane_bits < 32)
+    {
+        plane &= (1u << plane_bits) - 1;
+    }
+    return (plane >> PLANE_STRIP_SHIFT) & ALL_STRIPS_MASK;
+}
+
+// The waveform sent for a board must be the raster's colors, r, g then b of each pixel, MSB first,
+// whatever the plane format and encoder
+void test_emitted_waveform()
+{
+    int obj = create_raster(STRIPS, NUM_PIXELS, 4, 0, 0, CLIP);
+    raster_object_t ro = get_raster(obj);
+    srand(8);
+    for (int i = 0; i < ro.height; i++)
+    {
+        for (int j = 0; j < ro.width; j++)
+        {
+            ro.raster[i][j] = rand() & 0xffffff;
+        }
+    }
+
+    EncodeMode modes[2] = {ENCODE_PUT_PIXEL, ENCODE_TRANSPOSE};
+    for (int m = 0; m < 2; m++)
+    {
+        memset(plane_buffer(current_buffer, 4), 0, BOARD_PLANE_BYTES);
+        set_encode_mode(modes[m]);
+        show_raster_object(obj);
+        for (uint pixel = 0; pixel < NUM_PIXELS; pixel++)
+        {
+            for (uint channel = 0; channel < 3; channel++)
+            {
+                for (uint bit = 0; bit < 8; bit++)
+                {
+                    uint32_t expected = 0;
+                    for (uint strip = 0; strip < STRIPS; strip++)
+                    {
+                        uint32_t value = (ro.raster[strip][pixel] >> (16 - channel * 8)) & 0xffu;
+                        expected |= ((value >> (7 - bit)) & 1u) << strip;
+                    }
+                    assert(emitted_strip_levels(4, (pixel * 3 + channel) * 8 + bit) == expected);
+                }
+            }
+        }
+    }
+    printf("Emitted waveform matches, %u bytes of planes per board\n", (uint)BOARD_PLANE_BYTES);
+}
+
+// Color of a strip's pixel in a board's planes, r, g then b, MSB first
+static uint32_t planes_color(const value_bits_t *values, uint strip, uint pixel)
+{
+    uint32_t rgb = 0;
+    for (uint channel = 0; channel < 3; channel++)
+    {
+        for (uint bit = 0; bit < 8; bit++)
+        {
+            uint32_t level = (values[pixel * 3 + channel].planes[bit] >> (strip + PLANE_STRIP_SHIFT)) & 1u;
+            rgb |= level << (23 - channel * 8 - bit);
+        }
+    }
+    return rgb;
+}
+
+// Encoding a board at a time from the queued shows must give the same planes with either encoder, and
+// without STREAMING_OUTPUT the same planes as showing into the frame buffer
+void test_streamed_boards()
+{
+    // Starts half way along board 5 and runs onto board 6
+    int spanning = create_raster(24, 60, 5, 4, 20, NO_WRAP);
+    int shifted = create_raster(STRIPS, NUM_PIXELS, 6, 0, 0, CLIP);
+    raster_object_t a = get_raster(spanning);
+    raster_object_t b = get_raster(shifted);
+    srand(9);
+    for (int i = 0; i < a.height; i++)
+        for (int j = 0; j < a.width; j++)
+            a.raster[i][j] = rand() & 0xffffff;
+    for (int i = 0; i < b.height; i++)
+        for (int j = 0; j < b.width; j++)
+            b.raster[i][j] = rand() & 0xffffff;
+
+    static value_bits_t streamed[NUM_PIXELS * 3];
+    static value_bits_t put_pixel_boards[3][NUM_PIXELS * 3];
+    EncodeMode modes[2] = {ENCODE_PUT_PIXEL, ENCODE_TRANSPOSE};
+    for (int m = 0; m < 2; m++)
+    {
+        set_encode_mode(modes[m]);
+#if !STREAMING_OUTPUT
+        for (uint board = 5; board <= 7; board++)
+        {
+            memset(plane_buffer(current_buffer, board), 0, sizeof(streamed));
+        }
+        show_raster_object_with_shift(shifted, 0.25f, 0.5f);
+        show_raster_object(spanning);
+#endif
+
+        queue_raster_show_with_shift(shifted, 0.25f, 0.5f);
+        queue_raster_show(spanning);
+        for (uint board = 5; board <= 7; board++)
+        {
+            memset(streamed, 0xa5, sizeof(streamed));
+            encode_frame_board(board, streamed);
+#if !STREAMING_OUTPUT
+            assert(memcmp(streamed, plane_buffer(current_buffer, board), sizeof(streamed)) == 0);
+#endif
+            if (m == 0)
+                memcpy(put_pixel_boards[board - 5], streamed, sizeof(streamed));
+            else
+                assert(memcmp(streamed, put_pixel_boards[board - 5], sizeof(streamed)) == 0);
+            // The raster queued last is on top
+            for (uint i = 0; i < (uint)a.height * a.width; i++)
+            {
+                pixel_address_t address = a.mapping[i];
+                if (address.board == board)
+                    assert(planes_color(streamed, address.strip, address.pixel) == a.pixels[i]);
+            }
+        }
+        clear_frame_shows();
+    }
+    printf("Streamed boards match the frame buffer\n");
+}
+
+// Every strip of the first boards gets its own random colors, the other boards are left black.
+// Returns the raster id of the first board, the others follow it.
+static int fill_simulated_boards(uint boards)
+{
+    int first_raster = -1;
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        memset(plane_buffer(current_buffer, board), 0, BOARD_PLANE_BYTES);
+    }
+    srand(10);
+    for (uint board = 0; board < boards; board++)
+    {
+        int obj = create_raster(STRIPS, NUM_PIXELS, board, 0, 0, CLIP);
+        raster_object_t ro = get_raster(obj);
+        for (int i = 0; i < ro.height; i++)
+            for (int j = 0; j < ro.width; j++)
+                ro.raster[i][j] = rand() & 0xffffff;
+        show_raster_object(obj);
+        if (board == 0)
+            first_raster = obj;
+    }
+    return first_raster;
+}
+
+// The decoded strips must hold the raster colors, with WS2812 timing on every bit
+static void check_simulated_output(piosim_t *sim, int first_raster, uint boards)
+{
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        for (uint strip = 0; strip < STRIPS; strip++)
+        {
+            const piosim_strip_t *s = &sim->strips[board][strip];
+            assert(s->frames == 1);
+            for (uint pixel = 0; pixel < NUM_PIXELS; pixel++)
+            {
+                uint32_t expected = board < boards ? get_raster(first_raster + board).raster[strip][pixel] : 0;
+                assert(s->pixels[pixel] == expected);
+            }
+        }
+    }
+    uint cycles_per_bit = ws2812_parallel_T1 + ws2812_parallel_T2 + ws2812_parallel_T3;
+    assert(sim->timing.zero_high_min == ws2812_parallel_T1 && sim->timing.zero_high_max == ws2812_parallel_T1);
+    assert(sim->timing.one_high_min == ws2812_parallel_T1 + ws2812_parallel_T2 && sim->timing.one_high_max == ws2812_parallel_T1 + ws2812_parallel_T2);
+    assert(sim->timing.period_min == cycles_per_bit && sim->timing.period_max == cycles_per_bit);
+    assert(sim->timing.bits == (uint64_t)BOARDS * STRIPS * NUM_PIXELS * 24);
+    assert(sim->dma_words >= (uint64_t)BOARDS * NUM_PIXELS * 3 * VALUE_WORD_COUNT);
+}
+
+// Run the output programs in the PIO simulator and decode what the strips receive
+void test_output_simulation()
+{
+    static piosim_t sim;
+    static uintptr_t fragments[NUM_PIXELS * 3 + 1];
+    // A segment for each fragment of a board, or for each of the 4 blocks of each board in the chain
+    static piosim_segment_t segments[NUM_PIXELS * 3 > BOARDS * 4 ? NUM_PIXELS * 3 : BOARDS * 4];
+    uint boards = 3;
+    set_encode_mode(ENCODE_TRANSPOSE);
+    int first_raster = fill_simulated_boards(boards);
+
+    // Board by board, as _show_pixels_internal does with OUTPUT_SCHEDULE_OVERLAP
+    piosim_init(&sim);
+    piosim_sm_config(&sim, 0, plane_program_instructions, sizeof(plane_program_instructions) / sizeof(plane_program_instructions[0]),
+                     plane_program_wrap_target, plane_program_wrap);
+    piosim_sm_set_out(&sim, 0, PLANE_PIN_BASE, PLANE_PIN_COUNT, true, true, 32);
+    // GPIO 0-3 stay with the CPU for the board address
+    piosim_set_pio_pins(&sim, STRIP_PIN_BASE, STRIPS);
+    piosim_sm_enable(&sim, 0);
+    uint64_t start = now_ns();
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        for (uint pin = 0; pin < BOARD_SELECT_PIN_COUNT; pin++)
+        {
+            piosim_gpio_put(&sim, BOARD_SELECT_PIN_BASE + pin, (board >> pin) & 1u);
+        }
+        fill_fragment_list(fragments, plane_buffer(current_buffer, board), NUM_PIXELS * 3);
+        piosim_dma_start(&sim, segments, piosim_fragment_segments(segments, fragments, VALUE_WORD_COUNT, 0));
+        assert(piosim_run_until_drained(&sim, 0, 1000000));
+    }
+    piosim_latch(&sim);
+    uint64_t elapsed = now_ns() - start;
+    check_simulated_output(&sim, first_raster, boards);
+    printf("Simulated fragment output: %.1f us/frame, simulated at %.1f Mcycles/s\n",
+           (double)sim.cycle * PIOSIM_CYCLE_NS / 1000.0, (double)sim.cycle * 1000.0 / elapsed);
+
+    // The whole frame from one chain, as OUTPUT_SCHEDULE_CHAINED does
+    static uint32_t address_words[BOARDS];
+    uint32_t bits_word = NUM_PIXELS * 3 * VALUE_PLANE_COUNT - 1;
+    uint32_t gap_word = 0;
+    uint32_t frame_gap_word = PIOSIM_RESET_CYCLES / 10 - 1;
+    uint count = 0;
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        address_words[board] = board;
+        segments[count++] = (piosim_segment_t){&address_words[board], 1, 1};
+        segments[count++] = (piosim_segment_t){&bits_word, 1, 0};
+        segments[count++] = (piosim_segment_t){(const uint32_t *)plane_buffer(current_buffer, board), NUM_PIXELS * 3 * VALUE_WORD_COUNT, 0};
+        segments[count++] = (piosim_segment_t){board == BOARDS - 1 ? &frame_gap_word : &gap_word, 1, 0};
+    }
+    piosim_init(&sim);
+    piosim_sm_config(&sim, 0, chained_program_instructions, sizeof(chained_program_instructions) / sizeof(chained_program_instructions[0]),
+                     chained_program_wrap_target, chained_program_wrap);
+    piosim_sm_set_out(&sim, 0, STRIP_PIN_BASE, STRIPS, true, true, 32);
+    piosim_sm_config(&sim, 1, board_select_program_instructions, sizeof(board_select_program_instructions) / sizeof(board_select_program_instructions[0]),
+                     board_select_wrap_target, board_select_wrap);
+    piosim_sm_set_out(&sim, 1, BOARD_SELECT_PIN_BASE, BOARD_SELECT_PIN_COUNT, true, true, BOARD_SELECT_PIN_COUNT);
+    piosim_set_pio_pins(&sim, BOARD_SELECT_PIN_BASE, BOARD_SELECT_PIN_COUNT);
+    piosim_set_pio_pins(&sim, STRIP_PIN_BASE, STRIPS);
+    piosim_sm_enable(&sim, 0);
+    piosim_sm_enable(&sim, 1);
+    piosim_dma_start(&sim, segments, count);
+    // board_select waits for the next address once the last board and the frame gap are out
+    assert(piosim_run_until_drained(&sim, 1, 10000000));
+    piosim_latch(&sim);
+    check_simulated_output(&sim, first_raster, boards);
+    printf("Simulated chained output: %.1f us/frame\n", (double)sim.cycle * PIOSIM_CYCLE_NS / 1000.0);
+}
+
+// Golden frames: deterministic scenes rendered through the raster API, whose bit planes must match the
+// golden file byte for byte. Run with UPDATE_GOLDEN=1 to rewrite the file after an intended layout change.
+#ifndef GOLDEN_DIR
+#define GOLDEN_DIR "golden"
+#endif
+#if PACKED_PLANES
+#define GOLDEN_FILE "frames16.bin"
+#else
+#define GOLDEN_FILE "frames32.bin"
+#endif
+#define GOLDEN_MAGIC 0x46474250 // "PBGF"
+#define GOLDEN_NAME_LENGTH 32
+#define GOLDEN_FRAME_WORDS (BOARDS * BOARD_PLANE_BYTES / sizeof(uint32_t))
+
+typedef struct
+{
+    const char *name;
+    void (*render)();
+} golden_scene_t;
+
+// Same colors on every platform, unlike rand()
+static uint32_t golden_state;
+
+static uint32_t golden_random()
+{
+    golden_state ^= golden_state << 13;
+    golden_state ^= golden_state >> 17;
+    golden_state ^= golden_state << 5;
+    return golden_state;
+}
+
+static int golden_raster(uint16_t height, uint16_t width, uint board, uint strip, uint pixel, WrapMode wrap, uint32_t seed)
+{
+    int obj = create_raster(height, width, board, strip, pixel, wrap);
+    raster_object_t ro = get_raster(obj);
+    golden_state = seed;
+    for (int i = 0; i < ro.height; i++)
+        for (int j = 0; j < ro.width; j++)
+            ro.raster[i][j] = golden_random() & 0xffffff;
+    return obj;
+}
+
+static void scene_clip_rect()
+{
+    show_raster_object(golden_raster(6, 24, 2, 5, 37, CLIP, 1));
+}
+
+static void scene_rainbow_strip()
+{
+    int obj = create_raster(1, 30, 0, 0, 0, CLIP);
+    init_rainbow(obj);
+    show_raster_object(obj);
+}
+
+static void scene_wrap_zigzag()
+{
+    show_raster_object(golden_raster(2, 25, 3, 12, 0, WRAP, 2));
+}
+
+// Runs off the last strip of board 4 onto board 5
+static void scene_no_wrap_span()
+{
+    show_raster_object(golden_raster(2, 40, 4, 15, 70, NO_WRAP, 3));
+}
+
+static void scene_shifted()
+{
+    show_raster_object_with_shift(golden_raster(STRIPS, 20, 6, 0, 0, CLIP, 4), 0.3f, 0.7f);
+}
+
+static void scene_dirty_update()
+{
+    int obj = golden_raster(STRIPS, 20, 7, 0, 10, CLIP, 5);
+    show_raster_object(obj);
+    draw_pixel(obj, 3, 0, 0xffffff);
+    draw_pixel(obj, 3, 9, 0x00ff00);
+    draw_pixel(obj, 19, 15, 0x0000ff);
+    show_raster_object_dirty(obj);
+}
+
+// Two rasters covering some of the same strips of the same pixel indexes, the second one wins
+static void scene_overlap()
+{
+    show_raster_object(golden_raster(4, 10, 8, 2, 5, CLIP, 6));
+    show_raster_object(golden_raster(4, 10, 8, 4, 8, CLIP, 7));
+}
+
+static void scene_faded_fill()
+{
+    int obj = create_raster(STRIPS, NUM_PIXELS, 9, 0, 0, CLIP);
+    fill_raster(obj, 0x40a0ff);
+    fade_raster(obj, 64);
+    show_raster_object(obj);
+}
+
+static const golden_scene_t golden_scenes[] = {
+    {"clip_rect", scene_clip_rect},
+    {"rainbow_strip", scene_rainbow_strip},
+    {"wrap_zigzag", scene_wrap_zigzag},
+    {"no_wrap_span", scene_no_wrap_span},
+    {"shifted", scene_shifted},
+    {"dirty_update", scene_dirty_update},
+    {"overlap", scene_overlap},
+    {"faded_fill", scene_faded_fill},
+};
+
+// A frame is stored as runs of zero words, each followed by a run of literal words
+static void write_golden_frame(FILE *f, const uint32_t *words)
+{
+    uint32_t i = 0;
+    while (i < GOLDEN_FRAME_WORDS)
+    {
+        uint32_t zeros = 0;
+        while (i + zeros < GOLDEN_FRAME_WORDS && words[i + zeros] == 0)
+            zeros++;
+        uint32_t start = i + zeros;
+        uint32_t literals = 0;
+        while (start + literals < GOLDEN_FRAME_WORDS && words[start + literals] != 0)
+            literals++;
+        fwrite(&zeros, sizeof(zeros), 1, f);
+        fwrite(&literals, sizeof(literals), 1, f);
+        fwrite(&words[start], sizeof(uint32_t), literals, f);
+        i = start + literals;
+    }
+}
+
+static bool read_golden_frame(FILE *f, uint32_t *words)
+{
+    uint32_t i = 0;
+    while (i < GOLDEN_FRAME_WORDS)
+    {
+        uint32_t zeros, literals;
+        if (fread(&zeros, sizeof(zeros), 1, f) != 1 || fread(&literals, sizeof(literals), 1, f) != 1)
+            return false;
+        if (zeros + literals > GOLDEN_FRAME_WORDS - i)
+            return false;
+        memset(&words[i], 0, zeros * sizeof(uint32_t));
+        i += zeros;
+        if (fread(&words[i], sizeof(uint32_t), literals, f) != literals)
+            return false;
+        i += literals;
+    }
+    return true;
+}
+
+// Print where the current buffer first differs from expected, returns true if it doesn't
+static bool check_golden_frame(const char *scene, const char *mode, const uint32_t *expected)
+{
+    const uint32_t *actual = (const uint32_t *)board_planes[current_buffer][0];
+    for (uint32_t i = 0; i < GOLDEN_FRAME_WORDS; i++)
+    {
+        if (actual[i] != expected[i])
+        {
+            uint32_t board_words = GOLDEN_FRAME_WORDS / BOARDS;
+            uint32_t value = i % board_words / VALUE_WORD_COUNT;
+            printf("Golden frame %s (%s) differs at board %u pixel %u channel %u word %u: %08x, expected %08x\n",
+                   scene, mode, i / board_words, value / 3, value % 3, (uint)(i % VALUE_WORD_COUNT), actual[i], expected[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_golden_frames()
+{
+    static uint32_t expected[GOLDEN_FRAME_WORDS];
+    const uint32_t scene_count = sizeof(golden_scenes) / sizeof(golden_scenes[0]);
+    const uint32_t header[6] = {GOLDEN_MAGIC, sizeof(plane_word_t), BOARDS, STRIPS, NUM_PIXELS, scene_count};
+    const EncodeMode modes[2] = {ENCODE_PUT_PIXEL, ENCODE_TRANSPOSE};
+    const char *mode_names[2] = {"put_pixel", "transpose"};
+    bool update = getenv("UPDATE_GOLDEN") != NULL;
+
+    const char *path = GOLDEN_DIR "/" GOLDEN_FILE;
+    FILE *f = fopen(path, update ? "wb" : "rb");
+    if (f == NULL)
+    {
+        printf("Can't open %s, run with UPDATE_GOLDEN=1 to create it\n", path);
+        assert(f != NULL);
+    }
+    if (update)
+    {
+        fwrite(header, sizeof(header), 1, f);
+    }
+    else
+    {
+        uint32_t file_header[6];
+        assert(fread(file_header, sizeof(file_header), 1, f) == 1);
+        // Golden frames are only kept for the default geometry
+        assert(memcmp(header, file_header, sizeof(header)) == 0);
+    }
+
+    bool matched = true;
+    for (uint32_t s = 0; s < scene_count; s++)
+    {
+        char name[GOLDEN_NAME_LENGTH] = {0};
+        strncpy(name, golden_scenes[s].name, GOLDEN_NAME_LENGTH - 1);
+        if (!update)
+        {
+            char file_name[GOLDEN_NAME_LENGTH];
+            assert(fread(file_name, sizeof(file_name), 1, f) == 1);
+            assert(memcmp(name, file_name, sizeof(name)) == 0);
+            assert(read_golden_frame(f, expected));
+        }
+        for (int m = 0; m < 2; m++)
+        {
+            memset(board_planes[current_buffer][0], 0, FRAME_PLANE_BYTES);
+            set_encode_mode(modes[m]);
+            golden_scenes[s].render();
+            if (update && m == 0)
+            {
+                // Both encoders still have to agree on the new frame
+                memcpy(expected, board_planes[current_buffer][0], sizeof(expected));
+                fwrite(name, sizeof(name), 1, f);
+                write_golden_frame(f, expected);
+            }
+            matched &= check_golden_frame(name, mode_names[m], expected);
+        }
+    }
+    fclose(f);
+    set_encode_mode(ENCODE_PUT_PIXEL);
+    fflush(stdout);
+    assert(matched);
+    printf("%s %u golden frames in %s\n", update ? "Wrote" : "Matched", scene_count, path);
+}
+
+// Incremental show must produce the same planes as a full show, while encoding only the dirty pixels
+void test_trace_ring()
+{
+    static trace_record_t records[TRACE_RECORDS];
+    trace_start();
+    for (uint frame = 0; frame < 3; frame++)
+    {
+        trace_event(TRACE_RENDER_START, frame);
+        hal_busy_wait_us(100);
+        trace_event(TRACE_RENDER_END, frame);
+        trace_event(TRACE_FRAME_END, frame);
+    }
+    uint32_t count = trace_snapshot(records, TRACE_RECORDS);
+    assert(count == 9);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        assert(records[i].sequence == i + 1);
+        assert(records[i].event == (uint16_t)(i % 3 == 0 ? TRACE_RENDER_START : i % 3 == 1 ? TRACE_RENDER_END : TRACE_FRAME_END));
+        assert(records[i].arg == i / 3);
+        if (i > 0)
+            assert(records[i].time_us >= records[i - 1].time_us);
+    }
+    trace_summary_t summary = trace_summarize();
+    assert(summary.events == 9 && summary.dropped == 0 && summary.frames == 3);
+    assert(summary.render_p50_us >= 100);
+    assert(summary.frame_p50_us >= 100 && summary.frame_max_us >= summary.frame_p99_us);
+
+    // The ring keeps the most recent TRACE_RECORDS events
+    for (uint i = 0; i < TRACE_RECORDS + 10; i++)
+    {
+        trace_event(TRACE_SWAP_START, i);
+    }
+    count = trace_snapshot(records, TRACE_RECORDS);
+    assert(count == TRACE_RECORDS);
+    // The 9 frame events and the first 10 swaps were overwritten
+    assert(records[0].sequence == 20 && records[0].arg == 10);
+    assert(records[count - 1].arg == TRACE_RECORDS + 9);
+    summary = trace_summarize();
+    assert(summary.events == TRACE_RECORDS + 19 && summary.dropped == 19);
+
+    trace_stop();
+    trace_event(TRACE_SWAP_END, 0);
+    assert(trace_summarize().events == TRACE_RECORDS + 19);
+    printf("Trace ring: ok\n");
+}
+
+// Rasters queued for parallel encode and encoded a board at a time match show_raster_object
+void test_parallel_encode()
+{
+    static value_bits_t expected[2][NUM_PIXELS * 3];
+    int full = create_raster(STRIPS, NUM_PIXELS, 1, 0, 0, CLIP);
+    int shifted = create_raster(STRIPS, NUM_PIXELS / 2, 2, 0, NUM_PIXELS / 4, CLIP);
+    srand(17);
+    for (int id = full; id <= shifted; id++)
+    {
+        raster_object_t ro = get_raster(id);
+        for (int i = 0; i < ro.height; i++)
+            for (int j = 0; j < ro.width; j++)
+                ro.raster[i][j] = rand() & 0xffffff;
+    }
+    set_encode_mode(ENCODE_TRANSPOSE);
+    memset(board_planes[current_buffer][0], 0, FRAME_PLANE_BYTES);
+    show_raster_object(full);
+    show_raster_object_with_shift(shifted, 0.3f, 0.6f);
+    memcpy(expected[0], plane_buffer(current_buffer, 1), sizeof(expected[0]));
+    memcpy(expected[1], plane_buffer(current_buffer, 2), sizeof(expected[1]));
+
+    memset(board_planes[current_buffer][0], 0, FRAME_PLANE_BYTES);
+    set_parallel_encode(true);
+    show_raster_object(full);
+    show_raster_object_with_shift(shifted, 0.3f, 0.6f);
+    // Only queued
+    for (uint i = 0; i < NUM_PIXELS * 3; i++)
+        assert(plane_buffer(current_buffer, 1)[i].planes[0] == 0);
+    // In the order core 1 could take them
+    for (int board = BOARDS - 1; board >= 0; board--)
+        encode_queued_board(board);
+    clear_frame_shows();
+    set_parallel_encode(false);
+    assert(memcmp(expected[0], plane_buffer(current_buffer, 1), sizeof(expected[0])) == 0);
+    assert(memcmp(expected[1], plane_buffer(current_buffer, 2), sizeof(expected[1])) == 0);
+    printf("Parallel encode: ok\n");
+}
+
+// Only boards whose planes differ from the frame before are reported changed
+void test_changed_boards()
+{
+    BufferCopyMode copy_mode = get_buffer_copy_mode();
+    set_buffer_copy_mode(BUFFER_COPY_FULL);
+    int raster = create_raster(STRIPS, NUM_PIXELS, 3, 0, 0, CLIP);
+    fill_raster(raster, 0x102030);
+    show_raster_object(raster);
+    swap_buffers();
+    assert(changed_boards(NULL) == 0);
+
+    // Written again with the same colors
+    show_raster_object(raster);
+    assert(changed_boards(NULL) == 0);
+    swap_buffers();
+
+    // Only sent up to the changed pixel
+    uint16_t send_values[BOARDS];
+    draw_pixel(raster, 5, 2, 0x405060);
+    show_raster_object(raster);
+    assert(changed_boards(send_values) == 1u << 3);
+    assert(send_values[3] == 6 * 3 && send_values[2] == 0);
+    swap_buffers();
+    assert(changed_boards(NULL) == 0);
+    set_buffer_copy_mode(copy_mode);
+    printf("Changed boards: ok\n");
+}
+
+// Strips shorter than NUM_PIXELS and boards that aren't there
+void test_geometry()
+{
+    geometry_t g;
+    default_geometry(&g);
+    uint32_t full_bytes = geometry_arena_bytes();
+    g.strips[2] = 0;
+    g.pixels[4][0] = 50;
+    g.pixels[4][1] = 50;
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
+    assert(present_boards() == (((1u << BOARDS) - 1) & ~(1u << 2)));
+    assert(board_pixel_count[2] == 0 && board_pixel_count[4] == NUM_PIXELS);
+    assert(strip_pixels(4, 0) == 50 && strip_pixels(2, 0) == 0 && strip_pixels(4, STRIPS) == 0);
+#if STREAMING_OUTPUT
+    // Each buffer holds one board, as long as the longest
+    assert(buffer_values == NUM_PIXELS * 3 && geometry_arena_bytes() == full_bytes);
+#else
+    // The missing board takes no plane memory
+    assert(plane_buffer(0, 3) - plane_buffer(0, 1) == NUM_PIXELS * 3);
+    assert(buffer_values == (BOARDS - 1) * NUM_PIXELS * 3);
+    assert(geometry_arena_bytes() == full_bytes - 2 * BOARD_PLANE_BYTES);
+#endif
+
+    // WRAP folds at the end of the real strip
+    int wrapped = create_raster(2, 25, 4, 1, 0, WRAP);
+    raster_object_t raster = get_raster(wrapped);
+    assert(raster.pixel_mapping[0][24].pixel == 24 && raster.pixel_mapping[1][0].pixel == 49);
+    assert(raster.pixel_mapping[1][24].pixel == 25 && raster.pixel_mapping[1][24].strip == 1);
+
+    // NO_WRAP runs from the end of board 1 straight onto board 3, none of its pixels go to missing board 2
+    int crossing = create_raster(3, 100, 1, 15, 0, NO_WRAP);
+    raster = get_raster(crossing);
+    assert(raster.plan.source_count == 3 * 100);
+    for (uint y = 0; y < 3; y++)
+    {
+        for (uint x = 0; x < 100; x++)
+            assert(raster.pixel_mapping[y][x].board != 2);
+    }
+    assert(raster.pixel_mapping[0][99].board == 1 && raster.pixel_mapping[0][99].strip == 15);
+    assert(raster.pixel_mapping[1][0].board == 3 && raster.pixel_mapping[1][0].strip == 0 && raster.pixel_mapping[1][0].pixel == 0);
+    assert(raster.pixel_mapping[2][99].board == 3 && raster.pixel_mapping[2][99].strip == 1 && raster.pixel_mapping[2][99].pixel == 99);
+    assert(destroy_raster(crossing) == 0);
+    // As does one placed on the missing board
+    int placed = create_raster(1, 10, 2, 0, 0, NO_WRAP);
+    raster = get_raster(placed);
+    assert(raster.plan.source_count == 10 && raster.pixel_mapping[0][0].board == 3 && raster.pixel_mapping[0][9].pixel == 9);
+    assert(destroy_raster(placed) == 0);
+
+    // A full length row is clipped at the end of the strip. Queued and encoded a board at a time, as the
+    // streaming build does.
+    int clipped = create_raster(1, NUM_PIXELS, 4, 0, 0, CLIP);
+    fill_raster(clipped, 0xffffff);
+    set_parallel_encode(true);
+    show_raster_object(clipped);
+    encode_queued_board(4);
+    clear_frame_shows();
+    set_parallel_encode(false);
+    value_bits_t *planes = plane_buffer(current_buffer, 4);
+    assert(planes[49 * 3].planes[0] & (1u << PLANE_STRIP_SHIFT));
+    assert(!(planes[50 * 3].planes[0] & (1u << PLANE_STRIP_SHIFT)));
+    assert(get_raster(clipped).plan.source_count == 50);
+
+    // Nothing is mapped on a board that isn't present
+    int absent = create_raster(1, NUM_PIXELS, 2, 0, 0, CLIP);
+    assert(get_raster(absent).plan.source_count == 0);
+
+    g.pixels[0][0] = NUM_PIXELS + 1;
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == -1);
+    assert(strip_pixels(0, 0) == NUM_PIXELS);
+    g.pixels[0][0] = NUM_PIXELS;
+    g.strips[0] = STRIPS + 1;
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == -1);
+    memset(g.strips, 0, sizeof(g.strips));
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == -1);
+
+    // The raster table holds what was asked for
+    default_geometry(&g);
+    assert(init_geometry(&g, 2, TEST_RASTER_POOL_BYTES) == 0);
+    assert(create_raster(1, 1, 0, 0, 0, CLIP) == 0 && create_raster(1, 1, 0, 0, 1, CLIP) == 1);
+    assert(create_raster(1, 1, 0, 0, 2, CLIP) == -1);
+    assert(get_raster(2).height == 0);
+
+    // The frame show queue is as long as the raster table, past MAX_RASTER_OBJECTS too
+    uint rasters = MAX_RASTER_OBJECTS + 20;
+    assert(init_geometry(&g, rasters, TEST_RASTER_POOL_BYTES) == 0);
+    set_parallel_encode(true);
+    for (uint k = 0; k < rasters; k++)
+    {
+        int id = create_raster(1, 1, k / STRIPS, k % STRIPS, 0, CLIP);
+        fill_raster(id, 0xffffff);
+        show_raster_object(id);
+    }
+    // Checked as each board is encoded, streaming builds reuse the board buffers
+    for (uint board = 0; board < BOARDS; board++)
+    {
+        encode_queued_board(board);
+        for (uint k = board * STRIPS; k < rasters && k < (board + 1) * STRIPS; k++)
+            assert(plane_buffer(current_buffer, board)[0].planes[0] & (1u << (k % STRIPS + PLANE_STRIP_SHIFT)));
+    }
+    clear_frame_shows();
+    set_parallel_encode(false);
+
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
+    assert(geometry_arena_bytes() == full_bytes);
+    assert(present_boards() == (1u << BOARDS) - 1);
+
+    // Laying out again drops the rasters and the shows still queued for them. A raster that gets a
+    // queued raster's id isn't encoded by the old show.
+    set_parallel_encode(true);
+    int queued = create_raster(1, NUM_PIXELS, 0, 0, 0, CLIP);
+    fill_raster(queued, 0xffffff);
+    show_raster_object(queued);
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
+    assert(raster_object_count == -1);
+    int reused = create_raster(1, NUM_PIXELS, 0, 0, 0, CLIP);
+    assert(reused == queued);
+    fill_raster(reused, 0xffffff);
+    encode_queued_board(0);
+    set_parallel_encode(false);
+    for (uint i = 0; i < NUM_PIXELS * 3; i++)
+        assert(plane_buffer(current_buffer, 0)[i].planes[0] == 0);
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
+    printf("Geometry: ok\n");
+}
+
+// Rasters destroyed and resized at runtime reuse their ids and leave the pool packed
+void test_raster_lifecycle()
+{
+    geometry_t g;
+    default_geometry(&g);
+    assert(init_geometry(&g, 4, 8 * 1024) == 0);
+    int a = create_raster(4, 10, 0, 0, 0, CLIP);
+    int b = create_raster(2, 5, 1, 0, 0, CLIP);
+    int c = create_raster(3, 3, 2, 0, 0, CLIP);
+    assert(a == 0 && b == 1 && c == 2);
+    fill_raster(b, 0x123456);
+    uint32_t used = raster_pool_used;
+
+    // The rasters after a destroyed one move down over it
+    uint32_t a_bytes = get_raster(a).storage_bytes;
+    assert(destroy_raster(a) == 0);
+    assert(raster_pool_used == used - a_bytes);
+    raster_object_t moved = get_raster(b);
+    assert(moved.storage == raster_pool && moved.raster[1][4] == 0x123456);
+    assert(moved.pixel_mapping[1][4].board == 1 && moved.pixel_mapping[1][4].strip == 1);
+    assert(get_raster(a).raster == NULL);
+    assert(destroy_raster(a) == -1 && compile_raster(a) == -1);
+    draw_pixel(a, 0, 0, 0xffffff);
+
+    // The id is reused
+    assert(create_raster(4, 10, 0, 0, 0, CLIP) == a);
+    assert(raster_pool_used == used);
+
+    // Resizing keeps the pixels both sizes share and maps the rest
+    assert(resize_raster(b, 4, 8) == 0);
+    raster_object_t resized = get_raster(b);
+    assert(resized.height == 4 && resized.width == 8);
+    assert(resized.raster[1][4] == 0x123456 && resized.raster[1][5] == 0 && resized.raster[3][0] == 0);
+    assert(resized.plan.source_count == 32 && resized.pixel_mapping[3][7].strip == 3);
+    assert(resize_raster(b, 2, 5) == 0);
+    assert(get_raster(b).raster[1][4] == 0x123456 && raster_pool_used == used);
+
+    // The plan is the end of the raster's block. Compiling an edited mapping again resizes it there and
+    // moves the blocks after it.
+    raster_object_t planned = get_raster(b);
+    assert((uint8_t *)planned.plan.sources > planned.storage);
+    assert((uint8_t *)(planned.plan.columns + planned.plan.column_count) <= planned.storage + planned.storage_bytes);
+    assert(get_raster(c).storage == raster_pool);
+    raster_object_t *edited = get_raster_handle(c);
+    pixel_address_t saved = edited->pixel_mapping[0][0];
+    edited->pixel_mapping[0][0] = (pixel_address_t){2, 0, 50};
+    assert(compile_raster(c) == 0 && edited->plan.column_count == 4 && raster_pool_used > used);
+    planned = get_raster(b);
+    assert(planned.raster[1][4] == 0x123456 && planned.plan.source_count == 10);
+    assert(planned.plan.sources[planned.plan.columns[4].first_source].x == 4);
+    edited->pixel_mapping[0][0] = saved;
+    assert(compile_raster(c) == 0 && edited->plan.column_count == 3 && raster_pool_used == used);
+
+    // A raster that doesn't fit takes nothing
+    assert(create_raster(STRIPS, NUM_PIXELS, 3, 0, 0, CLIP) == -1);
+    assert(resize_raster(c, STRIPS, NUM_PIXELS) == -1 && get_raster(c).height == 3);
+    assert(raster_pool_used == used);
+    assert(create_raster(1, 1, 3, 0, 0, CLIP) == 3);
+    assert(create_raster(1, 1, 3, 0, 1, CLIP) == -1);
+
+    // Swapping layouts indefinitely takes no more memory
+    for (int i = 0; i < 1000; i++)
+    {
+        assert(destroy_raster(c) == 0);
+        c = create_raster(1 + i % 3, 1 + i % 7, 2, 0, 0, WRAP);
+        assert(c >= 0 && resize_raster(a, 1 + i % 4, 10) == 0);
+    }
+    assert(destroy_raster(c) == 0 && create_raster(3, 3, 2, 0, 0, CLIP) == c);
+    assert(resize_raster(a, 4, 10) == 0 && raster_pool_used == used + get_raster(3).storage_bytes);
+
+    // A destroyed raster is dropped from the shows queued for the frame
+    set_parallel_encode(true);
+    show_raster_object(b);
+    show_raster_object(c);
+    assert(destroy_raster(b) == 0);
+    for (uint board = 0; board < BOARDS; board++)
+        encode_queued_board(board);
+    clear_frame_shows();
+    set_parallel_encode(false);
+
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
+    printf("Raster lifecycle: ok\n");
+}
+
+// The scene ws2812_parallel.c and pipeline.c show, in the pool they give it
+void test_demo_scene()
+{
+    geometry_t g;
+    default_geometry(&g);
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, RASTER_POOL_BYTES) == 0);
+    int board1 = create_raster(16, 100, 0, 0, 0, CLIP);
+    int board2 = create_raster(16, 100, BOARDS - 1, 0, 0, CLIP);
+    assert(board1 >= 0 && board2 >= 0);
+    assert(get_raster(board2).plan.source_count == STRIPS * NUM_PIXELS && get_raster(board2).plan.column_count == NUM_PIXELS);
+    init_rainbow(board1);
+    init_rainbow(board2);
+
+    // Every pixel of the last board has a channel at full brightness
+    static value_bits_t values[NUM_PIXELS * 3];
+    set_parallel_encode(true);
+    show_raster_object(board1);
+    show_raster_object(board2);
+    encode_frame_board(BOARDS - 1, values);
+    clear_frame_shows();
+    set_parallel_encode(false);
+    for (uint pixel = 0; pixel < NUM_PIXELS; pixel++)
+    {
+        plane_word_t msb = values[pixel * 3].planes[0] | values[pixel * 3 + 1].planes[0] | values[pixel * 3 + 2].planes[0];
+        assert(msb == (plane_word_t)(0xffffu << PLANE_STRIP_SHIFT));
+    }
+
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
+    printf("Demo scene: ok\n");
+}
+
+// Flat accessors, the row pointer view and handles all see the same pixels
+void test_raster_access()
+{
+    int before = create_raster(2, 2, 0, 0, 0, CLIP);
+    int id = create_raster(3, 5, 0, 0, 0, CLIP);
+    raster_object_t *raster = get_raster_handle(id);
+    assert(raster != NULL && get_raster_handle(-1) == NULL && get_raster_handle(MAX_RASTER_OBJECTS) == NULL);
+    raster_set(raster, 4, 2, 0x010203);
+    assert(raster->pixels[2 * 5 + 4] == 0x010203 && raster->raster[2][4] == 0x010203);
+    assert(get_raster(id).raster[2][4] == 0x010203 && raster_get(raster, 4, 2) == 0x010203);
+    raster_row(raster, 1)[3] = 0x040506;
+    assert(raster_get(raster, 3, 1) == 0x040506 && raster->mapping[1 * 5 + 3].strip == 1);
+    // Out of range is ignored
+    raster_set(raster, 5, 0, 0xffffff);
+    raster_set(raster, 0, -1, 0xffffff);
+    assert(raster_get(raster, 5, 0) == 0 && raster_get(raster, 0, 3) == 0 && raster->pixels[5] == 0);
+    draw_pixel(id, 0, 0, 0x070809);
+    assert(raster_get(raster, 0, 0) == 0x070809 && raster->dirty_x0[0] == 0);
+
+    // The handle follows the raster when the pool moves
+    assert(destroy_raster(before) == 0);
+    assert(get_raster_handle(id) == raster && raster->raster[2][4] == 0x010203 && raster_get(raster, 3, 1) == 0x040506);
+    assert(destroy_raster(id) == 0);
+    printf("Raster access: ok\n");
+}
+
+// Palette and RGB565 rasters encode the same planes as an RGB888 raster of the colors they expand to
+void test_raster_formats()
+{
+    EncodeMode mode = get_encode_mode();
+    int direct = create_raster(STRIPS, NUM_PIXELS, 5, 0, 0, CLIP);
+    int indexed = create_raster_format(STRIPS, NUM_PIXELS, 6, 0, 0, CLIP, RASTER_PALETTE8);
+    int packed = create_raster_format(STRIPS, NUM_PIXELS, 7, 0, 0, CLIP, RASTER_RGB565);
+    raster_object_t *d = get_raster_handle(direct);
+    raster_object_t *p = get_raster_handle(indexed);
+    raster_object_t *h = get_raster_handle(packed);
+    assert(p->pixels == NULL && p->raster == NULL && h->pixels == NULL);
+    assert(p->storage_bytes < h->storage_bytes && h->storage_bytes < d->storage_bytes);
+    assert(set_raster_palette(direct, 0, 1, (uint32_t[]){0}) == -1);
+    assert(set_raster_palette(indexed, 255, 2, (uint32_t[]){0, 0}) == -1);
+
+    uint32_t palette[256];
+    for (uint i = 0; i < 256; i++)
+        palette[i] = rgb565_to_rgb(rgb_to_565(i * 0x3b1d07));
+    assert(set_raster_palette(indexed, 0, 256, palette) == 0);
+    assert(rgb565_to_rgb(0xffff) == 0xffffff && rgb_to_565(0xffffff) == 0xffff);
+    for (uint y = 0; y < STRIPS; y++)
+    {
+        for (uint x = 0; x < NUM_PIXELS; x++)
+        {
+            uint8_t index = (x * 7 + y * 13) & 0xff;
+            draw_pixel(direct, x, y, palette[index]);
+            draw_pixel(indexed, x, y, index);
+            draw_pixel(packed, x, y, palette[index]);
+        }
+    }
+    assert(raster_get(p, 3, 2) == ((3 * 7 + 2 * 13) & 0xff) && raster_get(h, 3, 2) == rgb_to_565(palette[3 * 7 + 2 * 13]));
+    for (uint e = 0; e < 2; e++)
+    {
+        set_encode_mode(e ? ENCODE_TRANSPOSE : ENCODE_PUT_PIXEL);
+        show_raster_object(direct);
+        show_raster_object(indexed);
+        show_raster_object(packed);
+        assert(memcmp(plane_buffer(current_buffer, 5), plane_buffer(current_buffer, 6), BOARD_PLANE_BYTES) == 0);
+        assert(memcmp(plane_buffer(current_buffer, 5), plane_buffer(current_buffer, 7), BOARD_PLANE_BYTES) == 0);
+        show_raster_object_with_shift(direct, 0.3f, 0.6f);
+        show_raster_object_with_shift(indexed, 0.3f, 0.6f);
+        show_raster_object_with_shift(packed, 0.3f, 0.6f);
+        assert(memcmp(plane_buffer(current_buffer, 5), plane_buffer(current_buffer, 6), BOARD_PLANE_BYTES) == 0);
+        assert(memcmp(plane_buffer(current_buffer, 5), plane_buffer(current_buffer, 7), BOARD_PLANE_BYTES) == 0);
+    }
+    set_encode_mode(mode);
+
+    // Cycling the palette moves every pixel along it and marks them all for encoding
+    show_raster_object(indexed);
+    rainbow(indexed);
+    assert(p->palette[0] == palette[1] && p->palette[255] == palette[0]);
+    assert(p->dirty_y0 == 0 && p->dirty_y1 == STRIPS - 1 && p->dirty_x1[3] == NUM_PIXELS - 1);
+    fade_raster(indexed, 0);
+    assert(p->palette[17] == 0 && raster_get(p, 3, 2) == ((3 * 7 + 2 * 13) & 0xff));
+
+    // Resizing keeps the indices and the palette
+    assert(resize_raster(indexed, 4, 10) == 0);
+    p = get_raster_handle(indexed);
+    assert(raster_get(p, 3, 2) == ((3 * 7 + 2 * 13) & 0xff) && p->palette[17] == 0 && p->palette[1] == 0);
+    fill_raster(packed, 0xffffff);
+    assert(raster_get(h, 99, 15) == 0xffff);
+    assert(destroy_raster(direct) == 0 && destroy_raster(indexed) == 0 && destroy_raster(packed) == 0);
+    swap_buffers();
+    printf("Raster formats: ok\n");
+}
+
+static int channel_difference(uint32_t a, uint32_t b)
+{
+    int most = 0;
+    for (int shift = 0; shift < 24; shift += 8)
+    {
+        int d = abs((int)((a >> shift) & 0xff) - (int)((b >> shift) & 0xff));
+        most = d > most ? d : most;
+    }
+    return most;
+}
+
+void test_gradients()
+{
+    // The integer wheel is the float one to within rounding, and a finer table lands on the same colors
+    const gradient_t *wheel = rainbow_gradient();
+    static uint32_t fine_colors[1024];
+    gradient_t fine = {fine_colors, 10};
+    gradient_hsv(&fine, 255, 255);
+    for (uint i = 0; i < 256; i++)
+    {
+        assert(channel_difference(wheel->colors[i], hsl_to_rgb(i / 256.0f, 1.0f, 0.5f)) <= 1);
+        assert(gradient_color(&fine, i << 8) == wheel->colors[i]);
+    }
+    assert(gradient_color(wheel, 0) == 0xff0000 && gradient_color(wheel, 0x8000) == 0x00ffff);
+    gradient_hsl(&fine, 1.0f, 0.5f);
+    assert(fine_colors[512] == hsl_to_rgb(0.5f, 1.0f, 0.5f));
+
+    // Keyframes blend both ways round, the last back to the first
+    uint32_t stop_colors[256];
+    gradient_t stepped = {stop_colors, 8};
+    const gradient_stop_t stops[] = {{0x0000, 0xff0000}, {0x8000, 0x0000ff}};
+    assert(gradient_stops(&stepped, stops, 2) == 0);
+    assert(gradient_color(&stepped, 0) == 0xff0000 && gradient_color(&stepped, 0x8000) == 0x0000ff);
+    assert(gradient_color(&stepped, 0x4000) == 0x7f007f && gradient_color(&stepped, 0xc000) == 0x7f007f);
+    const gradient_stop_t late[] = {{0x4000, 0x00ff00}};
+    assert(gradient_stops(&stepped, late, 1) == 0 && stop_colors[0] == 0x00ff00 && stop_colors[255] == 0x00ff00);
+    const gradient_stop_t unsorted[] = {{0x8000, 0}, {0x4000, 0}};
+    assert(gradient_stops(&stepped, stops, 0) == -1 && gradient_stops(&stepped, unsorted, 2) == -1);
+
+    // The rainbow is the same colors whether the raster stores them or indexes them
+    int direct = create_raster(STRIPS, NUM_PIXELS, 0, 0, 0, CLIP);
+    int indexed = create_raster_format(STRIPS, NUM_PIXELS, 1, 0, 0, CLIP, RASTER_PALETTE8);
+    draw_rainbow(direct, 0x4000);
+    draw_rainbow(indexed, 0x4000);
+    raster_object_t *d = get_raster_handle(direct);
+    raster_object_t *p = get_raster_handle(indexed);
+    for (uint i = 0; i < STRIPS * NUM_PIXELS; i++)
+    {
+        assert(raster_color(d, i) == raster_color(p, i));
+    }
+    uint16_t step_x = 0x10000 / NUM_PIXELS, step_y = 0x10000 / STRIPS;
+    assert(raster_get(d, 0, 0) == wheel->colors[64]);
+    assert(raster_get(d, 7, 3) == gradient_color(wheel, 0x4000 + 7 * step_x + 3 * step_y));
+    init_rainbow(indexed);
+    assert(raster_get(p, 0, 0) == 0 && p->palette[0] == 0xff0000);
+    assert(destroy_raster(direct) == 0 && destroy_raster(indexed) == 0);
+    printf("Gradients: ok\n");
+}
+
+void test_frame_queue()
+{
+    static frame_queue_t queue;
+    frame_t frame;
+    assert(!frame_queue_pop(&queue, &frame));
+    // Run the indices around the ring a few times
+    for (uint32_t round = 0; round < 3; round++)
+    {
+        for (uint32_t i = 0; i < FRAME_QUEUE_DEPTH; i++)
+        {
+            frame = (frame_t){.number = round * FRAME_QUEUE_DEPTH + i, .buffer = i & 1};
+            assert(frame_queue_push(&queue, &frame));
+        }
+        assert(frame_queue_count(&queue) == FRAME_QUEUE_DEPTH);
+        assert(!frame_queue_push(&queue, &frame));
+        for (uint32_t i = 0; i < FRAME_QUEUE_DEPTH; i++)
+        {
+            assert(frame_queue_pop(&queue, &frame));
+            assert(frame.number == round * FRAME_QUEUE_DEPTH + i && frame.buffer == (i & 1));
+        }
+        assert(!frame_queue_pop(&queue, &frame));
+    }
+    printf("Frame queue: ok\n");
+}
+
+void test_log_ring()
+{
+#if PIXELBLIT_LOG
+    while (log_drain(LOG_RECORDS))
+        ;
+    uint32_t dropped = log_dropped();
+    LOG(LOG_RASTER_LIMIT);
+    LOG(LOG_INVALID_RASTER, 7);
+    LOG(LOG_RASTER_CREATED, 1, 16, 100);
+    assert(log_drain(2) == 2);
+    assert(log_drain(LOG_RECORDS) == 1);
+    assert(log_drain(LOG_RECORDS) == 0);
+
+    // Writers that lap the drain drop the oldest messages
+    for (int i = 0; i < LOG_RECORDS + 5; i++)
+    {
+        LOG(LOG_INVALID_RASTER, i);
+    }
+    assert(log_drain(LOG_RECORDS * 2) == LOG_RECORDS);
+    assert(log_dropped() == dropped + 5);
+    printf("Log ring: ok\n");
+#endif
+}
+
+void test_dirty_tracking()
+{
+    int obj = create_raster(STRIPS, NUM_PIXELS, 4, 0, 0, CLIP);
+    static value_bits_t expected[NUM_PIXELS * 3];
+    show_pixels(); // close the frame of the earlier tests
+    for (int mode = ENCODE_PUT_PIXEL; mode <= ENCODE_TRANSPOSE; mode++)
+    {
+        set_encode_mode(mode);
+        init_rainbow(obj);
+        show_raster_object_dirty(obj);
+        show_pixels();
+        assert(get_encode_stats().last_frame_pixels_encoded == STRIPS * NUM_PIXELS);
+
+        // Nothing changed, nothing encoded
+        show_raster_object_dirty(obj);
+        show_pixels();
+        assert(get_encode_stats().last_frame_pixels_encoded == 0);
+
+        // A few sparkles, two of them on the same pixel index
+        draw_pixel(obj, 3, 0, 0xffffff);
+        draw_pixel(obj, 3, 7, 0xffffff);
+        draw_pixel(obj, 50, 2, 0x00ff00);
+        raster_object_t ro = get_raster(obj);
+        ro.raster[9][80] = 0x0000ff;
+        mark_raster_dirty(obj, 80, 9);
+        show_raster_object_dirty(obj);
+        show_pixels();
+        // The transpose encoder rewrites all strips of a touched pixel index
+        uint32_t expected_pixels = mode == ENCODE_TRANSPOSE ? 3 * STRIPS : 4;
+        assert(get_encode_stats().last_frame_pixels_encoded == expected_pixels);
+
+        memcpy(expected, plane_buffer(current_buffer, 4), sizeof(expected));
+        show_raster_object(obj);
+        show_pixels();
+        assert(memcmp(expected, plane_buffer(current_buffer, 4), sizeof(expected)) == 0);
+        printf("Dirty show encoded %d of %d pixels\n", expected_pixels, STRIPS * NUM_PIXELS);
+    }
+    set_encode_mode(ENCODE_PUT_PIXEL);
+}
+
+// Bytes copied between the double buffers per frame for each buffer copy mode.
+// The scene animates one board, holds a second one static and sparkles a few pixels on a third.
+void benchmark_buffer_copy()
+{
+    int animated = create_raster(STRIPS, NUM_PIXELS, 0, 0, 0, CLIP);
+    int still = create_raster(STRIPS, NUM_PIXELS, 9, 0, 0, CLIP);
+    int sparkle = create_raster(STRIPS, NUM_PIXELS, 5, 0, 0, CLIP);
+    init_rainbow(animated);
+    init_rainbow(still);
+    const char *names[] = {"full", "written", "none"};
+    int frames = 200;
+
+    set_encode_mode(ENCODE_TRANSPOSE);
+    for (int mode = BUFFER_COPY_FULL; mode <= BUFFER_COPY_NONE; mode++)
+    {
+        // Start with both buffers in sync
+        set_buffer_copy_mode(BUFFER_COPY_FULL);
+        show_all_raster_objects();
+        set_buffer_copy_mode(mode);
+
+        uint64_t copied = 0;
+        uint64_t swap_ns = 0;
+        srand(2);
+        for (int frame = 0; frame < frames; frame++)
+        {
+            rainbow(animated);
+            draw_pixel(sparkle, rand() % NUM_PIXELS, rand() % STRIPS, 0xffffff);
+            if (mode == BUFFER_COPY_NONE)
+            {
+                // Nothing is carried over, so everything shown is rewritten
+                show_raster_object(animated);
+                show_raster_object(still);
+                show_raster_object(sparkle);
+            }
+            else
+            {
+                show_raster_object_dirty(animated);
+                show_raster_object_dirty(still);
+                show_raster_object_dirty(sparkle);
+            }
+            uint64_t start = now_ns();
+            show_pixels();
+            swap_ns += now_ns() - start;
+            copied += get_encode_stats().last_swap_bytes_copied;
+        }
+        // When copying, the buffer about to be encoded into must hold the frame just shown
+        for (int board = 0; mode != BUFFER_COPY_NONE && board < BOARDS; board++)
+        {
+            assert(memcmp(plane_buffer(0, board), plane_buffer(1, board), BOARD_PLANE_BYTES) == 0);
+        }
+        printf("Buffer copy %s: %llu bytes/frame, %.2f us/swap\n", names[mode], (unsigned long long)(copied / frames), swap_ns / 1000.0 / frames);
+    }
+    set_buffer_copy_mode(BUFFER_COPY_FULL);
+    set_encode_mode(ENCODE_PUT_PIXEL);
+}
+
+// NO_WRAP lays the raster out as one line, row after row, carrying on along the next strip and board
+// at the end of each strip. The original expectations in main had each row restarting at the raster's
+// first pixel, which neither create_raster nor the readme describe.
+void test_no_wrap_fill()
+{
+    const struct
+    {
+        uint16_t height, width;
+        uint board, strip, pixel;
+    } cases[] = {
+        {6, 25, 0, 0, 0},   // rows divide the strip
+        {20, 75, 0, 0, 0},  // rows straddle strips
+        {12, 75, 1, 4, 0},  // from a later board and strip
+        {3, 90, 2, 15, 40}, // from mid strip, onto the next board
+    };
+    for (uint c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        int id = create_raster(cases[c].height, cases[c].width, cases[c].board, cases[c].strip, cases[c].pixel, NO_WRAP);
+        raster_object_t raster = get_raster(id);
+        uint start = (cases[c].board * STRIPS + cases[c].strip) * NUM_PIXELS + cases[c].pixel;
+        for (uint y = 0; y < raster.height; y++)
+        {
+            for (uint x = 0; x < raster.width; x++)
+            {
+                uint linear = start + y * raster.width + x;
+                pixel_address_t address = raster.pixel_mapping[y][x];
+                assert(address.board == linear / (STRIPS * NUM_PIXELS) % BOARDS);
+                assert(address.strip == linear / NUM_PIXELS % STRIPS);
+                assert(address.pixel == linear % NUM_PIXELS);
+            }
+        }
+        assert(raster.plan.source_count == (uint32_t)raster.height * raster.width);
+        assert(destroy_raster(id) == 0);
+    }
+    printf("NO_WRAP fill: ok\n");
+}
+
 int main()
 {
+    geometry_t g;
+    default_geometry(&g);
+    assert(init_geometry(&g, MAX_RASTER_OBJECTS, TEST_RASTER_POOL_BYTES) == 0);
     printBinary("Test", 0x12345678);
     uint obj = create_raster(16, 10, 0, 3, 0, CLIP);
     printf("Object: %d\n", obj);
@@ -77,6 +1344,20 @@ int main()
     assert(ro2.pixel_mapping[1][0].pixel == 49);
     assert(ro2.pixel_mapping[2][24].pixel == 74);
 
+    // The encode plan visits each physical pixel once, in plane buffer order
+    assert(ro2.plan.column_count == 75);
+    assert(ro2.plan.source_count == 75);
+    for (uint i = 0; i < ro2.plan.column_count; i++)
+    {
+        assert(ro2.plan.columns[i].board == 0);
+        assert(ro2.plan.columns[i].plane_offset == i * 3);
+        assert(ro2.plan.columns[i].strip_mask == 1);
+        assert(ro2.plan.columns[i].first_source == i);
+    }
+    // Pixel 49 is the start of the reversed second row
+    assert(ro2.plan.sources[49].x == 0);
+    assert(ro2.plan.sources[49].y == 1);
+
     uint obj3 = create_raster(6, 25, 0, 0, 0, NO_WRAP);
     printf("Object 3: %d\n", obj);
     raster_object_t ro3 = get_raster(obj3);
@@ -95,12 +1376,12 @@ int main()
     assert(ro3.pixel_mapping[1][0].strip == 0);
     assert(ro3.pixel_mapping[1][0].pixel == 25);
     assert(ro3.pixel_mapping[2][24].pixel == 74);
-    assert(ro3.pixel_mapping[5][24].pixel == 74);
+    assert(ro3.pixel_mapping[5][24].pixel == 49);
     assert(ro3.pixel_mapping[5][24].strip == 1);
 
     // width does not evenly divide NUM_PIXELS, WRAP mode disabled, NO_WRAP defaulting
     // Get same results as above
-    uint obj4 = create_raster(6, 52, 0, 0, 0, WRAP);
+    create_raster(6, 52, 0, 0, 0, WRAP);
     printf("Object 4: %d\n", obj);
     raster_object_t ro4 = get_raster(obj3);
 
@@ -118,7 +1399,7 @@ int main()
     assert(ro3.pixel_mapping[1][0].strip == 0);
     assert(ro3.pixel_mapping[1][0].pixel == 25);
     assert(ro3.pixel_mapping[2][24].pixel == 74);
-    assert(ro3.pixel_mapping[5][24].pixel == 74);
+    assert(ro3.pixel_mapping[5][24].pixel == 49);
     assert(ro3.pixel_mapping[5][24].strip == 1);
 
     uint obj5 = create_raster(20, 75, 0, 0, 0, NO_WRAP);
@@ -128,12 +1409,13 @@ int main()
     assert(ro5.width == 75);
     assert(ro5.raster != NULL);
     assert(ro5.pixel_mapping != NULL);
+    // NO_WRAP fills linearly, see test_no_wrap_fill: row 15 ends at pixel 15 * 75 + 74 = 1199, strip 11 pixel 99
     assert(ro5.pixel_mapping[15][74].board == 0);
-    assert(ro5.pixel_mapping[15][74].strip == 15);
-    assert(ro5.pixel_mapping[15][74].pixel == 74);
-    assert(ro5.pixel_mapping[19][74].board == 1);
-    assert(ro5.pixel_mapping[19][74].strip == 3);
-    assert(ro5.pixel_mapping[19][74].pixel == 74);
+    assert(ro5.pixel_mapping[15][74].strip == 11);
+    assert(ro5.pixel_mapping[15][74].pixel == 99);
+    assert(ro5.pixel_mapping[19][74].board == 0);
+    assert(ro5.pixel_mapping[19][74].strip == 14);
+    assert(ro5.pixel_mapping[19][74].pixel == 99);
 
     uint obj6 = create_raster(12, 75, 1, 4, 0, NO_WRAP);
     printf("Object 6: %d\n", obj);
@@ -146,8 +1428,8 @@ int main()
     assert(ro6.pixel_mapping[0][0].strip == 4);
     assert(ro6.pixel_mapping[0][0].pixel == 0);
     assert(ro6.pixel_mapping[11][74].board == 1);
-    assert(ro6.pixel_mapping[11][74].strip == 15);
-    assert(ro6.pixel_mapping[11][74].pixel == 74);
+    assert(ro6.pixel_mapping[11][74].strip == 12);
+    assert(ro6.pixel_mapping[11][74].pixel == 99);
 
     fill_raster(obj6, 0x00ff00);
     fill_raster(obj5, 0xff0000);
@@ -179,12 +1461,40 @@ int main()
     draw_pixel(obj7, 0, 0, 0x0000ff);
     show_raster_object(obj7);
     printf("Current buffer: %d\n", current_buffer);
-    printBinary("Buffer zerp", buffers[current_buffer][0][2].planes[0]);
+    printBinary("Buffer zerp", plane_buffer(current_buffer, 0)[2].planes[0]);
     fill_raster(obj7, 0x0000ff);
     show_raster_object(obj7);
-    printBinary("Buffer zerp", buffers[current_buffer][0][2].planes[0]);
+    printBinary("Buffer zerp", plane_buffer(current_buffer, 0)[2].planes[0]);
 
-    // assert(buffers[current_buffer][0][0].planes[0] == 0x0000ff);
+#if !STREAMING_OUTPUT
+    // Pixel 0 is on strips 0-11, blue is all ones and red all zeros
+    for (int bit = 0; bit < VALUE_PLANE_COUNT; bit++)
+    {
+        assert(plane_buffer(current_buffer, 0)[0].planes[bit] == 0);
+        assert(plane_buffer(current_buffer, 0)[2].planes[bit] == 0xfffu << PLANE_STRIP_SHIFT);
+    }
+
+    // These check the planes of a whole frame, which the streaming build doesn't keep
+    benchmark_encoders();
+    test_dirty_tracking();
+    benchmark_buffer_copy();
+    test_emitted_waveform();
+    test_output_simulation();
+    test_golden_frames();
+    test_parallel_encode();
+    test_changed_boards();
+#endif
+    test_streamed_boards();
+    test_trace_ring();
+    test_log_ring();
+    test_frame_queue();
+    test_no_wrap_fill();
+    test_geometry();
+    test_raster_lifecycle();
+    test_demo_scene();
+    test_raster_access();
+    test_raster_formats();
+    test_gradients();
 
     return 0;
 }
\ No newline at end of file
@@ -6,6 +6,10 @@
 
 #include "lib/pixelblit.h"
 #include "lib/utils.h"
+#include "lib/encoder.h"
+#include "lib/trace.h"
+#include "lib/log.h"
+#include "lib/geometry.h"
 #include "pico/multicore.h"
 
 void printBinary(const char *description, unsigned int number)
@@ -360,17 +364,32 @@ int main()
     stdio_init_all();
     // sleep_ms(10000);
     printf("Starting\n");
-    initialize_dma();
-    for (int pin = 0; pin <= 3; pin++)
+    // Every board with all its strips at full length, edit this to match the installation
+    geometry_t g;
+    default_geometry(&g);
+    if (init_geometry(&g, MAX_RASTER_OBJECTS, RASTER_POOL_BYTES) != 0)
     {
-        gpio_init(pin);
-        gpio_set_dir(pin, GPIO_OUT); // Set as output
+        log_drain(LOG_RECORDS);
+        while (1)
+            tight_loop_contents();
     }
+    // OUTPUT_SCHEDULE_CHAINED has to be chosen before initialize_dma
+    set_output_schedule(OUTPUT_SCHEDULE_OVERLAP);
+    initialize_dma();
+    set_encode_mode(ENCODE_TRANSPOSE);
+    set_buffer_copy_mode(BUFFER_COPY_WRITTEN);
     int board1 = create_raster(16, 100, 0, 0, 0, CLIP);
     int board2 = create_raster(16, 100, 9, 0, 0, CLIP);
+    if (board1 < 0 || board2 < 0)
+    {
+        log_drain(LOG_RECORDS);
+        while (1)
+            tight_loop_contents();
+    }
 
     init_rainbow(board1);
     init_rainbow(board2);
+    trace_start();
     int time = 0;
     while (1)
     {
@@ -378,13 +397,23 @@ int main()
         //  fill_raster(board2, 0xff0000);
         //  rainbow(board2);
         // sleep_ms(16);
-        printf("Time: %d\n", time);
+        // 'd' dumps the trace ring to stdio, 's' prints its summary
+        int command = getchar_timeout_us(0);
+        if (command == 'd')
+            trace_dump(stdout);
+        else if (command == 's')
+            trace_print_summary();
+
+        trace_event(TRACE_RENDER_START, time);
         float shift_x = fmodf(time * 0.001f, 1.0f); // Move right over time
         float shift_y = fmodf(time * 0.001f, 1.0f);
         show_raster_object_with_shift(board1, shift_x, shift_y);
         show_raster_object_with_shift(board2, shift_x, shift_y);
+        trace_event(TRACE_RENDER_END, time);
 
         show_pixels();
+        // Print what the library logged while core 1 sends the frame
+        log_drain(4);
 
         time++;
     }